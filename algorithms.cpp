@@ -1,65 +1,331 @@
 #include "algorithms.h"
+#include "color_matcher.h"
 
-#include <QPixmap>
 #include <QColor>
 #include <QPoint>
 #include <QImage>
-#include <QPainter>
+#include <QRgba64>
+#include <QtAlgorithms>
+#include <QThreadPool>
+#include <QSemaphore>
 
+#include <algorithm>
 #include <memory>
 #include <iostream>
-#include <queue>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
 
 
-void Algorithms::floodFill(QPainter &painter, const QColor &fillColor, const QPoint & startPos) {
-    const int threshold = 1; 
+constexpr qint64 parallelFillMinPixels = 4096 * 1024;
 
-    auto srcBuffer = static_cast<QPixmap *> (painter.device());
-    auto image = srcBuffer->toImage();
 
-    const int w = image.width();
-    const int h = image.height();
+// Visited flags for a fill, one bit per pixel; each row starts on a word boundary
+class FillMask {
+public:
+    FillMask(int width, int height): m_wordsPerRow((width + 63) / 64), m_bits(static_cast<size_t>(m_wordsPerRow) * height, 0) {}
 
-    bool visited[w][h];
-    memset(visited, false, sizeof(visited));
+    bool test(int x, int y) const {
+        return (m_bits[wordIndex(x, y)] >> (x & 63)) & 1;
+    }
+
+    void set(int x, int y) {
+        m_bits[wordIndex(x, y)] |= (uint64_t {1} << (x & 63));
+    }
+
+    // first x in [from, to] whose flag equals value, to+1 if there is none
+    int find(int y, int from, int to, bool value) const {
+        for (int x = from; x <= to; x = (x | 63) + 1) {
+            uint64_t word = value ? m_bits[wordIndex(x, y)] : ~m_bits[wordIndex(x, y)];
+            word >>= (x & 63);
+            if (word != 0)
+                return std::min(x + (int)qCountTrailingZeroBits(word), to + 1);
+        }
+
+        return to + 1;
+    }
+
+    // first x in [to, from], going down from from, whose flag equals value, to-1 if there is none
+    int findBackward(int y, int from, int to, bool value) const {
+        for (int x = from; x >= to; x = (x & ~63) - 1) {
+            uint64_t word = value ? m_bits[wordIndex(x, y)] : ~m_bits[wordIndex(x, y)];
+            word <<= (63 - (x & 63));
+            if (word != 0)
+                return std::max(x - (int)qCountLeadingZeroBits(word), to - 1);
+        }
+
+        return to - 1;
+    }
+
+private:
+    int m_wordsPerRow;
+    std::vector<uint64_t> m_bits;
+
+    size_t wordIndex(int x, int y) const { return static_cast<size_t>(y) * m_wordsPerRow + (x >> 6); }
+};
+
+
+// pixels x1..x2 of row y, still to be checked
+struct FillSeed {
+    int y;
+    int x1;
+    int x2;
+};
+
+
+// Image, colors and visited flags shared by all the spans of a fill. Each tile is filled
+// on its own, from its own seeds and with its own flags, so that different tiles can be
+// filled concurrently; flags are only allocated for the tiles the fill reaches.
+class FillTarget {
+public:
+    FillTarget(TiledImage &image, const QPoint &startPos, const QColor &fillColor, int tolerance):
+        m_image(image), m_matcher(image.pixel(startPos), tolerance),
+        m_visited(static_cast<size_t>(image.tilesX()) * image.tilesY()) {
+
+        m_fillPixel = fillColor.rgba64().premultiplied().toArgb32();
+    }
+
+    int tileCount() const { return (int)m_visited.size(); }
+    int tileAt(int x, int y) const { return (y / TiledImage::tileSize) * m_image.tilesX() + (x / TiledImage::tileSize); }
+
+    QRect fillTile(int tile, std::vector<FillSeed> &seeds, std::vector<FillSeed> &outSeeds);
+
+private:
+    TiledImage &m_image;
+    ColorMatcher m_matcher;
+    QRgb m_fillPixel;
+
+    std::vector<std::unique_ptr<FillMask>> m_visited; //null for the tiles not reached yet
+
+    // first x in [from, to] that can be filled, to+1 if there is none
+    int findInside(const FillMask &visited, const QRgb *line, int from, int to, int y) const {
+        for (int x = from; x <= to; x++) {
+            x = visited.find(y, x, to, false);
+            if (x > to)
+                break;
+            if (m_matcher.matches(line[x]))
+                return x;
+        }
+
+        return to + 1;
+    }
+
+    // last x in [from, to] such that from..x can all be filled
+    int findRunEnd(const FillMask &visited, const QRgb *line, int from, int to, int y) const {
+        return std::min(m_matcher.findMismatch(line, from, to), visited.find(y, from, to, true)) - 1;
+    }
+
+    // first x in [to, from] such that x..from can all be filled
+    int findRunStart(const FillMask &visited, const QRgb *line, int from, int to, int y) const {
+        return std::max(m_matcher.findMismatchBackward(line, from, to), visited.findBackward(y, from, to, true)) + 1;
+    }
+};
+
+
+// Fills everything reachable from seeds without leaving the tile; the spans found across
+// its borders are moved to outSeeds. Seeds are in document coordinates. Only the pixels
+// of the tile are read or written, and the tile is only copied when a span is filled.
+QRect FillTarget::fillTile(int tile, std::vector<FillSeed> &seeds, std::vector<FillSeed> &outSeeds) {
+    const int tx = tile % m_image.tilesX();
+    const int ty = tile / m_image.tilesX();
+    const QRect bounds = m_image.tileRect(tx, ty);
+
+    if (m_visited[tile] == nullptr)
+        m_visited[tile] = std::make_unique<FillMask>(bounds.width(), bounds.height());
+    auto &visited = *m_visited[tile];
+
+    auto pixels = m_image.tileImage(tx, ty);
+    if (pixels.isNull()) {
+        pixels = QImage {bounds.size(), QImage::Format_ARGB32_Premultiplied};
+        pixels.fill(Qt::transparent);
+    }
+    bool isWritten = false;
+    QRect filledArea;
+
+    while (!seeds.empty()) {
+        auto seed = seeds.back();
+        seeds.pop_back();
 
-    auto startColor = image.pixelColor(startPos.x(), startPos.y());
+        // tile coordinates, up to the seeds handed on
+        const int y = seed.y - bounds.top();
+        const int x2 = seed.x2 - bounds.left();
+        auto line = reinterpret_cast<const QRgb *>(pixels.constScanLine(y));
 
-    auto nodeQueue = std::queue<QPoint>();
-    nodeQueue.push(startPos);
+        for (int x = findInside(visited, line, seed.x1 - bounds.left(), x2, y); x <= x2; x = findInside(visited, line, x, x2, y)) {
+            int xLeft = findRunStart(visited, line, x, 0, y);
+            int xRight = findRunEnd(visited, line, x, bounds.width() - 1, y);
 
-    while (!nodeQueue.empty()) {
-        auto currNode = nodeQueue.front();
-        nodeQueue.pop();
+            // the first span written detaches the pixels from the tile, which other images may share
+            auto row = reinterpret_cast<QRgb *>(pixels.scanLine(y));
+            for (int i = xLeft; i <= xRight; i++) {
+                visited.set(i, y);
+                row[i] = m_fillPixel;
+            }
+            line = row;
+            isWritten = true;
 
-        auto x = currNode.x();
-        auto y = currNode.y();
-        if (visited[x][y])
-            continue;
+            const int left = bounds.left() + xLeft;
+            const int right = bounds.left() + xRight;
+            filledArea |= QRect {left, seed.y, right - left + 1, 1};
 
-        visited[x][y] = true;
-        auto currColor = image.pixelColor(x, y);
+            if (xLeft == 0 && left > 0)
+                outSeeds.push_back(FillSeed {seed.y, left-1, left-1});
+            if (xRight == bounds.width()-1 && right < m_image.width()-1)
+                outSeeds.push_back(FillSeed {seed.y, right+1, right+1});
 
-        if ( (abs(startColor.red() - currColor.red()) > threshold) ||
-            (abs(startColor.green() - currColor.green()) > threshold) ||
-            (abs(startColor.blue() - currColor.blue()) > threshold) ||
-            (abs(startColor.alpha() - currColor.alpha()) > threshold) ) {
-            //not inside
-            continue;
+            for (int ny: { seed.y-1, seed.y+1 }) {
+                if (ny < 0 || ny >= m_image.height())
+                    continue;
+
+                auto nextSeed = FillSeed {ny, left, right};
+                if (ny < bounds.top() || ny > bounds.bottom())
+                    outSeeds.push_back(nextSeed);
+                else
+                    seeds.push_back(nextSeed);
+            }
+
+            // xRight+1 is either outside the tile or not fillable
+            x = xRight + 2;
         }
+    }
+
+    if (isWritten)
+        m_image.setTileImage(tx, ty, pixels);
+
+    return filledArea;
+}
+
+
+// Fills the tiles that have seeds, then hands the spans that crossed a tile border over
+// to the neighbouring tiles, until no tile has anything left to fill. The tiles of each
+// round are filled one after the other, or on the thread pool when isParallel is true.
+static QRect floodFillTiles(FillTarget &target, const QPoint &startPos, bool isParallel) {
+    std::vector<std::vector<FillSeed>> pendingSeeds(target.tileCount());
+    std::vector<int> activeTiles { target.tileAt(startPos.x(), startPos.y()) };
+    pendingSeeds[activeTiles.front()].push_back(FillSeed {startPos.y(), startPos.x(), startPos.x()});
 
-        image.setPixelColor(x, y, fillColor);
+    QRect filledArea;
+    while (!activeTiles.empty()) {
+        std::vector<std::vector<FillSeed>> outSeeds(activeTiles.size());
+        std::vector<QRect> tileFilledAreas(activeTiles.size());
+        auto fillActiveTile = [&](int i) {
+            int tile = activeTiles[i];
+            tileFilledAreas[i] = target.fillTile(tile, pendingSeeds[tile], outSeeds[i]);
+        };
+
+        if (isParallel) {
+            Algorithms::parallelFor((int)activeTiles.size(), fillActiveTile);
+        } else {
+            for (int i = 0; i < (int)activeTiles.size(); i++)
+                fillActiveTile(i);
+        }
 
-        if (x > 0)
-            nodeQueue.push(QPoint(x-1, y  ));
-        if (x < w-1)
-            nodeQueue.push(QPoint(x+1, y)  );
-        if (y > 0)
-            nodeQueue.push(QPoint(x  , y-1));
-        if (y < h-1)
-            nodeQueue.push(QPoint(x  , y+1));
+        std::vector<int> nextTiles;
+        for (size_t i = 0; i < activeTiles.size(); i++) {
+            filledArea |= tileFilledAreas[i];
+            for (auto seed: outSeeds[i]) {
+                int tile = target.tileAt(seed.x1, seed.y);
+                if (pendingSeeds[tile].empty())
+                    nextTiles.push_back(tile);
+                pendingSeeds[tile].push_back(seed);
+            }
+        }
+        activeTiles = std::move(nextTiles);
     }
 
-    painter.drawImage(QPoint {0, 0}, image);
+    return filledArea;
 }
 
+
+QRect Algorithms::floodFill(TiledImage &image, const QColor &fillColor, const QPoint & startPos, int tolerance, FillStrategy strategy) {
+    if (!image.rect().contains(startPos))
+        return QRect {};
+
+    if (strategy == FillStrategy::Auto) {
+        bool isLarge = (static_cast<qint64>(image.width()) * image.height() >= parallelFillMinPixels);
+        strategy = (isLarge && QThreadPool::globalInstance()->maxThreadCount() > 1) ? FillStrategy::Parallel : FillStrategy::Sequential;
+    }
+
+    FillTarget target {image, startPos, fillColor, tolerance};
+    return floodFillTiles(target, startPos, strategy == FillStrategy::Parallel);
+}
+
+
+QRect Algorithms::replaceColor(TiledImage &image, const QColor &newColor, const QPoint & samplePos, int tolerance) {
+    if (!image.rect().contains(samplePos))
+        return QRect {};
+
+    const ColorMatcher matcher { image.pixel(samplePos), tolerance };
+    const QRgb newPixel = newColor.rgba64().premultiplied().toArgb32();
+
+    const int tileCount = image.tilesX() * image.tilesY();
+    std::vector<QRect> tileReplacedAreas(tileCount);
+
+    parallelFor(tileCount, [&](int tile) {
+        const int tx = tile % image.tilesX();
+        const int ty = tile / image.tilesX();
+        const QRect tileArea = image.tileRect(tx, ty);
+
+        auto pixels = image.tileImage(tx, ty);
+        if (pixels.isNull()) {
+            // unallocated tiles are transparent all over
+            if (!matcher.matches(0))
+                return;
+            pixels = QImage {tileArea.size(), QImage::Format_ARGB32_Premultiplied};
+            pixels.fill(Qt::transparent);
+        }
+
+        // rows are matched on a copy, so that only the tiles with a match are duplicated
+        std::vector<QRgb> row(tileArea.width());
+        QRect replacedArea;
+        for (int y = 0; y < tileArea.height(); y++) {
+            auto line = reinterpret_cast<const QRgb *>(pixels.constScanLine(y));
+            std::copy(line, line + row.size(), row.begin());
+            auto rowArea = matcher.replaceInRow(row.data(), y, tileArea.width(), newPixel);
+            if (rowArea.isEmpty())
+                continue;
+
+            std::copy(row.begin(), row.end(), reinterpret_cast<QRgb *>(pixels.scanLine(y)));
+            replacedArea |= rowArea;
+        }
+
+        if (replacedArea.isEmpty())
+            return;
+        image.setTileImage(tx, ty, pixels);
+        tileReplacedAreas[tile] = replacedArea.translated(tileArea.topLeft());
+    });
+
+    QRect replacedArea;
+    for (auto tileArea: tileReplacedAreas)
+        replacedArea |= tileArea;
+
+    return replacedArea;
+}
+
+
+void Algorithms::parallelFor(int count, const std::function<void(int)> &body) {
+    auto pool = QThreadPool::globalInstance();
+    std::atomic<int> nextIndex {0};
+    QSemaphore nFinishedHelpers;
+
+    auto work = [&]() {
+        for (int i = nextIndex++; i < count; i = nextIndex++)
+            body(i);
+    };
+
+    // the calling thread works too, so this never waits on a saturated pool
+    int nHelpers = 0;
+    for (int i = 1; i < std::min(count, pool->maxThreadCount()); i++) {
+        bool isStarted = pool->tryStart([&]() {
+            work();
+            nFinishedHelpers.release();
+        });
+        if (!isStarted)
+            break;
+        nHelpers ++;
+    }
+
+    work();
+    nFinishedHelpers.acquire(nHelpers);
+}
@@ -1,13 +1,31 @@
 #ifndef ALGORITHMS_H
 #define ALGORITHMS_H
 
-#include <QPixmap>
+#include "tiled_image.h"
+
 #include <QColor>
 #include <QPoint>
+#include <QRect>
+
+#include <functional>
+
+
+enum class FillStrategy {
+    Auto,       // parallel above a size threshold, sequential otherwise
+    Sequential,
+    Parallel,
+};
 
 
 class Algorithms {
 public:
-    static void floodFill(QPainter &painter, const QColor &color, const QPoint & startPos);
+    // returns the area that was actually filled; only the tiles the fill reaches are read,
+    // and only those it writes are copied
+    static QRect floodFill(TiledImage &image, const QColor &color, const QPoint & startPos, int tolerance, FillStrategy strategy=FillStrategy::Auto);
+    // recolors every pixel similar to the one at samplePos, connected or not; returns the area that was changed
+    static QRect replaceColor(TiledImage &image, const QColor &newColor, const QPoint & samplePos, int tolerance);
+
+    // runs body(0) ... body(count-1) on the global thread pool, returns when all of them are done
+    static void parallelFor(int count, const std::function<void(int)> &body);
 };
 #endif // ALGORITHMS_H
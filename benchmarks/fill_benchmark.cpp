@@ -0,0 +1,100 @@
+#include "algorithms.h"
+#include "tiled_image.h"
+
+#include <QColor>
+#include <QElapsedTimer>
+#include <QImage>
+#include <QPoint>
+#include <QThread>
+#include <QThreadPool>
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+
+// Times the sequential and the tile parallel flood fill on a large image, with
+// the global thread pool limited to several thread counts.
+
+static constexpr int imageSize = 8192;
+static constexpr int runCount = 3;
+static constexpr int cellSize = 193;
+static constexpr int gapSize = 16;
+
+
+// white image divided in cells by a grid of black walls, with a gap in every side of
+// every cell, so that the fill has to wind its way through all the tiles
+static TiledImage makeMaze() {
+    QImage image {imageSize, imageSize, QImage::Format_ARGB32_Premultiplied};
+    image.fill(Qt::white);
+    auto pixel = [&](int x, int y) -> QRgb & { return reinterpret_cast<QRgb *>(image.scanLine(y))[x]; };
+
+    std::mt19937 random {1};
+    for (int wall = cellSize; wall < imageSize; wall += cellSize) {
+        for (int i = 0; i < imageSize; i++) {
+            pixel(i, wall) = qRgb(0, 0, 0);
+            pixel(wall, i) = qRgb(0, 0, 0);
+        }
+    }
+    for (int wall = cellSize; wall < imageSize; wall += cellSize) {
+        for (int cell = 0; cell + gapSize < imageSize; cell += cellSize) {
+            int gap = cell + 1 + random() % (cellSize - gapSize - 1);
+            for (int i = gap; i < std::min(gap + gapSize, imageSize); i++) {
+                pixel(i, wall) = qRgb(255, 255, 255);
+                pixel(wall, i) = qRgb(255, 255, 255);
+            }
+        }
+    }
+
+    return TiledImage::fromImage(image);
+}
+
+// best of runCount fills of a copy of maze, in milliseconds; filled is the last copy
+static double timeFill(const TiledImage &maze, FillStrategy strategy, TiledImage &filled) {
+    double best = -1;
+    for (int run = 0; run < runCount; run++) {
+        // the copy shares the tiles of maze, which the fill duplicates as it writes them
+        TiledImage image = maze;
+
+        QElapsedTimer timer;
+        timer.start();
+        Algorithms::floodFill(image, QColor {255, 0, 0}, QPoint {1, 1}, 0, strategy);
+        double elapsed = timer.nsecsElapsed() / 1e6;
+
+        filled = image;
+
+        best = (best < 0) ? elapsed : std::min(best, elapsed);
+    }
+
+    return best;
+}
+
+
+int main() {
+    auto maze = makeMaze();
+
+    std::vector<int> threadCounts {1, 2, 4};
+    if (QThread::idealThreadCount() > 4)
+        threadCounts.push_back(QThread::idealThreadCount());
+
+    printf("flood fill of a %dx%d maze, best of %d runs\n", imageSize, imageSize, runCount);
+    printf("%8s %14s %14s %8s\n", "threads", "sequential ms", "parallel ms", "speedup");
+
+    for (int threads: threadCounts) {
+        QThreadPool::globalInstance()->setMaxThreadCount(threads);
+
+        TiledImage sequentialImage, parallelImage;
+        double sequential = timeFill(maze, FillStrategy::Sequential, sequentialImage);
+        double parallel = timeFill(maze, FillStrategy::Parallel, parallelImage);
+        // both strategies must fill the same pixels
+        if (sequentialImage.toImage() != parallelImage.toImage()) {
+            fprintf(stderr, "filled areas differ with %d threads\n", threads);
+            return 1;
+        }
+
+        printf("%8d %14.1f %14.1f %7.2fx\n", threads, sequential, parallel, sequential / parallel);
+    }
+
+    return 0;
+}
@@ -0,0 +1,431 @@
+#include "blend_kernels.h"
+#include "cpu_features.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef HAS_X86_SIMD
+#include <immintrin.h>
+#endif
+
+
+// x / 255, rounded, for x in [0, 255 * 255]
+static inline uint div255(uint x) {
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+static inline QRgb blendMaskedPixel(QRgb dest, uint coverage, QRgb color) {
+    if (coverage == 0)
+        return dest;
+
+    uint a = div255(qAlpha(color) * coverage);
+    uint r = div255(qRed(color) * coverage);
+    uint g = div255(qGreen(color) * coverage);
+    uint b = div255(qBlue(color) * coverage);
+    uint inverseAlpha = 255 - a;
+
+    return qRgba(r + div255(qRed(dest) * inverseAlpha),
+                 g + div255(qGreen(dest) * inverseAlpha),
+                 b + div255(qBlue(dest) * inverseAlpha),
+                 a + div255(qAlpha(dest) * inverseAlpha));
+}
+
+
+static inline uint subSaturated(uint x, uint y) {
+    return x > y ? x - y : 0;
+}
+
+// the separable modes follow the W3C formulas on premultiplied channels, with every
+// product divided by 255 on its own, so that 16-bit lanes never overflow
+static inline uint blendChannel(BlendMode mode, uint s, uint d, uint sa, uint da) {
+    uint inverseSa = 255 - sa;
+    uint inverseDa = 255 - da;
+
+    switch (mode) {
+        case BlendMode::Normal:
+            return s + div255(d * inverseSa);
+        case BlendMode::Multiply:
+            return div255(s * d) + div255(s * inverseDa) + div255(d * inverseSa);
+        case BlendMode::Screen:
+            return subSaturated(s + d, div255(s * d));
+        case BlendMode::Overlay: {
+            uint outside = div255(s * inverseDa) + div255(d * inverseSa);
+            if (2 * d < da)
+                return 2 * div255(s * d) + outside;
+            return subSaturated(div255(sa * da) + outside, 2 * div255(subSaturated(da, d) * subSaturated(sa, s)));
+        }
+        case BlendMode::Darken:
+            return std::min(div255(s * da), div255(d * sa)) + div255(s * inverseDa) + div255(d * inverseSa);
+        case BlendMode::Lighten:
+            return std::max(div255(s * da), div255(d * sa)) + div255(s * inverseDa) + div255(d * inverseSa);
+        case BlendMode::Add:
+            return s + d;
+        case BlendMode::Difference:
+            return subSaturated(s + d, 2 * std::min(div255(s * da), div255(d * sa)));
+        case BlendMode::Erase:
+            return div255(d * inverseSa);
+    }
+
+    return d;
+}
+
+// the separable modes take the alpha of source-over
+static inline bool hasNormalAlpha(BlendMode mode) {
+    return mode != BlendMode::Add && mode != BlendMode::Erase;
+}
+
+static inline QRgb compositePixel(BlendMode mode, QRgb dest, QRgb source, uint opacity) {
+    if (opacity < 255)
+        source = qRgba(div255(qRed(source) * opacity), div255(qGreen(source) * opacity),
+                       div255(qBlue(source) * opacity), div255(qAlpha(source) * opacity));
+
+    uint sa = qAlpha(source);
+    uint da = qAlpha(dest);
+    uint r = blendChannel(mode, qRed(source), qRed(dest), sa, da);
+    uint g = blendChannel(mode, qGreen(source), qGreen(dest), sa, da);
+    uint b = blendChannel(mode, qBlue(source), qBlue(dest), sa, da);
+    uint a = blendChannel(hasNormalAlpha(mode) ? BlendMode::Normal : mode, sa, da, sa, da);
+
+    return qRgba(std::min(r, 255u), std::min(g, 255u), std::min(b, 255u), std::min(a, 255u));
+}
+
+static void compositeScalar(BlendMode mode, QRgb *dest, const QRgb *source, int count, int opacity) {
+    for (int x = 0; x < count; x++)
+        dest[x] = compositePixel(mode, dest[x], source[x], opacity);
+}
+
+
+//--------------------------- SIMD kernels ---------------------------
+// Pixels are widened to 16 bits per channel, two of them per 128-bit lane; the
+// rounding of div255 is the same as in the scalar version.
+
+#ifdef HAS_X86_SIMD
+
+static inline __m128i div255(__m128i x) {
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+// blends two widened pixels
+static inline __m128i blendWide(__m128i dest, __m128i coverage, __m128i color) {
+    const __m128i source = div255(_mm_mullo_epi16(color, coverage));
+    const __m128i sourceAlpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(source, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    const __m128i inverseAlpha = _mm_sub_epi16(_mm_set1_epi16(255), sourceAlpha);
+    return _mm_add_epi16(source, div255(_mm_mullo_epi16(dest, inverseAlpha)));
+}
+
+static void blendMaskedSse2(QRgb *dest, const uchar *mask, int count, QRgb color) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i colors = _mm_unpacklo_epi8(_mm_set1_epi32(color), zero);
+
+    int x = 0;
+    for (; x + 3 < count; x += 4) {
+        quint32 mask4;
+        std::memcpy(&mask4, mask + x, sizeof(mask4));
+        if (mask4 == 0)
+            continue;
+
+        // each coverage byte repeated over the four channels of its pixel
+        __m128i coverage = _mm_cvtsi32_si128(static_cast<int>(mask4));
+        coverage = _mm_unpacklo_epi8(coverage, coverage);
+        coverage = _mm_unpacklo_epi16(coverage, coverage);
+
+        auto destPtr = reinterpret_cast<__m128i *>(dest + x);
+        const __m128i pixels = _mm_loadu_si128(destPtr);
+        const __m128i low = blendWide(_mm_unpacklo_epi8(pixels, zero), _mm_unpacklo_epi8(coverage, zero), colors);
+        const __m128i high = blendWide(_mm_unpackhi_epi8(pixels, zero), _mm_unpackhi_epi8(coverage, zero), colors);
+        _mm_storeu_si128(destPtr, _mm_packus_epi16(low, high));
+    }
+
+    for (; x < count; x++)
+        dest[x] = blendMaskedPixel(dest[x], mask[x], color);
+}
+
+TARGET_AVX2 static inline __m256i div255(__m256i x) {
+    x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+TARGET_AVX2 static inline __m256i blendWide(__m256i dest, __m256i coverage, __m256i color) {
+    const __m256i source = div255(_mm256_mullo_epi16(color, coverage));
+    const __m256i sourceAlpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(source, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    const __m256i inverseAlpha = _mm256_sub_epi16(_mm256_set1_epi16(255), sourceAlpha);
+    return _mm256_add_epi16(source, div255(_mm256_mullo_epi16(dest, inverseAlpha)));
+}
+
+TARGET_AVX2 static void blendMaskedAvx2(QRgb *dest, const uchar *mask, int count, QRgb color) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i colors = _mm256_unpacklo_epi8(_mm256_set1_epi32(color), zero);
+
+    int x = 0;
+    for (; x + 7 < count; x += 8) {
+        quint64 mask8;
+        std::memcpy(&mask8, mask + x, sizeof(mask8));
+        if (mask8 == 0)
+            continue;
+
+        const __m128i mask8Bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(mask + x));
+        const __m256i coverage = _mm256_mullo_epi32(_mm256_cvtepu8_epi32(mask8Bytes), _mm256_set1_epi32(0x01010101));
+
+        auto destPtr = reinterpret_cast<__m256i *>(dest + x);
+        const __m256i pixels = _mm256_loadu_si256(destPtr);
+        const __m256i low = blendWide(_mm256_unpacklo_epi8(pixels, zero), _mm256_unpacklo_epi8(coverage, zero), colors);
+        const __m256i high = blendWide(_mm256_unpackhi_epi8(pixels, zero), _mm256_unpackhi_epi8(coverage, zero), colors);
+        _mm256_storeu_si256(destPtr, _mm256_packus_epi16(low, high));
+    }
+
+    for (; x < count; x++)
+        dest[x] = blendMaskedPixel(dest[x], mask[x], color);
+}
+
+
+//--------------------------- SIMD compositing ---------------------------
+// Same lane layout as above, with the mode a template parameter so that each loop is
+// specialized; the saturating steps match those of blendChannel()
+
+// lanes 3 and 7 of a pair of widened pixels
+static constexpr int alphaLanes = 0x88;
+
+TARGET_SSE41 static inline __m128i multiplySse41(__m128i x, __m128i y) {
+    return div255(_mm_mullo_epi16(x, y));
+}
+
+TARGET_SSE41 static inline __m128i alphasSse41(__m128i x) {
+    return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+template <BlendMode mode>
+TARGET_SSE41 static inline __m128i compositeWide(__m128i d, __m128i s) {
+    const __m128i sa = alphasSse41(s);
+    const __m128i da = alphasSse41(d);
+    const __m128i inverseSa = _mm_sub_epi16(_mm_set1_epi16(255), sa);
+    const __m128i inverseDa = _mm_sub_epi16(_mm_set1_epi16(255), da);
+    const __m128i normal = _mm_add_epi16(s, multiplySse41(d, inverseSa));
+    const __m128i outside = _mm_add_epi16(multiplySse41(s, inverseDa), multiplySse41(d, inverseSa));
+
+    __m128i result = normal;
+    switch (mode) {
+        case BlendMode::Normal:
+            return normal;
+        case BlendMode::Multiply:
+            result = _mm_add_epi16(multiplySse41(s, d), outside);
+            break;
+        case BlendMode::Screen:
+            result = _mm_subs_epu16(_mm_add_epi16(s, d), multiplySse41(s, d));
+            break;
+        case BlendMode::Overlay: {
+            const __m128i low = _mm_add_epi16(_mm_slli_epi16(multiplySse41(s, d), 1), outside);
+            const __m128i inverseProduct = multiplySse41(_mm_subs_epu16(da, d), _mm_subs_epu16(sa, s));
+            const __m128i high = _mm_subs_epu16(_mm_add_epi16(multiplySse41(sa, da), outside), _mm_slli_epi16(inverseProduct, 1));
+            result = _mm_blendv_epi8(high, low, _mm_cmplt_epi16(_mm_slli_epi16(d, 1), da));
+            break;
+        }
+        case BlendMode::Darken:
+            result = _mm_add_epi16(_mm_min_epu16(multiplySse41(s, da), multiplySse41(d, sa)), outside);
+            break;
+        case BlendMode::Lighten:
+            result = _mm_add_epi16(_mm_max_epu16(multiplySse41(s, da), multiplySse41(d, sa)), outside);
+            break;
+        case BlendMode::Add:
+            return _mm_add_epi16(s, d);
+        case BlendMode::Difference:
+            result = _mm_subs_epu16(_mm_add_epi16(s, d), _mm_slli_epi16(_mm_min_epu16(multiplySse41(s, da), multiplySse41(d, sa)), 1));
+            break;
+        case BlendMode::Erase:
+            return multiplySse41(d, inverseSa);
+    }
+
+    return _mm_blend_epi16(result, normal, alphaLanes);
+}
+
+template <BlendMode mode>
+TARGET_SSE41 static void compositeSse41(QRgb *dest, const QRgb *source, int count, int opacity) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i opacities = _mm_set1_epi16(opacity);
+
+    int x = 0;
+    for (; x + 3 < count; x += 4) {
+        const __m128i sources = _mm_loadu_si128(reinterpret_cast<const __m128i *>(source + x));
+        // transparent pixels leave dest as it is in every mode
+        if (_mm_testz_si128(sources, sources))
+            continue;
+
+        __m128i sourceLow = _mm_unpacklo_epi8(sources, zero);
+        __m128i sourceHigh = _mm_unpackhi_epi8(sources, zero);
+        if (opacity < 255) {
+            sourceLow = multiplySse41(sourceLow, opacities);
+            sourceHigh = multiplySse41(sourceHigh, opacities);
+        }
+
+        auto destPtr = reinterpret_cast<__m128i *>(dest + x);
+        const __m128i pixels = _mm_loadu_si128(destPtr);
+        const __m128i low = compositeWide<mode>(_mm_unpacklo_epi8(pixels, zero), sourceLow);
+        const __m128i high = compositeWide<mode>(_mm_unpackhi_epi8(pixels, zero), sourceHigh);
+        _mm_storeu_si128(destPtr, _mm_packus_epi16(low, high));
+    }
+
+    for (; x < count; x++)
+        dest[x] = compositePixel(mode, dest[x], source[x], opacity);
+}
+
+TARGET_AVX2 static inline __m256i multiplyAvx2(__m256i x, __m256i y) {
+    return div255(_mm256_mullo_epi16(x, y));
+}
+
+TARGET_AVX2 static inline __m256i alphasAvx2(__m256i x) {
+    return _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(x, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+template <BlendMode mode>
+TARGET_AVX2 static inline __m256i compositeWide(__m256i d, __m256i s) {
+    const __m256i sa = alphasAvx2(s);
+    const __m256i da = alphasAvx2(d);
+    const __m256i inverseSa = _mm256_sub_epi16(_mm256_set1_epi16(255), sa);
+    const __m256i inverseDa = _mm256_sub_epi16(_mm256_set1_epi16(255), da);
+    const __m256i normal = _mm256_add_epi16(s, multiplyAvx2(d, inverseSa));
+    const __m256i outside = _mm256_add_epi16(multiplyAvx2(s, inverseDa), multiplyAvx2(d, inverseSa));
+
+    __m256i result = normal;
+    switch (mode) {
+        case BlendMode::Normal:
+            return normal;
+        case BlendMode::Multiply:
+            result = _mm256_add_epi16(multiplyAvx2(s, d), outside);
+            break;
+        case BlendMode::Screen:
+            result = _mm256_subs_epu16(_mm256_add_epi16(s, d), multiplyAvx2(s, d));
+            break;
+        case BlendMode::Overlay: {
+            const __m256i low = _mm256_add_epi16(_mm256_slli_epi16(multiplyAvx2(s, d), 1), outside);
+            const __m256i inverseProduct = multiplyAvx2(_mm256_subs_epu16(da, d), _mm256_subs_epu16(sa, s));
+            const __m256i high = _mm256_subs_epu16(_mm256_add_epi16(multiplyAvx2(sa, da), outside), _mm256_slli_epi16(inverseProduct, 1));
+            result = _mm256_blendv_epi8(high, low, _mm256_cmpgt_epi16(da, _mm256_slli_epi16(d, 1)));
+            break;
+        }
+        case BlendMode::Darken:
+            result = _mm256_add_epi16(_mm256_min_epu16(multiplyAvx2(s, da), multiplyAvx2(d, sa)), outside);
+            break;
+        case BlendMode::Lighten:
+            result = _mm256_add_epi16(_mm256_max_epu16(multiplyAvx2(s, da), multiplyAvx2(d, sa)), outside);
+            break;
+        case BlendMode::Add:
+            return _mm256_add_epi16(s, d);
+        case BlendMode::Difference:
+            result = _mm256_subs_epu16(_mm256_add_epi16(s, d), _mm256_slli_epi16(_mm256_min_epu16(multiplyAvx2(s, da), multiplyAvx2(d, sa)), 1));
+            break;
+        case BlendMode::Erase:
+            return multiplyAvx2(d, inverseSa);
+    }
+
+    return _mm256_blend_epi16(result, normal, alphaLanes);
+}
+
+template <BlendMode mode>
+TARGET_AVX2 static void compositeAvx2(QRgb *dest, const QRgb *source, int count, int opacity) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i opacities = _mm256_set1_epi16(opacity);
+
+    int x = 0;
+    for (; x + 7 < count; x += 8) {
+        const __m256i sources = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(source + x));
+        if (_mm256_testz_si256(sources, sources))
+            continue;
+
+        __m256i sourceLow = _mm256_unpacklo_epi8(sources, zero);
+        __m256i sourceHigh = _mm256_unpackhi_epi8(sources, zero);
+        if (opacity < 255) {
+            sourceLow = multiplyAvx2(sourceLow, opacities);
+            sourceHigh = multiplyAvx2(sourceHigh, opacities);
+        }
+
+        auto destPtr = reinterpret_cast<__m256i *>(dest + x);
+        const __m256i pixels = _mm256_loadu_si256(destPtr);
+        const __m256i low = compositeWide<mode>(_mm256_unpacklo_epi8(pixels, zero), sourceLow);
+        const __m256i high = compositeWide<mode>(_mm256_unpackhi_epi8(pixels, zero), sourceHigh);
+        _mm256_storeu_si256(destPtr, _mm256_packus_epi16(low, high));
+    }
+
+    for (; x < count; x++)
+        dest[x] = compositePixel(mode, dest[x], source[x], opacity);
+}
+
+using CompositeLoop = void (*)(QRgb *dest, const QRgb *source, int count, int opacity);
+
+// the loop specialized for mode, for the given instruction set
+template <template <BlendMode> class Loops>
+static CompositeLoop compositeLoop(BlendMode mode) {
+    switch (mode) {
+        case BlendMode::Normal: return Loops<BlendMode::Normal>::run;
+        case BlendMode::Multiply: return Loops<BlendMode::Multiply>::run;
+        case BlendMode::Screen: return Loops<BlendMode::Screen>::run;
+        case BlendMode::Overlay: return Loops<BlendMode::Overlay>::run;
+        case BlendMode::Darken: return Loops<BlendMode::Darken>::run;
+        case BlendMode::Lighten: return Loops<BlendMode::Lighten>::run;
+        case BlendMode::Add: return Loops<BlendMode::Add>::run;
+        case BlendMode::Difference: return Loops<BlendMode::Difference>::run;
+        case BlendMode::Erase: return Loops<BlendMode::Erase>::run;
+    }
+
+    return Loops<BlendMode::Normal>::run;
+}
+
+template <BlendMode mode>
+struct Sse41Loops {
+    static void run(QRgb *dest, const QRgb *source, int count, int opacity) { compositeSse41<mode>(dest, source, count, opacity); }
+};
+
+template <BlendMode mode>
+struct Avx2Loops {
+    static void run(QRgb *dest, const QRgb *source, int count, int opacity) { compositeAvx2<mode>(dest, source, count, opacity); }
+};
+
+#endif // HAS_X86_SIMD
+
+
+SimdLevel BlendKernels::supportedLevel() {
+#ifdef HAS_X86_SIMD
+    if (CpuFeatures::hasAvx2())
+        return SimdLevel::Avx2;
+    if (CpuFeatures::hasSse41())
+        return SimdLevel::Sse41;
+    return SimdLevel::Sse2;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+
+void BlendKernels::blendMasked(QRgb *dest, const uchar *mask, int count, QRgb premultipliedColor) {
+    blendMasked(dest, mask, count, premultipliedColor, supportedLevel());
+}
+
+void BlendKernels::composite(BlendMode mode, QRgb *dest, const QRgb *source, int count, int opacity) {
+    composite(mode, dest, source, count, opacity, supportedLevel());
+}
+
+
+void BlendKernels::blendMasked(QRgb *dest, const uchar *mask, int count, QRgb premultipliedColor, SimdLevel level) {
+#ifdef HAS_X86_SIMD
+    if (level >= SimdLevel::Avx2)
+        return blendMaskedAvx2(dest, mask, count, premultipliedColor);
+    if (level >= SimdLevel::Sse2)
+        return blendMaskedSse2(dest, mask, count, premultipliedColor);
+#endif
+    for (int x = 0; x < count; x++)
+        dest[x] = blendMaskedPixel(dest[x], mask[x], premultipliedColor);
+}
+
+void BlendKernels::composite(BlendMode mode, QRgb *dest, const QRgb *source, int count, int opacity, SimdLevel level) {
+    if (opacity <= 0)
+        return;
+    opacity = std::min(opacity, 255);
+
+#ifdef HAS_X86_SIMD
+    if (level >= SimdLevel::Avx2)
+        return compositeLoop<Avx2Loops>(mode)(dest, source, count, opacity);
+    if (level >= SimdLevel::Sse41)
+        return compositeLoop<Sse41Loops>(mode)(dest, source, count, opacity);
+#endif
+    compositeScalar(mode, dest, source, count, opacity);
+}
@@ -0,0 +1,49 @@
+#ifndef BLEND_KERNELS_H
+#define BLEND_KERNELS_H
+
+#include <QColor>
+
+
+enum class BlendMode {
+    Normal,
+    Multiply,
+    Screen,
+    Overlay,
+    Darken,
+    Lighten,
+    Add,
+    Difference,
+    Erase, //clears dest where source is opaque
+};
+
+
+// instruction sets the loops are written for, from the plainest up
+enum class SimdLevel {
+    Scalar,
+    Sse2,
+    Sse41,
+    Avx2,
+};
+
+
+// Compositing loops over premultiplied ARGB32 scanlines, with SSE2, SSE4.1 and AVX2
+// versions chosen at run time. Results are bit-identical across versions.
+class BlendKernels {
+public:
+    // the highest level the CPU supports
+    static SimdLevel supportedLevel();
+
+    // source-over of color, scaled by each coverage byte of mask, onto dest
+    static void blendMasked(QRgb *dest, const uchar *mask, int count, QRgb premultipliedColor);
+    // blends source, scaled by opacity (0 to 255), onto dest; a transparent source pixel
+    // leaves its dest pixel as it is, whatever the mode
+    static void composite(BlendMode mode, QRgb *dest, const QRgb *source, int count, int opacity = 255);
+
+    // the same with the loops written for level at most, which must be supported,
+    // so that the versions can be checked against each other
+    static void blendMasked(QRgb *dest, const uchar *mask, int count, QRgb premultipliedColor, SimdLevel level);
+    static void composite(BlendMode mode, QRgb *dest, const QRgb *source, int count, int opacity, SimdLevel level);
+};
+
+
+#endif // BLEND_KERNELS_H
@@ -0,0 +1,157 @@
+#include "box_blur.h"
+#include "cpu_features.h"
+#include "filter_engine.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+#ifdef HAS_X86_SIMD
+#include <immintrin.h>
+#endif
+
+
+//--------------------------- inner loops ---------------------------
+// A summed-area table holds, for every pixel, the sums of each channel over the pixels above
+// and to the left of it, with an extra row and column of zeros in front. The sums wrap around
+// 32 bits, which leaves the differences between them exact.
+
+// table row y + 1 from row y above it and line y of the image, for count pixels
+static void buildTableRowScalar(quint32 *row, const quint32 *above, const QRgb *line, int count) {
+    quint32 sum[4] {};
+    std::fill(row, row + 4, 0);
+    for (int x = 0; x < count; x++) {
+        for (int c = 0; c < 4; c++) {
+            sum[c] += (line[x] >> (8 * c)) & 0xff;
+            row[(x + 1) * 4 + c] = above[(x + 1) * 4 + c] + sum[c];
+        }
+    }
+}
+
+// dest[x] = mean of the box of the given diameter whose corner is at table rows top and bottom, column x
+static void boxRowScalar(QRgb *dest, const quint32 *top, const quint32 *bottom, int count, int diameter, float scale) {
+    for (int x = 0; x < count; x++) {
+        QRgb pixel = 0;
+        for (int c = 0; c < 4; c++) {
+            quint32 sum = bottom[(x + diameter) * 4 + c] - bottom[x * 4 + c] - top[(x + diameter) * 4 + c] + top[x * 4 + c];
+            int mean = qBound(0, (int)std::nearbyint((float)sum * scale), 255);
+            pixel |= (QRgb)mean << (8 * c);
+        }
+        dest[x] = pixel;
+    }
+}
+
+#ifdef HAS_X86_SIMD
+
+// one register holds the four channel sums of a pixel
+static void buildTableRowSse2(quint32 *row, const quint32 *above, const QRgb *line, int count) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sum = zero;
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(row), zero);
+    for (int x = 0; x < count; x++) {
+        __m128i pixel = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(line[x]), zero), zero);
+        sum = _mm_add_epi32(sum, pixel);
+        __m128i total = _mm_add_epi32(sum, _mm_loadu_si128(reinterpret_cast<const __m128i *>(above + (x + 1) * 4)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(row + (x + 1) * 4), total);
+    }
+}
+
+static void boxRowSse2(QRgb *dest, const quint32 *top, const quint32 *bottom, int count, int diameter, float scale) {
+    const __m128 scale4 = _mm_set1_ps(scale);
+    for (int x = 0; x < count; x++) {
+        __m128i bottomRight = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bottom + (x + diameter) * 4));
+        __m128i bottomLeft = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bottom + x * 4));
+        __m128i topRight = _mm_loadu_si128(reinterpret_cast<const __m128i *>(top + (x + diameter) * 4));
+        __m128i topLeft = _mm_loadu_si128(reinterpret_cast<const __m128i *>(top + x * 4));
+        __m128i sum = _mm_sub_epi32(_mm_add_epi32(bottomRight, topLeft), _mm_add_epi32(bottomLeft, topRight));
+
+        __m128i mean = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(sum), scale4));
+        mean = _mm_packs_epi32(mean, mean);
+        dest[x] = _mm_cvtsi128_si32(_mm_packus_epi16(mean, mean));
+    }
+}
+
+#endif // HAS_X86_SIMD
+
+static void buildTableRow(quint32 *row, const quint32 *above, const QRgb *line, int count) {
+#ifdef HAS_X86_SIMD
+    buildTableRowSse2(row, above, line, count);
+#else
+    buildTableRowScalar(row, above, line, count);
+#endif
+}
+
+static void boxRow(QRgb *dest, const quint32 *top, const quint32 *bottom, int count, int diameter, float scale) {
+#ifdef HAS_X86_SIMD
+    boxRowSse2(dest, top, bottom, count, diameter, scale);
+#else
+    boxRowScalar(dest, top, bottom, count, diameter, scale);
+#endif
+}
+
+
+// source blurred by a box of the given radius, and shrunk by radius on every side;
+// table is reused from pass to pass
+static QImage boxPass(const QImage &source, int radius, std::vector<quint32> &table) {
+    const int diameter = 2 * radius + 1;
+    const int stride = (source.width() + 1) * 4;
+    table.resize(static_cast<size_t>(stride) * (source.height() + 1));
+
+    std::fill(table.begin(), table.begin() + stride, 0);
+    for (int y = 0; y < source.height(); y++) {
+        auto line = reinterpret_cast<const QRgb *>(source.constScanLine(y));
+        buildTableRow(&table[(y + 1) * stride], &table[y * stride], line, source.width());
+    }
+
+    QImage result {source.width() - 2 * radius, source.height() - 2 * radius, QImage::Format_ARGB32_Premultiplied};
+    const float scale = 1.0f / ((float)diameter * diameter);
+    for (int y = 0; y < result.height(); y++) {
+        auto line = reinterpret_cast<QRgb *>(result.scanLine(y));
+        boxRow(line, &table[y * stride], &table[(y + diameter) * stride], result.width(), diameter, scale);
+    }
+
+    return result;
+}
+
+
+QImage BoxBlur::filter(const TiledImage &source, const QRect &area, const std::vector<int> &radii) {
+    // every pass eats its radius off the border read around area
+    int border = std::accumulate(radii.begin(), radii.end(), 0);
+    auto image = FilterEngine::paddedCopy(source, area, border);
+
+    std::vector<quint32> table;
+    for (int radius: radii)
+        image = boxPass(image, radius, table);
+
+    return image;
+}
+
+void BoxBlur::apply(TiledImage &image, const QRect &area, const std::vector<int> &radii) {
+    // parts at least four times as wide as the border they read, which then adds at most
+    // 125% to their work, however large the radius
+    int border = std::accumulate(radii.begin(), radii.end(), 0);
+    int tileCount = std::max(1, (4 * border + TiledImage::tileSize - 1) / TiledImage::tileSize);
+
+    FilterEngine::applyByParts(image, area, tileCount * TiledImage::tileSize, [&](const TiledImage &source, const QRect &part) {
+        return filter(source, part, radii);
+    });
+}
+
+
+std::vector<int> BoxBlur::gaussianRadii(double sigma, int passes) {
+    // boxes of two odd widths, the narrower ones first, whose variances add up to sigma^2
+    double idealWidth = std::sqrt(12 * sigma * sigma / passes + 1);
+    int lowerWidth = (int)std::floor(idealWidth);
+    if (lowerWidth % 2 == 0)
+        lowerWidth --;
+    int upperWidth = lowerWidth + 2;
+
+    double idealCount = (12 * sigma * sigma - passes * lowerWidth * lowerWidth - 4 * passes * lowerWidth - 3 * passes) / (-4.0 * lowerWidth - 4);
+    int lowerCount = qBound(0, (int)std::lround(idealCount), passes);
+
+    std::vector<int> radii;
+    for (int i = 0; i < passes; i++)
+        radii.push_back(((i < lowerCount ? lowerWidth : upperWidth) - 1) / 2);
+
+    return radii;
+}
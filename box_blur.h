@@ -0,0 +1,28 @@
+#ifndef BOX_BLUR_H
+#define BOX_BLUR_H
+
+#include "tiled_image.h"
+
+#include <QImage>
+#include <QRect>
+
+#include <vector>
+
+
+// Box blurs read from summed-area tables: every pixel costs four lookups whatever the
+// radius. A few boxes in a row approximate a Gaussian at the same cost per pixel.
+class BoxBlur {
+public:
+    static constexpr int gaussianPasses = 3;
+
+    // blurs area of image, a null rect standing for the whole image, with boxes of the given radii in turn
+    static void apply(TiledImage &image, const QRect &area, const std::vector<int> &radii);
+    // area of source blurred, as a premultiplied image of the size of area
+    static QImage filter(const TiledImage &source, const QRect &area, const std::vector<int> &radii);
+
+    // radii of the boxes whose succession comes closest to a Gaussian of standard deviation sigma
+    static std::vector<int> gaussianRadii(double sigma, int passes = gaussianPasses);
+};
+
+
+#endif // BOX_BLUR_H
@@ -0,0 +1,110 @@
+#include "brush_engine.h"
+#include "blend_kernels.h"
+#include "constants.h"
+
+#include <QLineF>
+#include <QTransform>
+
+#include <algorithm>
+#include <cmath>
+
+
+static double smoothStep(double t) {
+    t = std::clamp(t, 0.0, 1.0);
+    return t * t * (3.0 - 2.0 * t);
+}
+
+QImage BrushEngine::makeMask(BrushShape shape, int diameter, double hardness, const QImage &customTip) {
+    diameter = std::max(diameter, 1);
+
+    if (shape == BrushShape::Custom && !customTip.isNull()) {
+        // opaque tips are read as dark ink on a light background
+        auto tip = customTip.scaled(diameter, diameter, Qt::KeepAspectRatio, Qt::SmoothTransformation)
+            .convertToFormat(QImage::Format_ARGB32);
+        bool hasAlpha = customTip.hasAlphaChannel();
+
+        QImage mask {tip.size(), QImage::Format_Alpha8};
+        for (int y = 0; y < tip.height(); y++) {
+            auto src = reinterpret_cast<const QRgb *>(tip.constScanLine(y));
+            auto dest = mask.scanLine(y);
+            for (int x = 0; x < tip.width(); x++)
+                dest[x] = static_cast<uchar>(hasAlpha ? qAlpha(src[x]) : 255 - qGray(src[x]));
+        }
+        return mask;
+    }
+
+    double radiusX = diameter / 2.0;
+    double radiusY = (shape == BrushShape::Elliptical) ? radiusX * ellipticalBrushAspect : radiusX;
+    // the falloff is at least one pixel wide, which antialiases hard brushes
+    double outer = radiusX;
+    double inner = std::min(hardness * outer, outer - 1.0);
+
+    QImage mask {diameter, diameter, QImage::Format_Alpha8};
+    for (int y = 0; y < diameter; y++) {
+        auto dest = mask.scanLine(y);
+        double dy = (y + 0.5 - diameter / 2.0) / radiusY;
+        for (int x = 0; x < diameter; x++) {
+            double dx = (x + 0.5 - diameter / 2.0) / radiusX;
+            // distance scaled to the long axis, so that the falloff follows the shape
+            double distance = std::sqrt(dx * dx + dy * dy) * outer;
+            double coverage = (distance <= inner) ? 1.0 : 1.0 - smoothStep((distance - inner) / (outer - inner));
+            dest[x] = static_cast<uchar>(std::lround(coverage * 255.0));
+        }
+    }
+
+    return mask;
+}
+
+
+double BrushEngine::walkSegment(const QPointF &from, const QPointF &to, double offset, double spacing, const std::function<void(const QPointF &)> &dab) {
+    double length = QLineF {from, to}.length();
+    double distance = offset;
+    for (; distance <= length; distance += spacing) {
+        double t = (length > 0.0) ? distance / length : 0.0;
+        dab(from + (to - from) * t);
+    }
+
+    return distance - length;
+}
+
+
+QRect BrushEngine::dabRect(const QImage &mask, const QPointF &center) {
+    // dabs are snapped to whole pixels, the mask is not resampled
+    QPoint topLeft {static_cast<int>(std::floor(center.x() - mask.width() / 2.0 + 0.5)),
+                    static_cast<int>(std::floor(center.y() - mask.height() / 2.0 + 0.5))};
+    return QRect {topLeft, mask.size()};
+}
+
+void BrushEngine::stamp(QPainter &painter, const QImage &mask, const QPointF &center, const QColor &color) {
+    auto area = dabRect(mask, center);
+    auto premultipliedColor = qPremultiply(color.rgba());
+
+    // dabs are blended straight into the pixels of an image device, painted through
+    // a temporary image on any other device
+    auto device = painter.device();
+    bool isDirect = (device->devType() == QInternal::Image)
+        && (static_cast<QImage *>(device)->format() == QImage::Format_ARGB32_Premultiplied)
+        && painter.transform().type() <= QTransform::TxTranslate;
+
+    if (!isDirect) {
+        QImage dab {area.size(), QImage::Format_ARGB32_Premultiplied};
+        dab.fill(Qt::transparent);
+        for (int y = 0; y < mask.height(); y++)
+            BlendKernels::blendMasked(reinterpret_cast<QRgb *>(dab.scanLine(y)), mask.constScanLine(y), mask.width(), premultipliedColor);
+        painter.drawImage(area.topLeft(), dab);
+        return;
+    }
+
+    auto &image = *static_cast<QImage *>(device);
+    auto dabArea = area.translated(painter.transform().map(QPoint {0, 0}));
+    auto deviceArea = dabArea.intersected(image.rect());
+    if (deviceArea.isEmpty())
+        return;
+
+    auto maskOffset = deviceArea.topLeft() - dabArea.topLeft();
+    for (int y = 0; y < deviceArea.height(); y++) {
+        auto dest = reinterpret_cast<QRgb *>(image.scanLine(deviceArea.y() + y)) + deviceArea.x();
+        auto coverage = mask.constScanLine(maskOffset.y() + y) + maskOffset.x();
+        BlendKernels::blendMasked(dest, coverage, deviceArea.width(), premultipliedColor);
+    }
+}
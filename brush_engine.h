@@ -0,0 +1,38 @@
+#ifndef BRUSH_ENGINE_H
+#define BRUSH_ENGINE_H
+
+#include <QColor>
+#include <QImage>
+#include <QPainter>
+#include <QPointF>
+#include <QRect>
+
+#include <functional>
+
+
+enum class BrushShape {
+    Round,
+    Elliptical,
+    Custom,     // coverage taken from an image
+};
+
+
+// Lays down a stroke as a sequence of dabs: a coverage mask, computed once per brush,
+// stamped at regular steps along the path and blended with BlendKernels.
+class BrushEngine {
+public:
+    // Alpha8 coverage of one dab; hardness goes from 0 (soft) to 1 (hard edge)
+    static QImage makeMask(BrushShape shape, int diameter, double hardness, const QImage &customTip = QImage {});
+
+    // calls dab() every spacing px along the segment, the first time offset px after from;
+    // returns the offset for the segment that follows
+    static double walkSegment(const QPointF &from, const QPointF &to, double offset, double spacing, const std::function<void(const QPointF &)> &dab);
+
+    // document area covered by a dab centered at center
+    static QRect dabRect(const QImage &mask, const QPointF &center);
+    // blends a dab of color centered at center, in the painter coordinates, into the painter device
+    static void stamp(QPainter &painter, const QImage &mask, const QPointF &center, const QColor &color);
+};
+
+
+#endif // BRUSH_ENGINE_H
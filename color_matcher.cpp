@@ -0,0 +1,333 @@
+#include "color_matcher.h"
+#include "cpu_features.h"
+
+#include <QColor>
+#include <QRgba64>
+#include <QtAlgorithms>
+
+#include <cstdlib>
+#include <algorithm>
+
+#ifdef HAS_X86_SIMD
+#include <immintrin.h>
+#endif
+
+
+static inline bool isColorSimilar(QRgb a, QRgb b, int tolerance) {
+    return (abs(qRed(a)   - qRed(b))   <= tolerance) &&
+           (abs(qGreen(a) - qGreen(b)) <= tolerance) &&
+           (abs(qBlue(a)  - qBlue(b))  <= tolerance) &&
+           (abs(qAlpha(a) - qAlpha(b)) <= tolerance);
+}
+
+// straight (non-premultiplied) channels, rounded the same way QImage::pixelColor does
+static inline QRgb unpremultiplied(QRgb pixel) {
+    if (qAlpha(pixel) == 255)
+        return pixel;
+
+    return QRgba64::fromArgb32(pixel).unpremultiplied().toArgb32();
+}
+
+
+ColorMatcher::ColorMatcher(QRgb referencePixel, int tolerance):
+    m_referencePixel(referencePixel), m_referenceColor(unpremultiplied(referencePixel)), m_tolerance(tolerance) {}
+
+bool ColorMatcher::matches(QRgb pixel) const {
+    return (pixel == m_referencePixel) || isColorSimilar(unpremultiplied(pixel), m_referenceColor, m_tolerance);
+}
+
+
+static inline QRect replacedExtent(int first, int last, int y) {
+    if (last < first)
+        return QRect {};
+
+    return QRect {first, y, last - first + 1, 1};
+}
+
+
+//--------------------------- SIMD kernels ---------------------------
+// Opaque and fully transparent premultiplied pixels are equal to their straight
+// version, so they can be compared bytewise against the straight reference color;
+// a vector containing any translucent pixel goes through ColorMatcher::matches instead.
+
+#ifdef HAS_X86_SIMD
+
+static inline bool isAllStraight(__m128i pixels) {
+    const __m128i alpha = _mm_srli_epi32(pixels, 24);
+    const __m128i isStraight = _mm_or_si128(_mm_cmpeq_epi32(alpha, _mm_setzero_si128()), _mm_cmpeq_epi32(alpha, _mm_set1_epi32(0xff)));
+    return _mm_movemask_ps(_mm_castsi128_ps(isStraight)) == 0xf;
+}
+
+// all bits set in the lanes whose channels are all within tolerance of reference
+static inline __m128i similarLanes(__m128i pixels, __m128i reference, __m128i tolerance) {
+    const __m128i diff = _mm_or_si128(_mm_subs_epu8(pixels, reference), _mm_subs_epu8(reference, pixels));
+    const __m128i excess = _mm_subs_epu8(diff, tolerance);
+    return _mm_cmpeq_epi32(excess, _mm_setzero_si128());
+}
+
+// bit i set when pixel i matches, -1 when the scalar test is needed
+static inline int matchMask4(const QRgb *pixels, __m128i reference, __m128i tolerance) {
+    const __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pixels));
+    if (!isAllStraight(px))
+        return -1;
+
+    return _mm_movemask_ps(_mm_castsi128_ps(similarLanes(px, reference, tolerance)));
+}
+
+TARGET_AVX2 static inline bool isAllStraight(__m256i pixels) {
+    const __m256i alpha = _mm256_srli_epi32(pixels, 24);
+    const __m256i isStraight = _mm256_or_si256(_mm256_cmpeq_epi32(alpha, _mm256_setzero_si256()), _mm256_cmpeq_epi32(alpha, _mm256_set1_epi32(0xff)));
+    return _mm256_movemask_ps(_mm256_castsi256_ps(isStraight)) == 0xff;
+}
+
+TARGET_AVX2 static inline __m256i similarLanes(__m256i pixels, __m256i reference, __m256i tolerance) {
+    const __m256i diff = _mm256_or_si256(_mm256_subs_epu8(pixels, reference), _mm256_subs_epu8(reference, pixels));
+    const __m256i excess = _mm256_subs_epu8(diff, tolerance);
+    return _mm256_cmpeq_epi32(excess, _mm256_setzero_si256());
+}
+
+TARGET_AVX2 static inline int matchMask8(const QRgb *pixels, __m256i reference, __m256i tolerance) {
+    const __m256i px = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pixels));
+    if (!isAllStraight(px))
+        return -1;
+
+    return _mm256_movemask_ps(_mm256_castsi256_ps(similarLanes(px, reference, tolerance)));
+}
+
+
+static int findMismatchSse2(const ColorMatcher &matcher, const QRgb *line, int from, int to, QRgb referenceColor, int tolerance) {
+    const __m128i reference = _mm_set1_epi32(referenceColor);
+    const __m128i tolerances = _mm_set1_epi8(static_cast<char>(tolerance));
+
+    int x = from;
+    for (; x + 3 <= to; x += 4) {
+        int mask = matchMask4(line + x, reference, tolerances);
+        if (mask < 0) {
+            for (int i = 0; i < 4; i++) {
+                if (!matcher.matches(line[x+i]))
+                    return x + i;
+            }
+        } else if (mask != 0xf) {
+            return x + qCountTrailingZeroBits(static_cast<quint32>(~mask));
+        }
+    }
+
+    for (; x <= to; x++) {
+        if (!matcher.matches(line[x]))
+            return x;
+    }
+
+    return to + 1;
+}
+
+TARGET_AVX2 static int findMismatchAvx2(const ColorMatcher &matcher, const QRgb *line, int from, int to, QRgb referenceColor, int tolerance) {
+    const __m256i reference = _mm256_set1_epi32(referenceColor);
+    const __m256i tolerances = _mm256_set1_epi8(static_cast<char>(tolerance));
+
+    int x = from;
+    for (; x + 7 <= to; x += 8) {
+        int mask = matchMask8(line + x, reference, tolerances);
+        if (mask < 0) {
+            for (int i = 0; i < 8; i++) {
+                if (!matcher.matches(line[x+i]))
+                    return x + i;
+            }
+        } else if (mask != 0xff) {
+            return x + qCountTrailingZeroBits(static_cast<quint32>(~mask));
+        }
+    }
+
+    for (; x <= to; x++) {
+        if (!matcher.matches(line[x]))
+            return x;
+    }
+
+    return to + 1;
+}
+
+
+static int findMismatchBackwardSse2(const ColorMatcher &matcher, const QRgb *line, int from, int to, QRgb referenceColor, int tolerance) {
+    const __m128i reference = _mm_set1_epi32(referenceColor);
+    const __m128i tolerances = _mm_set1_epi8(static_cast<char>(tolerance));
+
+    int x = from;
+    for (; x - 3 >= to; x -= 4) {
+        int mask = matchMask4(line + x - 3, reference, tolerances);
+        if (mask < 0) {
+            for (int i = 0; i < 4; i++) {
+                if (!matcher.matches(line[x-i]))
+                    return x - i;
+            }
+        } else if (mask != 0xf) {
+            // highest lane that does not match
+            quint32 mismatches = ~mask & 0xf;
+            return x - 3 + (31 - qCountLeadingZeroBits(mismatches));
+        }
+    }
+
+    for (; x >= to; x--) {
+        if (!matcher.matches(line[x]))
+            return x;
+    }
+
+    return to - 1;
+}
+
+TARGET_AVX2 static int findMismatchBackwardAvx2(const ColorMatcher &matcher, const QRgb *line, int from, int to, QRgb referenceColor, int tolerance) {
+    const __m256i reference = _mm256_set1_epi32(referenceColor);
+    const __m256i tolerances = _mm256_set1_epi8(static_cast<char>(tolerance));
+
+    int x = from;
+    for (; x - 7 >= to; x -= 8) {
+        int mask = matchMask8(line + x - 7, reference, tolerances);
+        if (mask < 0) {
+            for (int i = 0; i < 8; i++) {
+                if (!matcher.matches(line[x-i]))
+                    return x - i;
+            }
+        } else if (mask != 0xff) {
+            quint32 mismatches = ~mask & 0xff;
+            return x - 7 + (31 - qCountLeadingZeroBits(mismatches));
+        }
+    }
+
+    for (; x >= to; x--) {
+        if (!matcher.matches(line[x]))
+            return x;
+    }
+
+    return to - 1;
+}
+
+
+static QRect replaceInRowSse2(const ColorMatcher &matcher, QRgb *line, int y, int width, QRgb newPixel, QRgb referenceColor, int tolerance) {
+    const __m128i reference = _mm_set1_epi32(referenceColor);
+    const __m128i tolerances = _mm_set1_epi8(static_cast<char>(tolerance));
+    const __m128i newPixels = _mm_set1_epi32(newPixel);
+
+    int first = width;
+    int last = -1;
+    auto replaceOne = [&](int x) {
+        if (!matcher.matches(line[x]))
+            return;
+        line[x] = newPixel;
+        first = std::min(first, x);
+        last = x;
+    };
+
+    int x = 0;
+    for (; x + 3 < width; x += 4) {
+        auto pixelsPtr = reinterpret_cast<__m128i *>(line + x);
+        const __m128i px = _mm_loadu_si128(pixelsPtr);
+        if (!isAllStraight(px)) {
+            for (int i = 0; i < 4; i++)
+                replaceOne(x + i);
+            continue;
+        }
+
+        const __m128i similar = similarLanes(px, reference, tolerances);
+        const int mask = _mm_movemask_ps(_mm_castsi128_ps(similar));
+        if (mask == 0)
+            continue;
+
+        _mm_storeu_si128(pixelsPtr, _mm_or_si128(_mm_and_si128(similar, newPixels), _mm_andnot_si128(similar, px)));
+        first = std::min(first, x + (int)qCountTrailingZeroBits(static_cast<quint32>(mask)));
+        last = x + (31 - qCountLeadingZeroBits(static_cast<quint32>(mask)));
+    }
+
+    for (; x < width; x++)
+        replaceOne(x);
+
+    return replacedExtent(first, last, y);
+}
+
+TARGET_AVX2 static QRect replaceInRowAvx2(const ColorMatcher &matcher, QRgb *line, int y, int width, QRgb newPixel, QRgb referenceColor, int tolerance) {
+    const __m256i reference = _mm256_set1_epi32(referenceColor);
+    const __m256i tolerances = _mm256_set1_epi8(static_cast<char>(tolerance));
+    const __m256i newPixels = _mm256_set1_epi32(newPixel);
+
+    int first = width;
+    int last = -1;
+    auto replaceOne = [&](int x) {
+        if (!matcher.matches(line[x]))
+            return;
+        line[x] = newPixel;
+        first = std::min(first, x);
+        last = x;
+    };
+
+    int x = 0;
+    for (; x + 7 < width; x += 8) {
+        auto pixelsPtr = reinterpret_cast<__m256i *>(line + x);
+        const __m256i px = _mm256_loadu_si256(pixelsPtr);
+        if (!isAllStraight(px)) {
+            for (int i = 0; i < 8; i++)
+                replaceOne(x + i);
+            continue;
+        }
+
+        const __m256i similar = similarLanes(px, reference, tolerances);
+        const int mask = _mm256_movemask_ps(_mm256_castsi256_ps(similar));
+        if (mask == 0)
+            continue;
+
+        _mm256_storeu_si256(pixelsPtr, _mm256_blendv_epi8(px, newPixels, similar));
+        first = std::min(first, x + (int)qCountTrailingZeroBits(static_cast<quint32>(mask)));
+        last = x + (31 - qCountLeadingZeroBits(static_cast<quint32>(mask)));
+    }
+
+    for (; x < width; x++)
+        replaceOne(x);
+
+    return replacedExtent(first, last, y);
+}
+
+#endif // HAS_X86_SIMD
+
+
+int ColorMatcher::findMismatch(const QRgb *line, int from, int to) const {
+#ifdef HAS_X86_SIMD
+    if (CpuFeatures::hasAvx2())
+        return findMismatchAvx2(*this, line, from, to, m_referenceColor, m_tolerance);
+    return findMismatchSse2(*this, line, from, to, m_referenceColor, m_tolerance);
+#else
+    for (int x = from; x <= to; x++) {
+        if (!matches(line[x]))
+            return x;
+    }
+    return to + 1;
+#endif
+}
+
+int ColorMatcher::findMismatchBackward(const QRgb *line, int from, int to) const {
+#ifdef HAS_X86_SIMD
+    if (CpuFeatures::hasAvx2())
+        return findMismatchBackwardAvx2(*this, line, from, to, m_referenceColor, m_tolerance);
+    return findMismatchBackwardSse2(*this, line, from, to, m_referenceColor, m_tolerance);
+#else
+    for (int x = from; x >= to; x--) {
+        if (!matches(line[x]))
+            return x;
+    }
+    return to - 1;
+#endif
+}
+
+QRect ColorMatcher::replaceInRow(QRgb *line, int y, int width, QRgb newPixel) const {
+#ifdef HAS_X86_SIMD
+    if (CpuFeatures::hasAvx2())
+        return replaceInRowAvx2(*this, line, y, width, newPixel, m_referenceColor, m_tolerance);
+    return replaceInRowSse2(*this, line, y, width, newPixel, m_referenceColor, m_tolerance);
+#else
+    int first = width;
+    int last = -1;
+    for (int x = 0; x < width; x++) {
+        if (!matches(line[x]))
+            continue;
+        line[x] = newPixel;
+        first = std::min(first, x);
+        last = x;
+    }
+    return replacedExtent(first, last, y);
+#endif
+}
@@ -0,0 +1,32 @@
+#ifndef COLOR_MATCHER_H
+#define COLOR_MATCHER_H
+
+#include <QColor>
+#include <QRect>
+
+
+// Compares the pixels of premultiplied ARGB32 scanlines against a reference pixel.
+// Channels are compared unpremultiplied, the way QImage::pixelColor returns them;
+// fully opaque and fully transparent pixels are compared 4 or 8 at a time.
+class ColorMatcher {
+public:
+    ColorMatcher(QRgb referencePixel, int tolerance);
+
+    bool matches(QRgb pixel) const;
+
+    // first x in [from, to] that does not match, to+1 if all of them match
+    int findMismatch(const QRgb *line, int from, int to) const;
+    // first x in [to, from], going down from from, that does not match, to-1 if all of them match
+    int findMismatchBackward(const QRgb *line, int from, int to) const;
+
+    // overwrites the matching pixels of row y with newPixel; returns the replaced extent
+    QRect replaceInRow(QRgb *line, int y, int width, QRgb newPixel) const;
+
+private:
+    QRgb m_referencePixel;
+    QRgb m_referenceColor;
+    int m_tolerance;
+};
+
+
+#endif // COLOR_MATCHER_H
@@ -3,20 +3,102 @@
 #include "constants.h"
 #include "editor.h"
 #include "algorithms.h"
+#include "pixel_codec.h"
 
 #include <QPen>
 
+#include <algorithm>
+
+
+
+// round caps and joins, so that segments painted one by one look like the whole polyline
+static QPen strokePen(const QColor &color, int width) {
+    return QPen {color, static_cast<qreal>(width), Qt::SolidLine, Qt::RoundCap, Qt::RoundJoin};
+}
+
+// area covered by lines drawn with a pen of the given width, caps and antialiasing included
+static QRect strokeBounds(const QRect &linesBounds, int width) {
+    auto margin = width + 1;
+    return linesBounds.adjusted(-margin, -margin, margin, margin);
+}
+
+// canvas area covered by the round cursor of a pen of the given width, outline included
+static QRect cursorBounds(const QPoint &pos, int width) {
+    auto radius = width / 2 + 1;
+    return QRect {pos.x() - radius, pos.y() - radius, radius * 2 + 1, radius * 2 + 1};
+}
+
+
+void Command::performOn(TiledImage &image) const {
+    auto area = inputRect();
+    area = area.isNull() ? image.rect() : area.intersected(image.rect());
+    if (area.isEmpty())
+        return;
+
+    auto region = image.copy(area);
+    QPainter painter {&region};
+    painter.translate(-area.topLeft());
+    perform(painter);
+    painter.end();
+
+    // a command that could not tell its area in advance knows it now
+    auto writtenArea = affectedRect();
+    writtenArea = writtenArea.isNull() ? area : writtenArea.intersected(area);
+    image.paste(region.copy(writtenArea.translated(-area.topLeft())), writtenArea.topLeft());
+}
+
+void Command::performOnDocument(LayerStack &layers) const {
+    if (m_layer >= 0 && m_layer < layers.count())
+        performOn(layers.layer(m_layer).image);
+}
+
+void Command::performSegmentOn(TiledImage &image, const QPoint from, const QPoint to) const {
+    auto area = dragSegmentRect(from, to).intersected(image.rect());
+    if (area.isEmpty())
+        return;
+
+    auto region = image.copy(area);
+    QPainter painter {&region};
+    painter.translate(-area.topLeft());
+    performSegment(painter, from, to);
+    painter.end();
+
+    image.paste(region, area.topLeft());
+}
 
 
 void CommandDraw::continueDrag(const QPoint from, const QPoint to) {
-    m_lines->push_back(QPair<QPoint, QPoint> {from, to});
+    if (m_path.use_count() > 1)
+        m_path = std::make_shared<StrokePath>(*m_path);
+    m_path->append(from, to);
+}
+
+void CommandDraw::endDrag() {
+    if (m_path.use_count() > 1)
+        m_path = std::make_shared<StrokePath>(*m_path);
+    m_path->simplify(strokeSimplifyTolerance);
 }
 
 void CommandDraw::perform(QPainter &painter) const {
-    painter.setPen(QPen(m_color, m_width));
-    for (auto line: *m_lines) {
-        painter.drawLine(line.first, line.second);
-    }
+    painter.setPen(strokePen(m_color, m_width));
+    m_path->draw(painter);
+}
+
+QRect CommandDraw::affectedRect() const {
+    return strokeBounds(m_path->bounds(), m_width);
+}
+
+QRect CommandDraw::dragSegmentRect(const QPoint from, const QPoint to) const {
+    return strokeBounds(QRect {from, to}.normalized(), m_width);
+}
+
+void CommandDraw::performSegment(QPainter &painter, const QPoint from, const QPoint to) const {
+    painter.setPen(strokePen(m_color, m_width));
+    painter.drawLine(from, to);
+}
+
+qint64 CommandDraw::memoryUsage() const {
+    return sizeof(CommandDraw) + m_path->memoryUsage();
 }
 
 void CommandDraw::paintCustomCursor(QPainter &painter, QPoint pos) const {
@@ -26,25 +108,137 @@ void CommandDraw::paintCustomCursor(QPainter &painter, QPoint pos) const {
     painter.drawEllipse(pos.x() - radius, pos.y() - radius, radius * 2, radius * 2);
 }
 
+QRect CommandDraw::customCursorRect(QPoint pos) const {
+    return cursorBounds(pos, m_width);
+}
+
+
+void CommandBrush::updateMask() {
+    m_mask = std::make_shared<const QImage>(BrushEngine::makeMask(m_shape, m_width, m_hardness / 100.0, m_customTip));
+}
+
+double CommandBrush::spacingPx() const {
+    return std::max(1.0, m_width * m_spacing / 100.0);
+}
+
+void CommandBrush::continueDrag(const QPoint from, const QPoint to) {
+    if (m_path.use_count() > 1)
+        m_path = std::make_shared<StrokePath>(*m_path);
+    if (m_path->isEmpty())
+        m_nextOffset = 0.0;
+
+    // the dabs of the segment are only placed when painting, starting from the offset left by the previous one
+    m_segmentOffset = m_nextOffset;
+    m_nextOffset = BrushEngine::walkSegment(from, to, m_segmentOffset, spacingPx(), [](const QPointF &) {});
+    m_path->append(from, to);
+}
+
+void CommandBrush::endDrag() {
+    if (m_path.use_count() > 1)
+        m_path = std::make_shared<StrokePath>(*m_path);
+    m_path->simplify(strokeSimplifyTolerance);
+}
+
+void CommandBrush::performSegment(QPainter &painter, const QPoint from, const QPoint to) const {
+    BrushEngine::walkSegment(from, to, m_segmentOffset, spacingPx(), [&](const QPointF &center) {
+        BrushEngine::stamp(painter, *m_mask, center, m_color);
+    });
+}
+
+void CommandBrush::perform(QPainter &painter) const {
+    auto stampDab = [&](const QPointF &center) {
+        BrushEngine::stamp(painter, *m_mask, center, m_color);
+    };
+
+    for (int i = 0; i < m_path->runCount(); i++) {
+        auto points = m_path->run(i);
+        if (points.size() == 1) {
+            stampDab(points.front());
+            continue;
+        }
+
+        double offset = 0.0;
+        for (int j = 1; j < points.size(); j++)
+            offset = BrushEngine::walkSegment(points[j - 1], points[j], offset, spacingPx(), stampDab);
+    }
+}
+
+QRect CommandBrush::affectedRect() const {
+    return strokeBounds(m_path->bounds(), m_width);
+}
+
+QRect CommandBrush::dragSegmentRect(const QPoint from, const QPoint to) const {
+    return strokeBounds(QRect {from, to}.normalized(), m_width);
+}
+
+qint64 CommandBrush::memoryUsage() const {
+    // the mask is counted even though consecutive strokes usually share it
+    return sizeof(CommandBrush) + m_path->memoryUsage() + m_mask->sizeInBytes();
+}
+
+void CommandBrush::paintCustomCursor(QPainter &painter, QPoint pos) const {
+    // an outline, since a filled disc would hide what is under a large brush
+    auto radius = m_width / 2;
+    painter.setPen(cursorColor);
+    painter.setBrush(Qt::NoBrush);
+    painter.drawEllipse(pos.x() - radius, pos.y() - radius, radius * 2, radius * 2);
+}
+
+QRect CommandBrush::customCursorRect(QPoint pos) const {
+    return cursorBounds(pos, m_width);
+}
+
 
-void CommandFill::perform(QPainter &painter) const {
-    Algorithms::floodFill(painter, m_color, m_targetPos); 
-    // auto tmpPos = QPoint {100, 100};
-    // Algorithms::floodFill(painter, m_color, tmpPos);
+void CommandFill::performOnDocument(LayerStack &layers) const {
+    if (m_layer < 0 || m_layer >= layers.count())
+        return;
+
+    auto &image = layers.layer(m_layer).image;
+    // alternate mode recolors every similar pixel, not only the connected ones
+    if (m_mode == Alternate)
+        m_filledArea = Algorithms::replaceColor(image, m_color, m_targetPos, m_tolerance);
+    else
+        m_filledArea = Algorithms::floodFill(image, m_color, m_targetPos, m_tolerance);
 }
 
 
 
 void CommandErase::continueDrag(const QPoint from, const QPoint to) {
-    m_lines->push_back(QPair<QPoint, QPoint> {from, to});
+    if (m_path.use_count() > 1)
+        m_path = std::make_shared<StrokePath>(*m_path);
+    m_path->append(from, to);
+}
+
+void CommandErase::endDrag() {
+    if (m_path.use_count() > 1)
+        m_path = std::make_shared<StrokePath>(*m_path);
+    m_path->simplify(strokeSimplifyTolerance);
 }
 
 void CommandErase::perform(QPainter &painter) const {
-    painter.setPen(QPen(bkgColor, m_width));
-    for (auto line: *m_lines) {
-        painter.drawLine(line.first, line.second);
-    }
+    // the pen only gives the coverage: whatever is under it is cleared
+    painter.setCompositionMode(QPainter::CompositionMode_DestinationOut);
+    painter.setPen(strokePen(Qt::black, m_width));
+    m_path->draw(painter);
+
+}
 
+QRect CommandErase::affectedRect() const {
+    return strokeBounds(m_path->bounds(), m_width);
+}
+
+QRect CommandErase::dragSegmentRect(const QPoint from, const QPoint to) const {
+    return strokeBounds(QRect {from, to}.normalized(), m_width);
+}
+
+void CommandErase::performSegment(QPainter &painter, const QPoint from, const QPoint to) const {
+    // coverage, erased from the layer when composited with segmentBlendMode()
+    painter.setPen(strokePen(Qt::black, m_width));
+    painter.drawLine(from, to);
+}
+
+qint64 CommandErase::memoryUsage() const {
+    return sizeof(CommandErase) + m_path->memoryUsage();
 }
 
 void CommandErase::paintCustomCursor(QPainter &painter, QPoint pos) const {
@@ -53,6 +247,10 @@ void CommandErase::paintCustomCursor(QPainter &painter, QPoint pos) const {
     painter.drawEllipse(pos.x() - radius, pos.y() - radius, radius * 2, radius * 2);
 }
 
+QRect CommandErase::customCursorRect(QPoint pos) const {
+    return cursorBounds(pos, m_width);
+}
+
 void CommandSelect::startDrag(const QPoint pos) {
     m_from = pos;
 }
@@ -70,7 +268,92 @@ void CommandCut::perform(QPainter &painter) const {
 }
 
 void CommandPaste::perform(QPainter &painter) const {
-    painter.drawPixmap(m_targetArea, *m_data);
+    if (!m_data.isNull())
+        painter.drawImage(m_targetArea, m_data);
+    else
+        painter.drawImage(m_targetArea, PixelCodec::decode(m_encodedData, m_encodedSize, m_encodedFormat));
+}
+
+qint64 CommandPaste::memoryUsage() const {
+    qint64 dataBytes = m_encodedData.size();
+    if (!m_data.isNull())
+        dataBytes += m_data.sizeInBytes();
+
+    return sizeof(CommandPaste) + dataBytes;
+}
+
+void CommandPaste::compact() {
+    if (m_data.isNull())
+        return;
+
+    m_encodedData = PixelCodec::encode(m_data);
+    m_encodedSize = m_data.size();
+    m_encodedFormat = m_data.format();
+    m_data = QImage {};
+}
+
+
+void CommandLayer::performOnDocument(LayerStack &layers) const {
+    switch (m_operation) {
+        case LayerOperation::Add:
+            layers.insert(m_layer, m_properties);
+            break;
+        case LayerOperation::Remove:
+            // the last layer always stays
+            if (layers.count() > 1)
+                layers.remove(m_layer);
+            break;
+        case LayerOperation::MoveUp:
+            if (m_layer + 1 < layers.count())
+                layers.move(m_layer, m_layer + 1);
+            break;
+        case LayerOperation::MoveDown:
+            if (m_layer > 0)
+                layers.move(m_layer, m_layer - 1);
+            break;
+        case LayerOperation::SetProperties:
+            layers.layer(m_layer).properties = m_properties;
+            break;
+    }
+}
+
+
+ConvolutionKernel CommandFilter::kernel() const {
+    switch (m_filterType) {
+        case FilterType::GaussianBlur:
+            return ConvolutionKernel::gaussian(m_radius);
+        case FilterType::Sharpen:
+            return ConvolutionKernel::sharpen();
+        case FilterType::Emboss:
+            return ConvolutionKernel::emboss();
+        case FilterType::EdgeDetect:
+            return ConvolutionKernel::edgeDetect();
+    }
+
+    return ConvolutionKernel {};
+}
+
+void CommandFilter::performOnDocument(LayerStack &layers) const {
+    if (m_layer < 0 || m_layer >= layers.count())
+        return;
+
+    FilterEngine::apply(layers.layer(m_layer).image, m_targetArea, kernel());
+}
+
+
+std::vector<int> CommandBlur::boxRadii() const {
+    if (m_shape == BlurShape::Box)
+        return {m_radius};
+
+    // same standard deviation as the Gaussian convolution kernel of this radius
+    return BoxBlur::gaussianRadii(std::max(m_radius / 3.0, 0.5));
+}
+
+void CommandBlur::performOnDocument(LayerStack &layers) const {
+    if (m_layer < 0 || m_layer >= layers.count())
+        return;
+
+    BoxBlur::apply(layers.layer(m_layer).image, m_targetArea, boxRadii());
 }
 
 
@@ -2,9 +2,17 @@
 #define COMMAND_H
 
 #include "constants.h"
+#include "tiled_image.h"
+#include "layer_stack.h"
+#include "stroke_path.h"
+#include "brush_engine.h"
+#include "filter_engine.h"
+#include "box_blur.h"
 
 #include "qnamespace.h"
 #include <QPixmap>
+#include <QImage>
+#include <QByteArray>
 #include <QColor>
 #include <QPoint>
 #include <QPair>
@@ -21,13 +29,17 @@ class Editor;
 enum CommandType {
     Select,
     Draw,
+    Brush,
     Fill,
     Erase,
     Cut,
     Copy,
     Paste,
+    Filter,
+    Blur,
     Scroll,
     Zoom,
+    Layers,
 };
 
 enum CommandMode {
@@ -40,6 +52,9 @@ class Command {
 public:
     void setMode(CommandMode mode) { m_mode = mode; };
     void setEditor(Editor *editor) { m_editor = editor; }
+    // index of the layer the command paints on
+    void setLayer(int layer) { m_layer = layer; }
+    int layer() const { return m_layer; }
 
     virtual ~Command() = default;
     virtual std::unique_ptr<Command> clone() const = 0;
@@ -53,76 +68,185 @@ public:
     virtual bool isDraggable() const { return false; };
     virtual void startDrag(const QPoint pos) {};
     virtual void continueDrag(const QPoint from, const QPoint to) {};
+    // called once the last segment has been added, before the command is performed
+    virtual void endDrag() {};
+    // document area touched by the segment just added by continueDrag()
+    virtual QRect dragSegmentRect(const QPoint from, const QPoint to) const { return affectedRect(); }
+    // paints only the segment just added by continueDrag()
+    virtual void performSegment(QPainter &painter, const QPoint from, const QPoint to) const {};
+    // how the segments painted by performSegment() combine with the layer below them
+    virtual BlendMode segmentBlendMode() const { return BlendMode::Normal; }
+    // performs the segment on the part of image given by dragSegmentRect()
+    void performSegmentOn(TiledImage &image, const QPoint from, const QPoint to) const;
     
     virtual bool isWheelable() const { return false; };
     virtual void setWheelDelta(int delta) {};
 
     virtual void perform() const {};
     virtual void perform(QPainter &painter) const {};
+    // document area touched by perform(QPainter &); a null rect stands for the whole document
+    virtual QRect affectedRect() const { return QRect {}; }
+    // document area perform(QPainter &) reads or paints; a null rect stands for the whole document
+    virtual QRect inputRect() const { return affectedRect(); }
+    // performs the command on the part of image given by inputRect()
+    void performOn(TiledImage &image) const;
+    // performs the command on its layer of the document
+    virtual void performOnDocument(LayerStack &layers) const;
+    // true for commands that change the layers themselves rather than their pixels
+    virtual bool changesLayerStack() const { return false; }
+    // true for a modifying command that would not change anything
+    virtual bool isEmpty() const { return false; }
+    // approximate heap and object size, as accounted by the history
+    virtual qint64 memoryUsage() const { return sizeof(Command); }
+    // called once the command is stored in the history, to shrink what it holds
+    virtual void compact() {}
     virtual const Qt::CursorShape getCursor() const { return Qt::ArrowCursor; }
     virtual bool usesCustomCursor() const { return false; };
     virtual void paintCustomCursor(QPainter &painter, QPoint pos) const {};
+    // canvas area covered by paintCustomCursor()
+    virtual QRect customCursorRect(QPoint pos) const { return QRect {}; }
 
 protected:
-    CommandMode m_mode;
+    CommandMode m_mode = Primary;
     Editor *m_editor;
+    int m_layer = 0;
 };
 
 class CommandDraw: public Command {
 
 public:
     CommandDraw(const QColor &color, int width): m_width(width), m_color(color) {
-        m_lines = std::make_unique<std::vector<QPair<QPoint, QPoint>>>();
+        m_path = std::make_shared<StrokePath>();
     }
 
-    CommandDraw(const CommandDraw &other): m_width(other.m_width), m_color(other.m_color) {
-        m_lines = std::make_unique<std::vector<QPair<QPoint, QPoint>>>();
+    void setWidth(int width) {
+        m_width = width;
+    }
+
+    void setColor(const QColor &color) {
+        m_color = color;
+    }
+
+    std::unique_ptr<Command> clone() const override {
+        return std::make_unique<CommandDraw>(*this);
+    }
+
+    CommandType type() const override { return CommandType::Draw; }
+    virtual bool isModifying() const override { return true; };
+
+    QColor color() const { return m_color; }
+
+    bool isDraggable() const override { return true; };
+    void continueDrag(const QPoint from, const QPoint to) override;
+    void endDrag() override;
+    QRect dragSegmentRect(const QPoint from, const QPoint to) const override;
+    void performSegment(QPainter &painter, const QPoint from, const QPoint to) const override;
+    void perform(QPainter &painter) const override;
+    QRect affectedRect() const override;
+    bool isEmpty() const override { return m_path->isEmpty(); }
+    qint64 memoryUsage() const override;
+    virtual const Qt::CursorShape getCursor() const override { return Qt::BlankCursor; }
+    bool usesCustomCursor() const override { return true; };
+    void paintCustomCursor(QPainter &painter, QPoint pos) const override;
+    QRect customCursorRect(QPoint pos) const override;
+
+protected:
+    int m_width;
+    QColor m_color;
+    // shared between clones, copied on the next write
+    std::shared_ptr<StrokePath> m_path;
+};
+
+
+// Stroke made of dabs of a precomputed mask, which keeps large and soft brushes cheap
+class CommandBrush: public Command {
 
-        for (auto line: *other.m_lines) {
-            m_lines->push_back(line);
-        }
+public:
+    CommandBrush(const QColor &color, int width): m_width(width), m_color(color) {
+        m_path = std::make_shared<StrokePath>();
+        updateMask();
     }
 
     void setWidth(int width) {
         m_width = width;
+        updateMask();
     }
 
     void setColor(const QColor &color) {
         m_color = color;
     }
 
+    void setHardness(int hardness) {
+        m_hardness = hardness;
+        updateMask();
+    }
+
+    void setSpacing(int spacing) {
+        m_spacing = spacing;
+    }
+
+    void setShape(BrushShape shape, const QImage &customTip = QImage {}) {
+        m_shape = shape;
+        m_customTip = customTip;
+        updateMask();
+    }
+
     std::unique_ptr<Command> clone() const override {
-        return std::make_unique<CommandDraw>(*this);
+        return std::make_unique<CommandBrush>(*this);
     }
 
-    CommandType type() const override { return CommandType::Draw; }
+    CommandType type() const override { return CommandType::Brush; }
     virtual bool isModifying() const override { return true; };
 
     QColor color() const { return m_color; }
 
     bool isDraggable() const override { return true; };
     void continueDrag(const QPoint from, const QPoint to) override;
+    void endDrag() override;
+    QRect dragSegmentRect(const QPoint from, const QPoint to) const override;
+    void performSegment(QPainter &painter, const QPoint from, const QPoint to) const override;
     void perform(QPainter &painter) const override;
+    QRect affectedRect() const override;
+    bool isEmpty() const override { return m_path->isEmpty(); }
+    qint64 memoryUsage() const override;
     virtual const Qt::CursorShape getCursor() const override { return Qt::BlankCursor; }
     bool usesCustomCursor() const override { return true; };
     void paintCustomCursor(QPainter &painter, QPoint pos) const override;
+    QRect customCursorRect(QPoint pos) const override;
 
 protected:
     int m_width;
     QColor m_color;
-    std::unique_ptr<std::vector<QPair<QPoint, QPoint>>> m_lines;
+    int m_hardness = defaultBrushHardness; //in percent
+    int m_spacing = defaultBrushSpacing; //in percent of m_width
+    BrushShape m_shape = BrushShape::Round;
+    QImage m_customTip;
+    // shared between clones, rebuilt when the brush changes
+    std::shared_ptr<const QImage> m_mask;
+    // shared between clones, copied on the next write
+    std::shared_ptr<StrokePath> m_path;
+    // distance to the next dab at the start of the last segment added, and at its end
+    double m_segmentOffset = 0.0;
+    double m_nextOffset = 0.0;
+
+    double spacingPx() const;
+    void updateMask();
 };
 
 
 class CommandFill: public Command {
 
 public:
-    CommandFill(const QColor &color, const QPoint &targetPos): m_color(color), m_targetPos(targetPos) {}
+    CommandFill(const QColor &color, const QPoint &targetPos): m_color(color), m_targetPos(targetPos), m_tolerance(defaultFillTolerance) {}
 
     void setColor(const QColor &color) {
         m_color = color;
     }
 
+    void setTolerance(int tolerance) {
+        m_tolerance = tolerance;
+    }
+
     std::unique_ptr<Command> clone() const override {
         return std::make_unique<CommandFill>(*this);
     }
@@ -134,12 +258,17 @@ public:
 
     QColor color() const { return m_color; }
 
-    void perform(QPainter &painter) const override;
+    // fills the tiles of the layer in place, reading only those the fill reaches
+    void performOnDocument(LayerStack &layers) const override;
+    // only known once the fill has been performed
+    QRect affectedRect() const override { return m_filledArea; }
     const Qt::CursorShape getCursor() const override { return Qt::ArrowCursor; }
 
 protected:
     QColor m_color;
     QPoint m_targetPos;
+    int m_tolerance;
+    mutable QRect m_filledArea;
 };
 
 
@@ -147,15 +276,7 @@ class CommandErase: public Command {
 
 public:
     CommandErase(int width): m_width(width) {
-        m_lines = std::make_unique<std::vector<QPair<QPoint, QPoint>>>();
-    }
-
-    CommandErase(const CommandErase &other): m_width(other.m_width) {
-        m_lines = std::make_unique<std::vector<QPair<QPoint, QPoint>>>();
-
-        for (auto line: *other.m_lines) {
-            m_lines->push_back(line);
-        }
+        m_path = std::make_shared<StrokePath>();
     }
 
     void setWidth(int width) {
@@ -171,15 +292,24 @@ public:
 
     bool isDraggable() const override { return true; };
     void continueDrag(const QPoint from, const QPoint to) override;
+    void endDrag() override;
+    QRect dragSegmentRect(const QPoint from, const QPoint to) const override;
+    void performSegment(QPainter &painter, const QPoint from, const QPoint to) const override;
+    BlendMode segmentBlendMode() const override { return BlendMode::Erase; }
     void perform(QPainter &painter) const override;
+    QRect affectedRect() const override;
+    bool isEmpty() const override { return m_path->isEmpty(); }
+    qint64 memoryUsage() const override;
     
     virtual const Qt::CursorShape getCursor() const override { return Qt::BlankCursor; }
     bool usesCustomCursor() const override { return true; };
     void paintCustomCursor(QPainter &painter, QPoint pos) const override;
+    QRect customCursorRect(QPoint pos) const override;
 
 protected:
     int m_width;
-    std::unique_ptr<std::vector<QPair<QPoint, QPoint>>> m_lines;
+    // shared between clones, copied on the next write
+    std::shared_ptr<StrokePath> m_path;
 };
 
 
@@ -223,23 +353,87 @@ public:
     bool isModifying() const override { return true; };
 
     void perform(QPainter &painter) const override;
+    QRect affectedRect() const override { return m_targetArea; }
 
 protected:
     QRect m_targetArea;
 };
 
 
-class CommandCopy: public Command {
+enum class FilterType {
+    GaussianBlur,
+    Sharpen,
+    Emboss,
+    EdgeDetect,
+};
+
+// Convolution of the target area, or of the whole layer when it is null
+class CommandFilter: public Command {
 
 public:
-    CommandCopy(QPixmap & data) {
-        m_data = std::make_unique<QPixmap>(data);
+    CommandFilter(FilterType filterType, const QRect &targetArea, int radius = defaultBlurRadius):
+        m_filterType(filterType), m_targetArea(targetArea), m_radius(radius) {}
+
+    std::unique_ptr<Command> clone() const override {
+        return std::make_unique<CommandFilter>(*this);
     }
 
-    CommandCopy(const CommandCopy& other) {
-        m_data = std::make_unique<QPixmap>(other.m_data->copy());
+    CommandType type() const override { return CommandType::Filter; }
+    bool isModifying() const override { return true; };
+
+    QRect affectedRect() const override { return m_targetArea; }
+    void performOnDocument(LayerStack &layers) const override;
+    qint64 memoryUsage() const override { return sizeof(CommandFilter); }
+
+    // built when performed, since large kernels would take more memory than the command
+    ConvolutionKernel kernel() const;
+
+protected:
+    FilterType m_filterType;
+    QRect m_targetArea;
+    int m_radius; //of the blur
+};
+
+
+enum class BlurShape {
+    Box,
+    Gaussian, //approximated by successive boxes
+};
+
+// Blur of the target area, or of the whole layer when it is null, read from summed-area
+// tables; it costs the same per pixel at any radius
+class CommandBlur: public Command {
+
+public:
+    CommandBlur(BlurShape shape, const QRect &targetArea, int radius):
+        m_shape(shape), m_targetArea(targetArea), m_radius(radius) {}
+
+    std::unique_ptr<Command> clone() const override {
+        return std::make_unique<CommandBlur>(*this);
     }
 
+    CommandType type() const override { return CommandType::Blur; }
+    bool isModifying() const override { return true; };
+
+    QRect affectedRect() const override { return m_targetArea; }
+    void performOnDocument(LayerStack &layers) const override;
+    qint64 memoryUsage() const override { return sizeof(CommandBlur); }
+
+    // radii of the box passes
+    std::vector<int> boxRadii() const;
+
+protected:
+    BlurShape m_shape;
+    QRect m_targetArea;
+    int m_radius;
+};
+
+
+class CommandCopy: public Command {
+
+public:
+    CommandCopy(const QImage & data): m_data(data) {}
+
     std::unique_ptr<Command> clone() const override {
         return std::make_unique<CommandCopy>(*this);
     }
@@ -248,20 +442,14 @@ public:
     bool isModifying() const override { return false; };
 
 protected:
-    std::unique_ptr<QPixmap> m_data;
+    QImage m_data; //implicitly shared with the clones
 };
 
 
 class CommandPaste: public Command {
 
 public:
-    CommandPaste(QRect &targetArea, QPixmap & data): m_targetArea(targetArea) {
-        m_data = std::make_unique<QPixmap>(data);
-    }
-
-    CommandPaste(const CommandPaste& other) {
-        m_data = std::make_unique<QPixmap>(other.m_data->copy());
-    }
+    CommandPaste(QRect &targetArea, const QImage & data): m_targetArea(targetArea), m_data(data) {}
 
     std::unique_ptr<Command> clone() const override {
         return std::make_unique<CommandPaste>(*this);
@@ -271,10 +459,49 @@ public:
     bool isModifying() const override { return true; };
 
     void perform(QPainter &painter) const override;
+    QRect affectedRect() const override { return m_targetArea; }
+    qint64 memoryUsage() const override;
+    void compact() override;
 
 protected:
     QRect m_targetArea;
-    std::unique_ptr<QPixmap> m_data;
+    QImage m_data; //implicitly shared with the clones, null once compacted
+    // m_data as encoded by PixelCodec
+    QByteArray m_encodedData;
+    QSize m_encodedSize;
+    QImage::Format m_encodedFormat = QImage::Format_ARGB32_Premultiplied;
+};
+
+
+enum class LayerOperation {
+    Add,
+    Remove,
+    MoveUp,
+    MoveDown,
+    SetProperties,
+};
+
+// Change to the layer stack: the layer it works on is the one given by setLayer()
+class CommandLayer: public Command {
+
+public:
+    CommandLayer(LayerOperation operation, const LayerProperties &properties = LayerProperties {}):
+        m_operation(operation), m_properties(properties) {}
+
+    std::unique_ptr<Command> clone() const override {
+        return std::make_unique<CommandLayer>(*this);
+    }
+
+    CommandType type() const override { return CommandType::Layers; }
+    bool isModifying() const override { return true; };
+    bool changesLayerStack() const override { return true; }
+
+    void performOnDocument(LayerStack &layers) const override;
+    qint64 memoryUsage() const override { return sizeof(CommandLayer) + m_properties.name.size() * sizeof(QChar); }
+
+protected:
+    LayerOperation m_operation;
+    LayerProperties m_properties; //of the new layer, or the new ones of the layer
 };
 
 
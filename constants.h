@@ -10,6 +10,20 @@ constexpr QColor cursorColor = QColorConstants::Black;
 
 constexpr int defaultDrawWidth = 5;
 constexpr int maxDrawWidth = 20;
+constexpr int maxBrushWidth = 1000; //dabs are stamped, not stroked, so they can be much larger
+
+constexpr int defaultBrushHardness = 50; //in percent
+constexpr int defaultBrushSpacing = 15; //in percent of the brush width
+constexpr double ellipticalBrushAspect = 0.5; //height over width
+
+constexpr double strokeSimplifyTolerance = 0.5; //in px; stroke points closer than this to a straight line are dropped
+
+constexpr int defaultFillTolerance = 1; //per channel, 0-255
+constexpr int maxFillTolerance = 255;
+
+constexpr int defaultBlurRadius = 5; //in px
+constexpr int maxBlurRadius = 100;
+constexpr int maxFastBlurRadius = 250; //summed-area tables cost the same at any radius
 
 constexpr int toolThumbnailSize = 32;
 
@@ -21,6 +35,17 @@ constexpr double maxZoomLevel = 10.0;
 constexpr double minZoomLevel = 0.01;
 
 constexpr int defaultScrollAmount = 20; //in pixels
+constexpr int frameInterval = 16; //in ms; drag samples are passed on at most once per frame
 constexpr int defaultZoomFactor = 2; //multiplicative factor
 
+// undo/redo replays commands from the closest buffer snapshot
+constexpr int checkpointCommandInterval = 16; //snapshot at least every n commands
+constexpr qint64 checkpointReplayCost = 150 * 1000 * 1000; //or once replaying would take this long, in ns
+
+// history memory ceiling; over it the oldest commands are baked into the base buffer
+constexpr qint64 defaultHistoryMemoryBudget = 512 * 1024 * 1024; //in bytes
+
+// document tiles past this are paged out to a scratch file, least recently used first
+constexpr qint64 defaultTileMemoryBudget = 2LL * 1024 * 1024 * 1024; //in bytes
+
 #endif // CONSTANTS_H
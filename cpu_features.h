@@ -0,0 +1,36 @@
+#ifndef CPU_FEATURES_H
+#define CPU_FEATURES_H
+
+
+// x86 SIMD code paths are compiled with per-function target attributes
+// and chosen at run time, so the build does not need any -m flags
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && defined(__SSE2__)
+#define HAS_X86_SIMD 1
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+
+class CpuFeatures {
+public:
+    static bool hasSse41() {
+#ifdef HAS_X86_SIMD
+        static const bool isSupported = __builtin_cpu_supports("sse4.1");
+        return isSupported;
+#else
+        return false;
+#endif
+    }
+
+    static bool hasAvx2() {
+#ifdef HAS_X86_SIMD
+        static const bool isSupported = __builtin_cpu_supports("avx2");
+        return isSupported;
+#else
+        return false;
+#endif
+    }
+};
+
+
+#endif // CPU_FEATURES_H
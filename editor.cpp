@@ -11,9 +11,12 @@
 #include <QPen>
 #include <QGuiApplication>
 #include <QClipboard>
+#include <QElapsedTimer>
+#include <QTransform>
 
 #include <iostream>
 #include <memory>
+#include <algorithm>
 
 
 
@@ -21,19 +24,23 @@
 Editor::Editor(int width, int height): 
     m_width(width), m_height(height), m_zoomLevel(1.0) {
     
-    m_initialBuffer = QPixmap(m_width, m_height);
-    m_initialBuffer.fill(bkgColor);
-
-    m_currBuffer = QPixmap(m_width, m_height);
-    m_currBuffer.fill(bkgColor);
+    // bkgColor is transparent, which is what unallocated tiles hold
+    m_currBuffer = LayerStack {TiledImage {QSize {m_width, m_height}}};
+    m_history.setLiveBuffer(&m_currBuffer);
+    m_history.reset(m_currBuffer);
 
     m_isModified = false;
+
+    connect(&m_replay, &HistoryReplay::finished, this, &Editor::onReplayFinished);
 }
 
 
 void Editor::setCurrentSelection(QRect selection) {
+    auto oldSelection = m_currSelection;
     m_currSelection = selection;
-    emit somethingDrawn();
+    // the outline is not part of the document, so nothing is drawn
+    if (oldSelection != m_currSelection)
+        emit selectionMoved(oldSelection, m_currSelection);
     emit selectionChanged(!m_currSelection.isEmpty());
 }
 
@@ -44,30 +51,31 @@ bool isClipboardValid() {
 
 
 void Editor::newFile() {
-    m_initialBuffer = QPixmap(m_width, m_height);
-    m_initialBuffer.fill(bkgColor);
-
-    resetDocument();
+    resetDocument(LayerStack {TiledImage {QSize {m_width, m_height}}});
 }
 
-bool Editor::loadFile(const QString filename) {
-    bool isLoadOk = m_initialBuffer.load(filename);
+bool Editor::loadFile(const QString filename, QString *errorString) {
+    TiledImage buffer;
+    bool isLoadOk = buffer.load(filename, errorString);
     if (!isLoadOk)
         return false;
 
-    resetDocument();
+    resetDocument(LayerStack {buffer});
 
     emit somethingDrawn();
 
     return true;
 }
 
-bool Editor::saveFile(const QString filename) {
-    bool isSaveOk = m_currBuffer.save(filename);
+bool Editor::saveFile(const QString filename, QString *errorString) {
+    m_replay.finish();
+
+    // layers are not kept in the file, only what they look like together
+    bool isSaveOk = buffer().save(filename, errorString);
     if (!isSaveOk)
         return false;
 
-    reset(m_initialBuffer, m_currBuffer);
+    reset(m_currBuffer);
     setModified(false);
     emit somethingDrawn();
 
@@ -85,88 +93,161 @@ void Editor::zoom(double zoomFactor, const QPoint & zoomPos) {
 }
 
 
+void Editor::setHistoryMemoryBudget(qint64 bytes) {
+    // baking would change the commands the replay is working on
+    m_replay.finish();
+    m_history.setMemoryBudget(bytes);
+    notifyHistoryChanged();
+}
+
+
 void Editor::onUndo() {
-    assert(m_cmdStackPos >= 0);
+    assert(m_history.position() >= 0);
 
-    //std::cout << "before undo; m_commandStack.size()=" << m_commandStack.size() << "; m_cmdStackPos=" << m_cmdStackPos << std::endl;
-    if (m_cmdStackPos == 0)
+    if (m_history.position() == 0)
         return;
 
-    m_cmdStackPos --;
+    m_history.setPosition(m_history.position() - 1);
 
-    restoreCommandsFromStack();
-    //std::cout << "after undo; m_commandStack.size()=" << m_commandStack.size() << "; m_cmdStackPos=" << m_cmdStackPos << std::endl;
-    emit commandStackChanged(m_cmdStack, m_cmdStackPos);
+    // during a replay the buffer is not at the previous position, so patches do not apply to it
+    auto &undoPatch = m_history.entry(m_history.position()).undoPatch;
+    if (undoPatch.isValid() && !isReplaying()) {
+        undoPatch.restore(m_currBuffer);
+
+        updateModifiedStatus();
+        notifyLayerDrawn(undoPatch.layer(), undoPatch.area());
+    } else {
+        restoreCommandsFromStack();
+    }
+    notifyHistoryChanged();
 }
 
 void Editor::onRedo() {
-    //std::cout << "before redo; m_commandStack.size()=" << m_commandStack.size() << "; m_cmdStackPos=" << m_cmdStackPos << std::endl;
-    assert(m_cmdStackPos <= (int)m_cmdStack.size());
+    assert(m_history.position() <= m_history.size());
+
+    if (m_history.position() == m_history.size())
+        return;
 
-    if (m_cmdStackPos == (int)m_cmdStack.size())
+    if (isReplaying()) {
+        // the replay in progress is restarted towards the new position
+        m_history.setPosition(m_history.position() + 1);
+        restoreCommandsFromStack();
+        notifyHistoryChanged();
         return;
+    }
+
+    // the buffer is exactly as the command left it, so it can just be performed again
+    auto &redoneEntry = m_history.entry(m_history.position());
+    QElapsedTimer timer;
+    timer.start();
 
-    m_cmdStackPos ++;
+    auto &redoneCommand = *redoneEntry.command;
+    redoneCommand.performOnDocument(m_currBuffer);
 
-    restoreCommandsFromStack();
-    //std::cout << "after redo; m_commandStack.size()=" << m_commandStack.size() << "; m_cmdStackPos=" << m_cmdStackPos << std::endl;
-    emit commandStackChanged(m_cmdStack, m_cmdStackPos);
+    redoneEntry.replayCost = timer.nsecsElapsed();
+    m_history.setPosition(m_history.position() + 1);
+    m_history.updateCheckpoints(m_currBuffer);
+
+    setModified(true);
+    if (redoneCommand.changesLayerStack())
+        notifyLayersChanged();
+    else
+        notifyLayerDrawn(redoneCommand.layer(), redoneCommand.affectedRect());
+    notifyHistoryChanged();
 }
 
 void Editor::onCut() {
+    if (deferDuringReplay([=]() { onCut(); }))
+        return;
+
     if (m_currSelection.isEmpty())
         return;
 
     assert(m_currCommand == nullptr);
 
-    QPixmap clipboardData = m_currBuffer.copy(m_currSelection);
-    QGuiApplication::clipboard()->setPixmap(clipboardData);
+    auto clipboardData = m_currBuffer.layer(m_activeLayer).image.copy(m_currSelection);
+    QGuiApplication::clipboard()->setImage(clipboardData);
 
     m_currCommand = std::unique_ptr<Command>(new CommandCut(m_currSelection));
+    m_currCommand->setLayer(m_activeLayer);
     performCompleteCommand();
     pushCurrentCommand();
-    emit commandStackChanged(m_cmdStack, m_cmdStackPos);
 }
 
 void Editor::onCopy() {
+    if (deferDuringReplay([=]() { onCopy(); }))
+        return;
+
     if (m_currSelection.isEmpty())
         return;
 
     //TODO: incapsulate in a Command?
     //TODO: check on native Linux
-    QPixmap clipboardData = m_currBuffer.copy(m_currSelection);
-    QGuiApplication::clipboard()->setPixmap(clipboardData);
+    auto clipboardData = m_currBuffer.layer(m_activeLayer).image.copy(m_currSelection);
+    QGuiApplication::clipboard()->setImage(clipboardData);
 }
 
 void Editor::onPaste() {
+    if (deferDuringReplay([=]() { onPaste(); }))
+        return;
+
     assert(m_currCommand == nullptr);
 
     auto clipboardData = QGuiApplication::clipboard()->image();
-    if (clipboardData.isNull())
+    if (clipboardData.isNull() || m_currSelection.isEmpty())
         return;
 
-    auto rawData = QPixmap::fromImage(clipboardData);
-    m_currCommand = std::unique_ptr<Command>(new CommandPaste(m_currSelection, rawData));
+    // converted once here, so that painting and compacting the command need no conversion;
+    // RGB32 pixels are already valid premultiplied pixels
+    if (clipboardData.format() != QImage::Format_ARGB32_Premultiplied && clipboardData.format() != QImage::Format_RGB32)
+        clipboardData = clipboardData.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    m_currCommand = std::unique_ptr<Command>(new CommandPaste(m_currSelection, clipboardData));
+    m_currCommand->setLayer(m_activeLayer);
     performCompleteCommand();
     pushCurrentCommand();
-    emit commandStackChanged(m_cmdStack, m_cmdStackPos);
 }
 
 
 void Editor::onSelectAll() {
-    m_currSelection = QRect {0, 0, m_width, m_height};
-    emit somethingDrawn();
-    emit selectionChanged(true);
+    setCurrentSelection(QRect {0, 0, m_width, m_height});
 }
 
 void Editor::onSelectNone() {
-    m_currSelection = QRect {0, 0, 0, 0};
-    emit somethingDrawn();
-    emit selectionChanged(false);
+    setCurrentSelection(QRect {0, 0, 0, 0});
+}
+
+
+void Editor::onFilterChosen(FilterType filterType, int radius) {
+    if (deferDuringReplay([=]() { onFilterChosen(filterType, radius); }))
+        return;
+
+    assert(m_currCommand == nullptr);
+
+    auto targetArea = m_currSelection.isEmpty() ? QRect {} : m_currSelection;
+    m_currCommand = std::unique_ptr<Command>(new CommandFilter(filterType, targetArea, radius));
+    m_currCommand->setLayer(m_activeLayer);
+    performCompleteCommand();
+    pushCurrentCommand();
+}
+
+void Editor::onBlurChosen(BlurShape shape, int radius) {
+    if (deferDuringReplay([=]() { onBlurChosen(shape, radius); }))
+        return;
+
+    assert(m_currCommand == nullptr);
+
+    auto targetArea = m_currSelection.isEmpty() ? QRect {} : m_currSelection;
+    m_currCommand = std::unique_ptr<Command>(new CommandBlur(shape, targetArea, radius));
+    m_currCommand->setLayer(m_activeLayer);
+    performCompleteCommand();
+    pushCurrentCommand();
 }
 
 
 void Editor::onClicked(const QPoint pos, Qt::MouseButton button) {
+    if (deferDuringReplay([=]() { onClicked(pos, button); }))
+        return;
+
     Command * maybeCmd = ToolConfig::instance().getConfig(m_activeTool);
     if (!maybeCmd->isClickable()) {
         //FIXME: use a ToolSetting class instead
@@ -178,12 +259,18 @@ void Editor::onClicked(const QPoint pos, Qt::MouseButton button) {
     m_currCommand = ToolConfig::instance().createCommand(m_activeTool);
     m_currCommand->setMode((button == Qt::LeftButton) ? CommandMode::Primary : CommandMode::Alternate );
     m_currCommand->setEditor(this);
+    m_currCommand->setLayer(m_activeLayer);
     m_currCommand->setTargetPos(pos);
 
+    // a click outside the document leaves it as it is; a fill there would not even know its area
+    if (m_currCommand->isModifying() && !m_currBuffer.rect().contains(pos)) {
+        m_currCommand.reset();
+        return;
+    }
+
     performCompleteCommand();
     if (m_currCommand->isModifying()) {
         pushCurrentCommand();
-        emit commandStackChanged(m_cmdStack, m_cmdStackPos);
     } else {
         m_currCommand.reset();
     }
@@ -192,6 +279,9 @@ void Editor::onClicked(const QPoint pos, Qt::MouseButton button) {
 }
 
 void Editor::onDragStarted(const QPoint pos) {
+    if (deferDuringReplay([=]() { onDragStarted(pos); }))
+        return;
+
     Command * maybeCmd = ToolConfig::instance().getConfig(m_activeTool);
     if (!maybeCmd->isDraggable()) {
         //FIXME: use a ToolSetting class instead
@@ -200,24 +290,47 @@ void Editor::onDragStarted(const QPoint pos) {
 
     m_currCommand = ToolConfig::instance().createCommand(m_activeTool);
     m_currCommand->setEditor(this);
+    m_currCommand->setLayer(m_activeLayer);
     m_currCommand->startDrag(pos);
+
+    if (m_currCommand->isModifying())
+        m_strokeLayer = TiledImage {m_currBuffer.size()};
 }
 
-void Editor::onDragContinued(const QPoint start, const QPoint end) {
+void Editor::onDragContinued(const QVector<QPoint> path) {
+    if (deferDuringReplay([=]() { onDragContinued(path); }))
+        return;
+
     if ((m_currCommand == nullptr) || (!m_currCommand->isDraggable()))
         return;
 
-    m_currCommand->continueDrag(start, end);
+    // every sample is kept, but the view is told only once per batch
+    QRect dirtyArea;
+    for (int i = 1; i < path.size(); i++) {
+        m_currCommand->continueDrag(path[i - 1], path[i]);
+        // only the new segments of a stroke need painting and repainting
+        if (m_currCommand->isModifying()) {
+            m_currCommand->performSegmentOn(m_strokeLayer, path[i - 1], path[i]);
+            dirtyArea |= m_currCommand->dragSegmentRect(path[i - 1], path[i]);
+        }
+    }
+
+    if (!dirtyArea.isEmpty())
+        notifyLayerDrawn(m_activeLayer, dirtyArea);
 }
 
 void Editor::onDragEnded(const QPoint pos) {
+    if (deferDuringReplay([=]() { onDragEnded(pos); }))
+        return;
+
     if ((m_currCommand == nullptr) || (!m_currCommand->isDraggable()))
         return;
 
+    m_strokeLayer = TiledImage {};
+    m_currCommand->endDrag();
     performCompleteCommand();
-    if (m_currCommand->isModifying()) {
+    if (m_currCommand->isModifying() && !m_currCommand->isEmpty()) {
         pushCurrentCommand();
-        emit commandStackChanged(m_cmdStack, m_cmdStackPos);
     } else {
         m_currCommand.reset();
     }
@@ -264,12 +377,17 @@ void Editor::onToolChosen(CommandType newToolType) {
     m_activeTool = newToolType;
     auto currCmd = ToolConfig::instance().getConfig(m_activeTool);
     emit cursorChanged(QCursor(currCmd->getCursor()));
+    // the previous tool may have left its custom cursor on the canvas
+    emit somethingDrawn();
 }
 
 void Editor::onToolColorChosen(const QColor & color) {
     Command * cmdDraw = ToolConfig::instance().getConfig(CommandType::Draw);
     (static_cast<CommandDraw *>(cmdDraw))->setColor(color);
 
+    Command * cmdBrush = ToolConfig::instance().getConfig(CommandType::Brush);
+    (static_cast<CommandBrush *>(cmdBrush))->setColor(color);
+
     Command * cmdFill = ToolConfig::instance().getConfig(CommandType::Fill);
     (static_cast<CommandFill *>(cmdFill))->setColor(color);
 }
@@ -280,6 +398,9 @@ void Editor::onToolWidthChosen(int width) {
         case Draw:
             (static_cast<CommandDraw *>(currCmd))->setWidth(width);
             break;
+        case Brush:
+            (static_cast<CommandBrush *>(currCmd))->setWidth(width);
+            break;
         case Erase:
             (static_cast<CommandErase *>(currCmd))->setWidth(width);
             break;
@@ -288,25 +409,116 @@ void Editor::onToolWidthChosen(int width) {
     }
 }
 
-void Editor::resetDocument() {
-    m_width = m_initialBuffer.width();
-    m_height = m_initialBuffer.height();
+void Editor::onToolToleranceChosen(int tolerance) {
+    Command * cmdFill = ToolConfig::instance().getConfig(CommandType::Fill);
+    (static_cast<CommandFill *>(cmdFill))->setTolerance(tolerance);
+}
+
+void Editor::onToolHardnessChosen(int hardness) {
+    Command * cmdBrush = ToolConfig::instance().getConfig(CommandType::Brush);
+    (static_cast<CommandBrush *>(cmdBrush))->setHardness(hardness);
+}
+
+void Editor::onToolSpacingChosen(int spacing) {
+    Command * cmdBrush = ToolConfig::instance().getConfig(CommandType::Brush);
+    (static_cast<CommandBrush *>(cmdBrush))->setSpacing(spacing);
+}
+
+void Editor::onToolBrushShapeChosen(BrushShape shape, const QImage &customTip) {
+    Command * cmdBrush = ToolConfig::instance().getConfig(CommandType::Brush);
+    (static_cast<CommandBrush *>(cmdBrush))->setShape(shape, customTip);
+}
+
+
+void Editor::onLayerAdded() {
+    if (deferDuringReplay([=]() { onLayerAdded(); }))
+        return;
+
+    LayerProperties properties;
+    properties.name = QString {"Layer %1"}.arg(m_currBuffer.count() + 1);
+    performLayerCommand(LayerOperation::Add, m_activeLayer + 1, m_activeLayer + 1, properties);
+}
+
+void Editor::onLayerRemoved() {
+    if (deferDuringReplay([=]() { onLayerRemoved(); }))
+        return;
+
+    // the document always keeps a layer
+    if (m_currBuffer.count() <= 1)
+        return;
+
+    performLayerCommand(LayerOperation::Remove, m_activeLayer, std::max(m_activeLayer - 1, 0));
+}
+
+void Editor::onLayerMovedUp() {
+    if (deferDuringReplay([=]() { onLayerMovedUp(); }))
+        return;
+
+    if (m_activeLayer + 1 >= m_currBuffer.count())
+        return;
+
+    performLayerCommand(LayerOperation::MoveUp, m_activeLayer, m_activeLayer + 1);
+}
+
+void Editor::onLayerMovedDown() {
+    if (deferDuringReplay([=]() { onLayerMovedDown(); }))
+        return;
+
+    if (m_activeLayer == 0)
+        return;
+
+    performLayerCommand(LayerOperation::MoveDown, m_activeLayer, m_activeLayer - 1);
+}
+
+void Editor::onLayerChosen(int index) {
+    if (deferDuringReplay([=]() { onLayerChosen(index); }))
+        return;
+
+    if (index < 0 || index >= m_currBuffer.count() || index == m_activeLayer)
+        return;
+
+    // the document looks the same, only the compositor caches are rebuilt around the new layer
+    m_activeLayer = index;
+    emit layersChanged();
+}
+
+void Editor::onLayerPropertiesChosen(const LayerProperties &properties) {
+    if (deferDuringReplay([=]() { onLayerPropertiesChosen(properties); }))
+        return;
+
+    if (properties == m_currBuffer.layer(m_activeLayer).properties)
+        return;
+
+    performLayerCommand(LayerOperation::SetProperties, m_activeLayer, m_activeLayer, properties);
+}
+
+
+void Editor::resetDocument(const LayerStack &buffer) {
+    m_width = buffer.size().width();
+    m_height = buffer.size().height();
     m_zoomLevel = 1.0;
 
-    reset(m_currBuffer, m_initialBuffer);
+    reset(buffer);
     setModified(false);
-    emit documentSizeChanged(m_initialBuffer.size());
+    emit documentSizeChanged(buffer.size());
 }
 
-void Editor::reset(QPixmap &destBuffer, const QPixmap &srcBuffer) {
-    destBuffer = srcBuffer.copy();
+void Editor::reset(const LayerStack &baseBuffer) {
+    m_replay.cancel();
+    m_pendingInput.clear();
 
-    m_cmdStack.clear();
-    m_cmdStackPos = 0;
+    // both share all their tiles until the first change
+    m_currBuffer = baseBuffer;
+    m_history.reset(baseBuffer);
 
     m_currCommand = nullptr;
+    m_strokeLayer = TiledImage {};
+
+    m_activeLayer = std::min(m_activeLayer, m_currBuffer.count() - 1);
+    m_compositor.invalidate();
+    emit layersChanged();
 
-    emit commandStackChanged(m_cmdStack, m_cmdStackPos);
+    notifyHistoryChanged();
 }
 
 
@@ -315,91 +527,180 @@ void Editor::setModified(bool isModified) {
     emit modifiedStatusChanged(isModified);
 }
 
-void Editor::performCompleteCommand() {
-    QPainter bufferPainter {&m_currBuffer};
-    performCurrentCommand(&bufferPainter);
+void Editor::updateModifiedStatus() {
+    // commands baked into the base buffer cannot be undone anymore
+    setModified(m_history.position() > 0 || m_history.isBaseModified());
 }
 
-void Editor::performPartialCommand(QPainter * canvasPainter) {
-    performCurrentCommand(canvasPainter);
+void Editor::notifyHistoryChanged() {
+    emit commandStackChanged(m_history.size(), m_history.position());
+    emit historyMemoryChanged(m_history.memoryUsage());
 }
 
-void Editor::performCurrentCommand(QPainter * painter) {
-    assert(painter != nullptr);
-    if (m_currCommand == nullptr)
-        return;
-    
-    if (m_currCommand->isModifying()) {
-        m_currCommand->perform(*painter);
+void Editor::performCompleteCommand() {
+    // changes to the layers themselves are undone by replaying the history
+    bool needsUndoPatch = (m_currCommand != nullptr) && m_currCommand->isModifying() && !m_currCommand->isEmpty()
+        && !m_currCommand->changesLayerStack();
+    auto patchArea = needsUndoPatch ? m_currCommand->affectedRect() : QRect {};
+    // when the command cannot tell its area in advance, the old buffer is kept
+    // (its tiles shared until the command changes them) and cropped once the area is known
+    LayerStack bufferBefore;
+    if (needsUndoPatch) {
+        if (patchArea.isNull())
+            bufferBefore = m_currBuffer;
+        else
+            m_currCommandPatch = UndoPatch { m_currBuffer, m_currCommand->layer(), patchArea };
+    }
 
-    } else {
-        m_currCommand->perform();
+    QElapsedTimer timer;
+    timer.start();
+
+    if (m_currCommand != nullptr) {
+        if (m_currCommand->isModifying())
+            m_currCommand->performOnDocument(m_currBuffer);
+        else
+            m_currCommand->perform();
     }
 
+    m_currCommandCost = timer.nsecsElapsed();
+
+    if (needsUndoPatch && patchArea.isNull())
+        m_currCommandPatch = UndoPatch { bufferBefore, m_currCommand->layer(), m_currCommand->affectedRect() };
+
+    if (m_currCommand != nullptr && m_currCommand->isModifying()) {
+        if (m_currCommand->changesLayerStack())
+            notifyLayersChanged();
+        else
+            notifyLayerDrawn(m_currCommand->layer(), m_currCommand->affectedRect());
+    }
+}
+
+void Editor::performLayerCommand(LayerOperation operation, int layer, int newActiveLayer, const LayerProperties &properties) {
+    assert(m_currCommand == nullptr);
+
+    m_currCommand = std::unique_ptr<Command>(new CommandLayer(operation, properties));
+    m_currCommand->setEditor(this);
+    m_currCommand->setLayer(layer);
+    // clamped once the layers have changed
+    m_activeLayer = newActiveLayer;
+
+    performCompleteCommand();
+    pushCurrentCommand();
+}
+
+void Editor::notifyLayerDrawn(int layer, const QRect &area) {
+    m_compositor.invalidate(layer, area);
+    emit somethingDrawn(area);
+}
+
+void Editor::notifyLayersChanged() {
+    // undo and replay may leave fewer layers than there were
+    m_activeLayer = std::max(0, std::min(m_activeLayer, m_currBuffer.count() - 1));
+    m_compositor.invalidate();
+
     emit somethingDrawn();
+    emit layersChanged();
 }
 
-void Editor::paintCurrentBuffer(QPainter * painter) {
+const TiledImage & Editor::buffer() {
+    // the stroke in progress belongs to the active layer, so it is composited along with it
+    auto strokeMode = (m_currCommand != nullptr) ? m_currCommand->segmentBlendMode() : BlendMode::Normal;
+    return m_compositor.composite(m_currBuffer, m_activeLayer, m_strokeLayer, strokeMode);
+}
+
+void Editor::paintCurrentBuffer(QPainter * painter, const QRect &area) {
     assert(painter != nullptr);
-    painter->drawPixmap(0, 0, m_currBuffer);
+    buffer().draw(*painter, area);
+}
+
+QRect Editor::customCursorRect(const QPoint &pos) const {
+    auto currToolConfig = ToolConfig::instance().getConfig(m_activeTool);
+    if (!currToolConfig->usesCustomCursor())
+        return QRect {};
+
+    return currToolConfig->customCursorRect(pos);
 }
 
-void Editor::paintCustomCursor(QPoint &pos, QWidget * target) {
+void Editor::paintCustomCursor(const QPoint &pos, QPainter * painter) {
     auto currToolConfig = ToolConfig::instance().getConfig(m_activeTool);
     if (!currToolConfig->usesCustomCursor())
         return;
 
-    QPainter painter {target};
-    currToolConfig->paintCustomCursor(painter, pos);
+    painter->save();
+    currToolConfig->paintCustomCursor(*painter, pos);
+    painter->restore();
 }
 
-void Editor::paintCurrentSelection(QWidget * target) {
+void Editor::paintCurrentSelection(QPainter * painter, const QTransform &documentTransform) {
     if (m_currSelection.size().isEmpty())
         return;
 
-    QPainter painter {target};
+    // the outline stays one screen pixel wide whatever the zoom level
+    auto selectionRect = documentTransform.mapRect(m_currSelection);
 
-    painter.setPen(QPen(Qt::DashLine));
-    painter.drawRect(m_currSelection);
+    painter->save();
+    painter->setPen(QPen(Qt::DashLine));
+    painter->drawRect(selectionRect);
+    painter->restore();
 }
 
 
 void Editor::pushCurrentCommand() {
-    //std::cout << "pushCurrentCommand" << std::endl;
-    //std::cout << "before; m_commandStack.size()=" << m_commandStack.size() << "; m_cmdStackPos=" << m_cmdStackPos << std::endl;
-
-    assert(m_cmdStackPos <= (int)m_cmdStack.size());
-
-    for (int cmdDiscardPos = (int)m_cmdStack.size()-1; cmdDiscardPos >= m_cmdStackPos; cmdDiscardPos--) {
-        // previously undoed commands are discarded when a new command is requested
-        m_cmdStack.erase(m_cmdStack.begin() + cmdDiscardPos);
-    }
-    
-    //m_cmdStack.push_back(m_currCommand);
-    m_cmdStack.push_back(std::move(m_currCommand));
-    m_cmdStackPos ++;
-
-    //std::cout << "after push; m_commandStack.size()=" << m_commandStack.size() << "; m_cmdStackPos=" << m_cmdStackPos << std::endl;
+    m_history.push(HistoryEntry { std::move(m_currCommand), std::move(m_currCommandPatch), m_currCommandCost });
+    m_currCommandPatch = UndoPatch {};
+    m_history.updateCheckpoints(m_currBuffer);
 
     m_currCommand = nullptr;
 
     setModified();
-    emit commandStackChanged(m_cmdStack, m_cmdStackPos);
+    notifyHistoryChanged();
 }
 
 
 void Editor::restoreCommandsFromStack() {
-    m_currBuffer = m_initialBuffer.copy();
-    QPainter painter {&m_currBuffer};
-    setModified(false);
-
-    for (int i=0; i < m_cmdStackPos && i < (int)m_cmdStack.size(); ++i) {
-        m_isModified = true;
-        //std::cout << "Restoring command #" << i << std::endl;
-        m_cmdStack[i]->perform(painter);
+    // replay starts from the closest snapshot instead of the base buffer, when there is one;
+    // it runs in the background while the canvas keeps showing the current buffer
+    int replayStartPos = 0;
+    LayerStack startBuffer;
+    auto checkpoint = m_history.findCheckpoint(m_history.position());
+    if (checkpoint == nullptr) {
+        startBuffer = m_history.baseBuffer();
+    } else {
+        startBuffer = checkpoint->buffer;
+        replayStartPos = checkpoint->stackPos;
     }
 
-    setModified(m_isModified);
-    emit somethingDrawn();
+    std::vector<std::unique_ptr<Command>> commands;
+    for (int i=replayStartPos; i < m_history.position(); ++i)
+        commands.push_back(m_history.entry(i).command->clone());
+
+    m_replay.start(startBuffer, replayStartPos, std::move(commands));
 }
 
+void Editor::onReplayFinished(const ReplayResult &result) {
+    m_currBuffer = result.buffer;
+    for (int i=0; i < (int)result.replayCosts.size(); ++i)
+        m_history.entry(result.startPos + i).replayCost = result.replayCosts[i];
+
+    m_history.updateCheckpoints(m_currBuffer);
+
+    updateModifiedStatus();
+    // the replayed commands may have changed the layers themselves
+    notifyLayersChanged();
+    notifyHistoryChanged();
+
+    // input may start another replay, in which case the rest waits for that one
+    while (!m_pendingInput.empty() && !isReplaying()) {
+        auto input = std::move(m_pendingInput.front());
+        m_pendingInput.pop_front();
+        input();
+    }
+}
+
+bool Editor::deferDuringReplay(std::function<void()> input) {
+    if (!isReplaying())
+        return false;
+
+    m_pendingInput.push_back(std::move(input));
+    return true;
+}
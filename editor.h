@@ -3,15 +3,25 @@
 
 
 #include "command.h"
+#include "history.h"
+#include "history_replay.h"
+#include "tiled_image.h"
+#include "layer_stack.h"
+#include "layer_compositor.h"
 #include "qpaintdevice.h"
 
 #include <QObject>
 #include <QColor>
 #include <QPoint>
 #include <QPixmap>
+#include <QRect>
 #include <QCursor>
+#include <QTransform>
+#include <QVector>
 
 #include <memory>
+#include <functional>
+#include <deque>
 
 
 
@@ -20,16 +30,25 @@ class Editor : public QObject
 Q_OBJECT
 public:
     Editor(int width, int height);
+    // true while the buffer is being rebuilt in the background; it still shows the previous state
+    bool isReplaying() const { return m_replay.isRunning(); }
 
-    const QPixmap & buffer() { return m_currBuffer; };
+    // all the layers composited, with the stroke in progress
+    const TiledImage & buffer();
+    const LayerStack & layers() const { return m_currBuffer; }
+    int activeLayer() const { return m_activeLayer; }
+
+    qint64 historyMemoryUsage() const { return m_history.memoryUsage(); }
+    void setHistoryMemoryBudget(qint64 bytes);
 
 
     const QRect currentSelection() const { return m_currSelection; }
     void setCurrentSelection(QRect selection);
 
     void newFile();
-    bool loadFile(const QString filename);
-    bool saveFile(const QString filename);
+    // on failure, the reason goes to errorString when given
+    bool loadFile(const QString filename, QString *errorString = nullptr);
+    bool saveFile(const QString filename, QString *errorString = nullptr);
 
     void zoom(double zoomFactor, const QPoint &zoomPos);
 
@@ -37,10 +56,13 @@ public:
     // void performCurrentCommand(QPaintDevice * target=nullptr);
     // void paintCustomCursor(QPoint &pos, QPaintDevice * target=nullptr);
     // void paintCurrentSelection(QPaintDevice * target=nullptr);
-    void paintCurrentBuffer(QPainter * canvasPainter);
-    void performPartialCommand(QPainter * canvasPainter);
-    void paintCustomCursor(QPoint &pos, QWidget * canvas);
-    void paintCurrentSelection(QWidget * canvas);
+    // area is in document coordinates
+    void paintCurrentBuffer(QPainter * canvasPainter, const QRect &area);
+    // pos and the returned rect are in canvas coordinates; a null rect means no custom cursor
+    QRect customCursorRect(const QPoint &pos) const;
+    void paintCustomCursor(const QPoint &pos, QPainter * canvasPainter);
+    // documentTransform maps document to canvas coordinates
+    void paintCurrentSelection(QPainter * canvasPainter, const QTransform &documentTransform);
 
 public slots:
     void onUndo();
@@ -52,14 +74,30 @@ public slots:
     void onSelectAll();
     void onSelectNone();
 
+    // applies to the selection, or to the whole active layer when nothing is selected
+    void onFilterChosen(FilterType filterType, int radius);
+    void onBlurChosen(BlurShape shape, int radius);
+
     void onToolChosen(CommandType newCommandType);
     void onToolColorChosen(const QColor & color);
     void onToolWidthChosen(int width);
+    void onToolToleranceChosen(int tolerance);
+    void onToolHardnessChosen(int hardness);
+    void onToolSpacingChosen(int spacing);
+    void onToolBrushShapeChosen(BrushShape shape, const QImage &customTip);
+
+    void onLayerAdded();
+    void onLayerRemoved();
+    void onLayerMovedUp();
+    void onLayerMovedDown();
+    void onLayerChosen(int index);
+    void onLayerPropertiesChosen(const LayerProperties &properties);
 
     void onClicked(const QPoint pos, Qt::MouseButton button);
     void onDragStarted(const QPoint pos);
     void onDragEnded(const QPoint pos);
-    void onDragContinued(const QPoint start, const QPoint end);
+    // path starts at the last point of the previous one
+    void onDragContinued(const QVector<QPoint> path);
     void onWheelRolled(const QPoint pos, int delta, QFlags<Qt::KeyboardModifier> modifiers);
 
 
@@ -67,8 +105,9 @@ protected:
     int m_width;
     int m_height;
 
-    QPixmap m_initialBuffer;
-    QPixmap m_currBuffer;
+    LayerStack m_currBuffer;
+    int m_activeLayer = 0; //the one painted on
+    LayerCompositor m_compositor;
 
     bool m_isModified;
     double m_zoomLevel;
@@ -76,30 +115,52 @@ protected:
     CommandType m_activeTool;
     QRect m_currSelection;
     
-    int m_cmdStackPos = 0;
     std::unique_ptr<Command> m_currCommand = nullptr;
-    std::vector<std::unique_ptr<Command>> m_cmdStack {};
+    qint64 m_currCommandCost = 0;
+    UndoPatch m_currCommandPatch;
+    // segments of the stroke in progress, each painted once as it comes, to be composited
+    // over the active layer; null outside strokes
+    TiledImage m_strokeLayer;
+
+    HistoryStore m_history;
+    HistoryReplay m_replay;
+    std::deque<std::function<void()>> m_pendingInput {}; //received during a replay
 
 
     void setModified(bool edited=true);
 
-    void resetDocument();
-    void reset(QPixmap &destBuffer, const QPixmap &srcBuffer);
+    void resetDocument(const LayerStack &buffer);
+    void reset(const LayerStack &baseBuffer);
     void restoreCommandsFromStack();
+    void onReplayFinished(const ReplayResult &result);
+    bool deferDuringReplay(std::function<void()> input);
+    void updateModifiedStatus();
+    void notifyHistoryChanged();
     void pushCurrentCommand();
     void performCompleteCommand();
-    void performCurrentCommand(QPainter * painter);
+    // layer is the one operation works on, newActiveLayer the one active after it
+    void performLayerCommand(LayerOperation operation, int layer, int newActiveLayer, const LayerProperties &properties = LayerProperties {});
+    // for changes to the pixels of a layer; area is in document coordinates, a null rect stands for the whole document
+    void notifyLayerDrawn(int layer, const QRect &area = QRect {});
+    // for changes to the layers themselves
+    void notifyLayersChanged();
 
 signals:
     void documentSizeChanged(QSize size);
     void zoomLevelChanged(double zoomLevel, const QPoint & zoomPos);
     void viewMovedBy(QPoint delta);
-    void somethingDrawn();
+    // area is in document coordinates; a null rect stands for the whole document
+    void somethingDrawn(const QRect &area = QRect {});
     
     void modifiedStatusChanged(bool isDocumentModified);
-    void commandStackChanged(std::vector<std::unique_ptr<Command>> &stack, int currStackPos);
+    void commandStackChanged(int stackSize, int currStackPos);
+    void historyMemoryChanged(qint64 bytes);
     void cursorChanged(const QCursor &cursor);
     void selectionChanged(bool isSomethingSelected);
+    // both rects are in document coordinates
+    void selectionMoved(const QRect &oldSelection, const QRect &newSelection);
+    // layers added, removed, moved, with new properties, or another one active
+    void layersChanged();
 };
 
 
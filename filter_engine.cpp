@@ -0,0 +1,340 @@
+#include "filter_engine.h"
+#include "algorithms.h"
+#include "cpu_features.h"
+
+#include <QMutex>
+#include <QMutexLocker>
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <numeric>
+
+#ifdef HAS_X86_SIMD
+#include <immintrin.h>
+#endif
+
+
+ConvolutionKernel::ConvolutionKernel(int size, const std::vector<float> &weights, float bias):
+    m_size(size), m_weights(weights), m_bias(bias) {
+
+    assert(size % 2 == 1 && (int)weights.size() == size * size);
+
+    float sum = std::accumulate(m_weights.begin(), m_weights.end(), 0.0f);
+    m_isNormalized = std::abs(sum - 1.0f) < 1e-3f;
+    factorize();
+}
+
+void ConvolutionKernel::factorize() {
+    // a separable kernel has rank 1: every row is a multiple of the one holding the largest weight
+    auto pivot = std::max_element(m_weights.begin(), m_weights.end(), [](float a, float b) { return std::abs(a) < std::abs(b); });
+    if (*pivot == 0.0f)
+        return;
+
+    int pivotRow = (int)(pivot - m_weights.begin()) / m_size;
+    int pivotColumn = (int)(pivot - m_weights.begin()) % m_size;
+    std::vector<float> column(m_size);
+    std::vector<float> row(m_size);
+    for (int i = 0; i < m_size; i++) {
+        column[i] = m_weights[i * m_size + pivotColumn];
+        row[i] = m_weights[pivotRow * m_size + i] / *pivot;
+    }
+
+    float tolerance = 1e-5f * std::abs(*pivot);
+    for (int i = 0; i < m_size; i++) {
+        for (int j = 0; j < m_size; j++) {
+            if (std::abs(column[i] * row[j] - m_weights[i * m_size + j]) > tolerance)
+                return;
+        }
+    }
+
+    m_column = column;
+    m_row = row;
+}
+
+
+ConvolutionKernel ConvolutionKernel::gaussian(int radius) {
+    radius = std::max(radius, 1);
+    int size = 2 * radius + 1;
+    // the kernel reaches three standard deviations out
+    double sigma = std::max(radius / 3.0, 0.5);
+
+    std::vector<double> profile(size);
+    for (int i = 0; i < size; i++)
+        profile[i] = std::exp(-(i - radius) * (i - radius) / (2 * sigma * sigma));
+    double sum = std::accumulate(profile.begin(), profile.end(), 0.0);
+
+    std::vector<float> weights(size * size);
+    for (int i = 0; i < size; i++) {
+        for (int j = 0; j < size; j++)
+            weights[i * size + j] = static_cast<float>(profile[i] * profile[j] / (sum * sum));
+    }
+
+    return ConvolutionKernel {size, weights};
+}
+
+ConvolutionKernel ConvolutionKernel::sharpen() {
+    return ConvolutionKernel {3, {
+         0, -1,  0,
+        -1,  5, -1,
+         0, -1,  0,
+    }};
+}
+
+ConvolutionKernel ConvolutionKernel::emboss() {
+    // relief on a mid grey
+    return ConvolutionKernel {3, {
+        -1, -1,  0,
+        -1,  0,  1,
+         0,  1,  1,
+    }, 128.0f};
+}
+
+ConvolutionKernel ConvolutionKernel::edgeDetect() {
+    return ConvolutionKernel {3, {
+        -1, -1, -1,
+        -1,  8, -1,
+        -1, -1, -1,
+    }};
+}
+
+
+//--------------------------- inner loops ---------------------------
+// Pixels are four floats, in the memory order of their channels; one SSE register
+// holds a pixel, one AVX register two. Sums stay in registers over the whole kernel.
+
+// dest[x] += weights[k] * source[x + k], summed over k, for count pixels
+static void convolveRowScalar(float *dest, const float *source, int count, const float *weights, int size) {
+    for (int x = 0; x < count; x++) {
+        for (int k = 0; k < size; k++) {
+            for (int c = 0; c < 4; c++)
+                dest[x * 4 + c] += weights[k] * source[(x + k) * 4 + c];
+        }
+    }
+}
+
+// dest[x] += weights[k] * source[x + k * stride], summed over k, for count pixels; stride is in floats
+static void convolveColumnScalar(float *dest, const float *source, int stride, int count, const float *weights, int size) {
+    for (int i = 0; i < count * 4; i++) {
+        for (int k = 0; k < size; k++)
+            dest[i] += weights[k] * source[k * stride + i];
+    }
+}
+
+#ifdef HAS_X86_SIMD
+
+static void convolveRowSse2(float *dest, const float *source, int count, const float *weights, int size) {
+    int x = 0;
+    // two accumulators, so that the additions of consecutive pixels overlap
+    for (; x + 1 < count; x += 2) {
+        __m128 sum0 = _mm_loadu_ps(dest + x * 4);
+        __m128 sum1 = _mm_loadu_ps(dest + x * 4 + 4);
+        for (int k = 0; k < size; k++) {
+            const __m128 weight = _mm_set1_ps(weights[k]);
+            sum0 = _mm_add_ps(sum0, _mm_mul_ps(weight, _mm_loadu_ps(source + (x + k) * 4)));
+            sum1 = _mm_add_ps(sum1, _mm_mul_ps(weight, _mm_loadu_ps(source + (x + k) * 4 + 4)));
+        }
+        _mm_storeu_ps(dest + x * 4, sum0);
+        _mm_storeu_ps(dest + x * 4 + 4, sum1);
+    }
+
+    if (x < count)
+        convolveRowScalar(dest + x * 4, source + x * 4, count - x, weights, size);
+}
+
+static void convolveColumnSse2(float *dest, const float *source, int stride, int count, const float *weights, int size) {
+    int x = 0;
+    for (; x + 1 < count; x += 2) {
+        __m128 sum0 = _mm_loadu_ps(dest + x * 4);
+        __m128 sum1 = _mm_loadu_ps(dest + x * 4 + 4);
+        for (int k = 0; k < size; k++) {
+            const __m128 weight = _mm_set1_ps(weights[k]);
+            sum0 = _mm_add_ps(sum0, _mm_mul_ps(weight, _mm_loadu_ps(source + k * stride + x * 4)));
+            sum1 = _mm_add_ps(sum1, _mm_mul_ps(weight, _mm_loadu_ps(source + k * stride + x * 4 + 4)));
+        }
+        _mm_storeu_ps(dest + x * 4, sum0);
+        _mm_storeu_ps(dest + x * 4 + 4, sum1);
+    }
+
+    if (x < count)
+        convolveColumnScalar(dest + x * 4, source + x * 4, stride, count - x, weights, size);
+}
+
+TARGET_AVX2 static void convolveRowAvx2(float *dest, const float *source, int count, const float *weights, int size) {
+    int x = 0;
+    for (; x + 3 < count; x += 4) {
+        __m256 sum0 = _mm256_loadu_ps(dest + x * 4);
+        __m256 sum1 = _mm256_loadu_ps(dest + x * 4 + 8);
+        for (int k = 0; k < size; k++) {
+            const __m256 weight = _mm256_set1_ps(weights[k]);
+            sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(weight, _mm256_loadu_ps(source + (x + k) * 4)));
+            sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(weight, _mm256_loadu_ps(source + (x + k) * 4 + 8)));
+        }
+        _mm256_storeu_ps(dest + x * 4, sum0);
+        _mm256_storeu_ps(dest + x * 4 + 8, sum1);
+    }
+
+    if (x < count)
+        convolveRowSse2(dest + x * 4, source + x * 4, count - x, weights, size);
+}
+
+TARGET_AVX2 static void convolveColumnAvx2(float *dest, const float *source, int stride, int count, const float *weights, int size) {
+    int x = 0;
+    for (; x + 3 < count; x += 4) {
+        __m256 sum0 = _mm256_loadu_ps(dest + x * 4);
+        __m256 sum1 = _mm256_loadu_ps(dest + x * 4 + 8);
+        for (int k = 0; k < size; k++) {
+            const __m256 weight = _mm256_set1_ps(weights[k]);
+            sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(weight, _mm256_loadu_ps(source + k * stride + x * 4)));
+            sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(weight, _mm256_loadu_ps(source + k * stride + x * 4 + 8)));
+        }
+        _mm256_storeu_ps(dest + x * 4, sum0);
+        _mm256_storeu_ps(dest + x * 4 + 8, sum1);
+    }
+
+    if (x < count)
+        convolveColumnSse2(dest + x * 4, source + x * 4, stride, count - x, weights, size);
+}
+
+#endif // HAS_X86_SIMD
+
+static void convolveRow(float *dest, const float *source, int count, const float *weights, int size) {
+#ifdef HAS_X86_SIMD
+    if (CpuFeatures::hasAvx2())
+        return convolveRowAvx2(dest, source, count, weights, size);
+    return convolveRowSse2(dest, source, count, weights, size);
+#else
+    convolveRowScalar(dest, source, count, weights, size);
+#endif
+}
+
+static void convolveColumn(float *dest, const float *source, int stride, int count, const float *weights, int size) {
+#ifdef HAS_X86_SIMD
+    if (CpuFeatures::hasAvx2())
+        return convolveColumnAvx2(dest, source, stride, count, weights, size);
+    return convolveColumnSse2(dest, source, stride, count, weights, size);
+#else
+    convolveColumnScalar(dest, source, stride, count, weights, size);
+#endif
+}
+
+
+// pixels of a padded copy as floats, in b, g, r, a order
+static std::vector<float> toFloats(const QImage &image) {
+    std::vector<float> pixels(static_cast<size_t>(image.width()) * image.height() * 4);
+    float *dest = pixels.data();
+    for (int y = 0; y < image.height(); y++) {
+        auto line = reinterpret_cast<const QRgb *>(image.constScanLine(y));
+        for (int x = 0; x < image.width(); x++) {
+            *dest++ = qBlue(line[x]);
+            *dest++ = qGreen(line[x]);
+            *dest++ = qRed(line[x]);
+            *dest++ = qAlpha(line[x]);
+        }
+    }
+
+    return pixels;
+}
+
+
+QImage FilterEngine::filter(const TiledImage &source, const QRect &area, const ConvolutionKernel &kernel) {
+    const int radius = kernel.radius();
+    const int size = kernel.size();
+    const int width = area.width();
+    const int height = area.height();
+    const int paddedWidth = width + 2 * radius;
+
+    auto padded = toFloats(paddedCopy(source, area, radius));
+    std::vector<float> result(static_cast<size_t>(width) * height * 4, 0.0f);
+
+    if (kernel.isSeparable()) {
+        // rows first, over the whole padded height, then columns: 2 * size products per pixel
+        std::vector<float> rows(static_cast<size_t>(width) * (height + 2 * radius) * 4, 0.0f);
+        for (int y = 0; y < height + 2 * radius; y++)
+            convolveRow(&rows[y * width * 4], &padded[y * paddedWidth * 4], width, kernel.row(), size);
+        for (int y = 0; y < height; y++)
+            convolveColumn(&result[y * width * 4], &rows[y * width * 4], width * 4, width, kernel.column(), size);
+    } else {
+        for (int y = 0; y < height; y++) {
+            for (int i = 0; i < size; i++)
+                convolveRow(&result[y * width * 4], &padded[(y + i) * paddedWidth * 4], width, kernel.weights() + i * size, size);
+        }
+    }
+
+    QImage image {area.size(), QImage::Format_ARGB32_Premultiplied};
+    for (int y = 0; y < height; y++) {
+        auto line = reinterpret_cast<QRgb *>(image.scanLine(y));
+        for (int x = 0; x < width; x++) {
+            const float *pixel = &result[(y * width + x) * 4];
+            float alpha = kernel.isNormalized() ? pixel[3] : padded[((y + radius) * paddedWidth + x + radius) * 4 + 3];
+            int a = qBound(0, qRound(alpha), 255);
+            // the colors stay premultiplied, so they cannot go past alpha
+            float bias = kernel.bias() * a / 255.0f;
+            int b = qBound(0, qRound(pixel[0] + bias), a);
+            int g = qBound(0, qRound(pixel[1] + bias), a);
+            int r = qBound(0, qRound(pixel[2] + bias), a);
+            line[x] = qRgba(r, g, b, a);
+        }
+    }
+
+    return image;
+}
+
+void FilterEngine::apply(TiledImage &image, const QRect &area, const ConvolutionKernel &kernel) {
+    applyByParts(image, area, TiledImage::tileSize, [&](const TiledImage &source, const QRect &part) {
+        return filter(source, part, kernel);
+    });
+}
+
+void FilterEngine::applyByParts(TiledImage &image, const QRect &area, int partSize, const PartFilter &filterPart) {
+    auto validArea = area.isNull() ? image.rect() : area.intersected(image.rect());
+    if (validArea.isEmpty())
+        return;
+
+    // tiles are read from a copy, which keeps the original pixels while the filtered ones are pasted
+    const TiledImage source = image;
+    auto parts = tileAreas(validArea, partSize);
+
+    QMutex pasteMutex;
+    Algorithms::parallelFor((int)parts.size(), [&](int i) {
+        auto filtered = filterPart(source, parts[i]);
+
+        QMutexLocker locker {&pasteMutex};
+        image.paste(filtered, parts[i].topLeft());
+    });
+}
+
+
+QImage FilterEngine::paddedCopy(const TiledImage &source, const QRect &area, int radius) {
+    auto padded = area.adjusted(-radius, -radius, radius, radius);
+    auto available = padded.intersected(source.rect());
+    auto image = source.copy(available);
+    if (padded == available)
+        return image;
+
+    QImage result {padded.size(), QImage::Format_ARGB32_Premultiplied};
+    for (int y = padded.top(); y <= padded.bottom(); y++) {
+        int sourceY = qBound(available.top(), y, available.bottom()) - available.top();
+        auto sourceLine = reinterpret_cast<const QRgb *>(image.constScanLine(sourceY));
+        auto line = reinterpret_cast<QRgb *>(result.scanLine(y - padded.top()));
+        for (int x = padded.left(); x <= padded.right(); x++)
+            *line++ = sourceLine[qBound(available.left(), x, available.right()) - available.left()];
+    }
+
+    return result;
+}
+
+std::vector<QRect> FilterEngine::tileAreas(const QRect &area, int partSize) {
+    std::vector<QRect> parts;
+    if (area.isEmpty())
+        return parts;
+
+    for (int ty = area.top() / partSize; ty <= area.bottom() / partSize; ty++) {
+        for (int tx = area.left() / partSize; tx <= area.right() / partSize; tx++) {
+            QRect tileRect {tx * partSize, ty * partSize, partSize, partSize};
+            parts.push_back(tileRect.intersected(area));
+        }
+    }
+
+    return parts;
+}
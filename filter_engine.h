@@ -0,0 +1,72 @@
+#ifndef FILTER_ENGINE_H
+#define FILTER_ENGINE_H
+
+#include "tiled_image.h"
+
+#include <QImage>
+#include <QRect>
+
+#include <functional>
+#include <vector>
+
+
+// Square convolution kernel of odd size, its weights stored row by row. A kernel that is
+// the product of a column and a row is also kept as those two, and filtered in two passes.
+class ConvolutionKernel {
+public:
+    ConvolutionKernel() {}
+    // bias is added to the color channels of every filtered pixel, as if it were opaque
+    ConvolutionKernel(int size, const std::vector<float> &weights, float bias = 0.0f);
+
+    static ConvolutionKernel gaussian(int radius);
+    static ConvolutionKernel sharpen();
+    static ConvolutionKernel emboss();
+    static ConvolutionKernel edgeDetect();
+
+    int size() const { return m_size; }
+    int radius() const { return m_size / 2; }
+    const float * weights() const { return m_weights.data(); }
+    float bias() const { return m_bias; }
+
+    bool isSeparable() const { return !m_column.empty(); }
+    const float * column() const { return m_column.data(); }
+    const float * row() const { return m_row.data(); }
+    // true when the weights add up to 1; other kernels leave alpha as it is
+    bool isNormalized() const { return m_isNormalized; }
+
+private:
+    int m_size = 1;
+    std::vector<float> m_weights {1.0f};
+    float m_bias = 0.0f;
+    bool m_isNormalized = true;
+    std::vector<float> m_column {}; //empty when not separable
+    std::vector<float> m_row {};
+
+    void factorize();
+};
+
+
+// Convolution of tiled images, one tile at a time on all cores. Each tile reads a border
+// of the kernel radius around it, clamped to the image edges.
+class FilterEngine {
+public:
+    // filtered part of the source image, as a premultiplied image of the size of part
+    typedef std::function<QImage(const TiledImage &source, const QRect &part)> PartFilter;
+
+    // filters area of image, a null rect standing for the whole image; pixels around area are read but not written
+    static void apply(TiledImage &image, const QRect &area, const ConvolutionKernel &kernel);
+    // area of source filtered, as a premultiplied image of the size of area
+    static QImage filter(const TiledImage &source, const QRect &area, const ConvolutionKernel &kernel);
+
+    // filters area of image part by part on all cores, the parts cut along a grid of partSize,
+    // a multiple of the tile size; each part reads the unfiltered image
+    static void applyByParts(TiledImage &image, const QRect &area, int partSize, const PartFilter &filterPart);
+    // area grown by radius on every side; the pixels past the edges of source repeat the edge ones
+    static QImage paddedCopy(const TiledImage &source, const QRect &area, int radius);
+
+    // the parts of area, cut along a grid of partSize
+    static std::vector<QRect> tileAreas(const QRect &area, int partSize = TiledImage::tileSize);
+};
+
+
+#endif // FILTER_ENGINE_H
@@ -0,0 +1,193 @@
+#include "history.h"
+#include "pixel_codec.h"
+
+#include <QImage>
+
+#include <cassert>
+#include <unordered_set>
+
+
+UndoPatch::UndoPatch(const LayerStack &buffer, int layer, const QRect &area) {
+    if (layer < 0 || layer >= buffer.count())
+        return;
+
+    m_layer = layer;
+    m_area = area.isNull() ? buffer.rect() : area.intersected(buffer.rect());
+    m_isValid = true;
+    if (m_area.isEmpty())
+        return;
+
+    auto image = buffer.layer(layer).image.copy(m_area);
+    m_format = image.format();
+    m_data = PixelCodec::encode(image);
+}
+
+void UndoPatch::restore(LayerStack &buffer) const {
+    if (!m_isValid || m_area.isEmpty() || m_layer >= buffer.count())
+        return;
+
+    buffer.layer(m_layer).image.paste(PixelCodec::decode(m_data, m_area.size(), m_format), m_area.topLeft());
+}
+
+
+void HistoryStore::reset(const LayerStack &baseBuffer) {
+    m_baseBuffer = baseBuffer;
+    m_isBaseModified = false;
+
+    m_entries.clear();
+    m_checkpoints.clear();
+    m_position = 0;
+}
+
+void HistoryStore::push(HistoryEntry entry) {
+    assert(m_position <= size());
+
+    // previously undoed commands are discarded when a new command is pushed
+    m_entries.erase(m_entries.begin() + m_position, m_entries.end());
+    while (!m_checkpoints.empty() && m_checkpoints.back().stackPos > m_position)
+        m_checkpoints.pop_back();
+
+    entry.command->compact();
+    m_entries.push_back(std::move(entry));
+    m_position ++;
+
+    enforceMemoryBudget();
+}
+
+
+const HistoryCheckpoint * HistoryStore::findCheckpoint(int stackPos) const {
+    const HistoryCheckpoint * closest = nullptr;
+    for (auto &checkpoint: m_checkpoints) {
+        if (checkpoint.stackPos > stackPos)
+            break;
+        closest = &checkpoint;
+    }
+
+    return closest;
+}
+
+void HistoryStore::updateCheckpoints(const LayerStack &currBuffer) {
+    int lastSnapshotPos = 0;
+    auto lastCheckpoint = findCheckpoint(m_position);
+    if (lastCheckpoint != nullptr)
+        lastSnapshotPos = lastCheckpoint->stackPos;
+
+    qint64 replayCost = 0;
+    for (int i=lastSnapshotPos; i < m_position; ++i)
+        replayCost += m_entries[i].replayCost;
+
+    bool isCheckpointDue = (m_position - lastSnapshotPos >= checkpointCommandInterval) || (replayCost >= checkpointReplayCost);
+    if (!isCheckpointDue || lastSnapshotPos == m_position)
+        return;
+
+    // what the checkpoint will cost once currBuffer has moved on: the tiles it does not
+    // share with the base buffer or the earlier checkpoints
+    std::unordered_set<const Tile *> countedTiles;
+    m_baseBuffer.memoryUsage(countedTiles);
+    for (auto &checkpoint: m_checkpoints) {
+        if (checkpoint.stackPos < m_position)
+            checkpoint.buffer.memoryUsage(countedTiles);
+    }
+    auto checkpointBytes = currBuffer.memoryUsage(countedTiles);
+    if (checkpointBytes > m_memoryBudget / 2)
+        return;
+
+    auto insertPos = m_checkpoints.begin();
+    while (insertPos != m_checkpoints.end() && insertPos->stackPos < m_position)
+        insertPos ++;
+    // implicitly shared: tiles are only duplicated when currBuffer changes them
+    m_checkpoints.insert(insertPos, HistoryCheckpoint { m_position, currBuffer });
+
+    enforceMemoryBudget();
+}
+
+
+void HistoryStore::setMemoryBudget(qint64 bytes) {
+    m_memoryBudget = bytes;
+    enforceMemoryBudget();
+}
+
+// what the entry holds on its own, which it takes along when it goes
+static qint64 entryMemoryUsage(const HistoryEntry &entry) {
+    return sizeof(HistoryEntry) + entry.command->memoryUsage() + entry.undoPatch.sizeInBytes();
+}
+
+qint64 HistoryStore::memoryUsage() const {
+    qint64 usage = checkpointsMemoryUsage();
+    for (auto &entry: m_entries)
+        usage += entryMemoryUsage(entry);
+
+    return usage;
+}
+
+qint64 HistoryStore::checkpointsMemoryUsage() const {
+    // the tiles shared with the live and base buffers cost nothing more, and a tile
+    // shared by several checkpoints is counted once
+    std::unordered_set<const Tile *> countedTiles;
+    if (m_liveBuffer != nullptr)
+        m_liveBuffer->memoryUsage(countedTiles);
+    m_baseBuffer.memoryUsage(countedTiles);
+
+    qint64 usage = 0;
+    for (auto &checkpoint: m_checkpoints)
+        usage += checkpoint.buffer.memoryUsage(countedTiles);
+
+    return usage;
+}
+
+void HistoryStore::enforceMemoryBudget() {
+    // the usage is counted once; entries take their own cost along as they go, and the
+    // tiles are only counted again when checkpoints go or the base buffer changes under them
+    qint64 entriesUsage = 0;
+    for (auto &entry: m_entries)
+        entriesUsage += entryMemoryUsage(entry);
+    qint64 checkpointsUsage = checkpointsMemoryUsage();
+    auto isOverBudget = [&]() { return entriesUsage + checkpointsUsage > m_memoryBudget; };
+
+    // checkpoints only speed up replay, so they go first, the oldest before the others
+    while (!m_checkpoints.empty() && isOverBudget()) {
+        m_checkpoints.erase(m_checkpoints.begin());
+        checkpointsUsage = checkpointsMemoryUsage();
+    }
+
+    // then the oldest commands stop being undoable; the last performed one always stays
+    while (m_position > 1 && isOverBudget()) {
+        entriesUsage -= entryMemoryUsage(m_entries.front());
+        bakeOldestEntry();
+        if (!m_checkpoints.empty())
+            checkpointsUsage = checkpointsMemoryUsage();
+    }
+
+    // finally the commands that could be redone, the newest first
+    while (size() > m_position && isOverBudget()) {
+        entriesUsage -= entryMemoryUsage(m_entries.back());
+        m_entries.pop_back();
+
+        bool isCheckpointDropped = false;
+        while (!m_checkpoints.empty() && m_checkpoints.back().stackPos > size()) {
+            m_checkpoints.pop_back();
+            isCheckpointDropped = true;
+        }
+        if (isCheckpointDropped)
+            checkpointsUsage = checkpointsMemoryUsage();
+    }
+}
+
+void HistoryStore::bakeOldestEntry() {
+    assert(m_position > 0);
+
+    if (!m_checkpoints.empty() && m_checkpoints.front().stackPos == 1) {
+        m_baseBuffer = m_checkpoints.front().buffer;
+    } else {
+        m_entries.front().command->performOnDocument(m_baseBuffer);
+    }
+    m_isBaseModified = true;
+
+    m_entries.erase(m_entries.begin());
+    m_position --;
+
+    for (auto &checkpoint: m_checkpoints)
+        checkpoint.stackPos --;
+    while (!m_checkpoints.empty() && m_checkpoints.front().stackPos <= 0)
+        m_checkpoints.erase(m_checkpoints.begin());
+}
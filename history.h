@@ -0,0 +1,104 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "command.h"
+#include "tiled_image.h"
+#include "layer_stack.h"
+
+#include <QImage>
+#include <QByteArray>
+#include <QRect>
+
+#include <memory>
+#include <vector>
+
+
+// snapshot of the layers after the first stackPos commands have been performed
+struct HistoryCheckpoint {
+    int stackPos;
+    LayerStack buffer; //shares its unchanged tiles with the other buffers
+};
+
+
+// Compressed copy of the pixels a command is about to paint over on one layer,
+// so that the command can be undone by painting them back
+class UndoPatch {
+public:
+    UndoPatch() {}
+    // a null area stands for the whole layer
+    UndoPatch(const LayerStack &buffer, int layer, const QRect &area);
+
+    bool isValid() const { return m_isValid; }
+    int layer() const { return m_layer; }
+    QRect area() const { return m_area; }
+    qint64 sizeInBytes() const { return m_data.size(); }
+
+    void restore(LayerStack &buffer) const;
+
+private:
+    bool m_isValid = false;
+    int m_layer = 0;
+    QRect m_area;
+    QImage::Format m_format = QImage::Format_ARGB32_Premultiplied;
+    QByteArray m_data;
+};
+
+
+// a performed command, with what is needed to undo and to replay it
+struct HistoryEntry {
+    std::unique_ptr<Command> command;
+    UndoPatch undoPatch;
+    qint64 replayCost = 0; //time taken by perform, in ns
+};
+
+
+// The commands performed on top of a base buffer, with their undo patches and buffer
+// checkpoints, kept under a memory budget. Over budget, checkpoints are dropped first,
+// then the oldest commands are baked into the base buffer, then the newest undone
+// commands are dropped.
+class HistoryStore {
+public:
+    HistoryStore(): m_memoryBudget(defaultHistoryMemoryBudget) {}
+
+    void reset(const LayerStack &baseBuffer);
+    // the buffer being edited, whose tiles the checkpoints do not pay for
+    void setLiveBuffer(const LayerStack *liveBuffer) { m_liveBuffer = liveBuffer; }
+    const LayerStack & baseBuffer() const { return m_baseBuffer; }
+    // true when some commands have been baked into the base buffer
+    bool isBaseModified() const { return m_isBaseModified; }
+
+    int size() const { return (int)m_entries.size(); }
+    // number of commands currently applied
+    int position() const { return m_position; }
+    void setPosition(int position) { m_position = position; }
+    HistoryEntry & entry(int i) { return m_entries[i]; }
+
+    // discards the undone commands, then appends entry and moves past it
+    void push(HistoryEntry entry);
+
+    const HistoryCheckpoint * findCheckpoint(int stackPos) const;
+    // currBuffer must be the buffer at position()
+    void updateCheckpoints(const LayerStack &currBuffer);
+
+    qint64 memoryBudget() const { return m_memoryBudget; }
+    void setMemoryBudget(qint64 bytes);
+    qint64 memoryUsage() const;
+
+private:
+    LayerStack m_baseBuffer;
+    bool m_isBaseModified = false;
+    const LayerStack *m_liveBuffer = nullptr;
+
+    std::vector<HistoryEntry> m_entries {};
+    std::vector<HistoryCheckpoint> m_checkpoints {}; //sorted by stackPos
+    int m_position = 0;
+
+    qint64 m_memoryBudget;
+
+    qint64 checkpointsMemoryUsage() const;
+    void enforceMemoryBudget();
+    void bakeOldestEntry();
+};
+
+
+#endif // HISTORY_H
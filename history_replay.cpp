@@ -0,0 +1,87 @@
+#include "history_replay.h"
+
+#include <QElapsedTimer>
+#include <QMutexLocker>
+
+
+HistoryReplay::HistoryReplay(QObject *parent): QObject(parent) {
+    // replays never overlap: a cancelled one still running delays the next one, which
+    // is queued behind it
+    m_pool.setMaxThreadCount(1);
+}
+
+HistoryReplay::~HistoryReplay() {
+    // the worker refers to this object until it returns
+    cancel();
+    m_pool.waitForDone();
+}
+
+
+void HistoryReplay::start(const LayerStack &startBuffer, int startPos, std::vector<std::unique_ptr<Command>> commands) {
+    cancel();
+
+    m_isRunning = true;
+    int generation = m_generation;
+    // the pool only takes copyable tasks
+    auto sharedCommands = std::make_shared<std::vector<std::unique_ptr<Command>>>(std::move(commands));
+
+    m_pool.start([this, startBuffer, startPos, sharedCommands, generation]() {
+        ReplayResult result { startPos, startBuffer, {} };
+        result.replayCosts.reserve(sharedCommands->size());
+
+        // tiles shared with the history are duplicated as the commands change them
+        QElapsedTimer timer;
+        for (auto &command: *sharedCommands) {
+            if (generation != m_generation)
+                return;
+
+            timer.start();
+            command->performOnDocument(result.buffer);
+            result.replayCosts.push_back(timer.nsecsElapsed());
+        }
+
+        {
+            QMutexLocker locker {&m_resultMutex};
+            if (generation != m_generation)
+                return;
+            m_result = std::move(result);
+            m_hasResult = true;
+        }
+        QMetaObject::invokeMethod(this, [this, generation]() { deliverResult(generation); }, Qt::QueuedConnection);
+    });
+}
+
+void HistoryReplay::cancel() {
+    QMutexLocker locker {&m_resultMutex};
+    m_generation ++;
+    m_isRunning = false;
+
+    m_hasResult = false;
+    m_result = ReplayResult {};
+}
+
+void HistoryReplay::finish() {
+    if (!m_isRunning)
+        return;
+
+    m_pool.waitForDone();
+    deliverResult(m_generation);
+}
+
+
+void HistoryReplay::deliverResult(int generation) {
+    if (generation != m_generation || !m_isRunning)
+        return;
+
+    ReplayResult result;
+    {
+        QMutexLocker locker {&m_resultMutex};
+        if (!m_hasResult)
+            return;
+        result = std::move(m_result);
+        m_hasResult = false;
+    }
+
+    m_isRunning = false;
+    emit finished(result);
+}
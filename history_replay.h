@@ -0,0 +1,59 @@
+#ifndef HISTORY_REPLAY_H
+#define HISTORY_REPLAY_H
+
+#include "command.h"
+#include "layer_stack.h"
+
+#include <QObject>
+#include <QThreadPool>
+#include <QMutex>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+
+struct ReplayResult {
+    int startPos;
+    LayerStack buffer;
+    std::vector<qint64> replayCosts; //time taken by each replayed command, in ns
+};
+
+
+// Performs a sequence of history commands on a private buffer, on a worker thread.
+// The result is delivered through finished() on the thread owning this object.
+// A cancelled replay is left to stop on its own, at the next command; whatever
+// it would deliver afterwards is told apart by its generation and dropped.
+class HistoryReplay : public QObject
+{
+Q_OBJECT
+public:
+    explicit HistoryReplay(QObject *parent=nullptr);
+    ~HistoryReplay();
+
+    bool isRunning() const { return m_isRunning; }
+
+    // commands are copies owned by the replay, so the history can change meanwhile
+    void start(const LayerStack &startBuffer, int startPos, std::vector<std::unique_ptr<Command>> commands);
+    // drops the replay in progress, if any, without waiting for its worker
+    void cancel();
+    // blocks until the replay in progress is done, then delivers its result
+    void finish();
+
+signals:
+    void finished(const ReplayResult &result);
+
+private:
+    QThreadPool m_pool;
+    bool m_isRunning = false;
+    std::atomic<int> m_generation {0}; //tells stale replays apart; only changed under m_resultMutex
+
+    QMutex m_resultMutex;
+    bool m_hasResult = false;
+    ReplayResult m_result;
+
+    void deliverResult(int generation);
+};
+
+
+#endif // HISTORY_REPLAY_H
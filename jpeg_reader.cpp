@@ -0,0 +1,120 @@
+#include "jpeg_reader.h"
+
+#include <QFile>
+#include <QImage>
+
+#include <algorithm>
+#include <csetjmp>
+#include <cstdio>
+#include <vector>
+
+#include <jpeglib.h>
+
+
+// libjpeg exits the process on an error unless told otherwise; this one jumps back to
+// readImage instead, with the message kept for the user
+struct ErrorManager {
+    jpeg_error_mgr base;
+    jmp_buf jump;
+    QString *message;
+};
+
+static void onError(j_common_ptr info) {
+    auto errors = reinterpret_cast<ErrorManager *>(info->err);
+    char buffer[JMSG_LENGTH_MAX];
+    (*info->err->format_message)(info, buffer);
+    *errors->message = QString::fromLatin1(buffer);
+    longjmp(errors->jump, 1);
+}
+
+// warnings do not stop the read
+static void onMessage(j_common_ptr) {}
+
+
+// line of the decoder's samples to premultiplied pixels; CMYK comes inverted, as
+// Adobe writes it
+static void decodeLine(const JSAMPLE *samples, int width, int components, QRgb *line) {
+    for (int x = 0; x < width; x++, samples += components) {
+        if (components == 1) {
+            line[x] = qRgb(samples[0], samples[0], samples[0]);
+        } else if (components == 3) {
+            line[x] = qRgb(samples[0], samples[1], samples[2]);
+        } else {
+            int k = samples[3];
+            line[x] = qRgb(samples[0] * k / 255, samples[1] * k / 255, samples[2] * k / 255);
+        }
+    }
+}
+
+// everything the read builds lives in the caller, which the jump back from an error
+// leaves alone; only scalars, which are not used after the jump, are local
+static bool readImage(jpeg_decompress_struct &decoder, ErrorManager &errors, FILE *file,
+                      TiledImage &image, QImage &band, std::vector<JSAMPLE> &row) {
+    if (setjmp(errors.jump))
+        return false;
+
+    jpeg_create_decompress(&decoder);
+    jpeg_stdio_src(&decoder, file);
+    jpeg_read_header(&decoder, TRUE);
+    if (decoder.jpeg_color_space == JCS_CMYK || decoder.jpeg_color_space == JCS_YCCK)
+        decoder.out_color_space = JCS_CMYK;
+    else if (decoder.jpeg_color_space != JCS_GRAYSCALE)
+        decoder.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&decoder);
+
+    int width = decoder.output_width;
+    int height = decoder.output_height;
+    int components = decoder.output_components;
+    image = TiledImage {QSize {width, height}};
+    row.resize(static_cast<size_t>(width) * components);
+
+    for (int y = 0; y < height; y += TiledImage::tileSize) {
+        band = QImage {width, std::min(TiledImage::tileSize, height - y), QImage::Format_ARGB32_Premultiplied};
+        for (int by = 0; by < band.height(); by++) {
+            JSAMPROW rowPointer = row.data();
+            jpeg_read_scanlines(&decoder, &rowPointer, 1);
+            decodeLine(row.data(), width, components, reinterpret_cast<QRgb *>(band.scanLine(by)));
+        }
+
+        image.paste(band, QPoint {0, y});
+    }
+
+    jpeg_finish_decompress(&decoder);
+    return true;
+}
+
+
+bool JpegReader::load(TiledImage &image, const QString &filename, QString *errorString) {
+    FILE *file = fopen(QFile::encodeName(filename).constData(), "rb");
+    if (file == nullptr) {
+        if (errorString)
+            *errorString = "the file cannot be read";
+        return false;
+    }
+
+    QString message;
+    ErrorManager errors;
+    errors.message = &message;
+    // destroying a decoder that was never created does nothing
+    jpeg_decompress_struct decoder {};
+    decoder.err = jpeg_std_error(&errors.base);
+    errors.base.error_exit = onError;
+    errors.base.output_message = onMessage;
+
+    TiledImage result;
+    QImage band;
+    std::vector<JSAMPLE> row;
+    bool isOk = readImage(decoder, errors, file, result, band, row);
+
+    jpeg_destroy_decompress(&decoder);
+    fclose(file);
+
+    if (!isOk) {
+        if (errorString)
+            *errorString = message;
+        return false;
+    }
+
+    image = result;
+    return true;
+}
@@ -0,0 +1,19 @@
+#ifndef JPEG_READER_H
+#define JPEG_READER_H
+
+#include "tiled_image.h"
+
+#include <QString>
+
+
+// Reads a JPEG file to a TiledImage with a single decoder going down the scanlines, a band
+// of tile rows at a time, so that images larger than a QImage can hold are opened too.
+class JpegReader {
+public:
+    // grayscale, RGB or CMYK; returns false, leaving image alone, on failure, with the
+    // reason in errorString
+    static bool load(TiledImage &image, const QString &filename, QString *errorString);
+};
+
+
+#endif // JPEG_READER_H
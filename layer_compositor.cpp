@@ -0,0 +1,124 @@
+#include "layer_compositor.h"
+
+#include <QImage>
+
+#include <functional>
+
+
+// calls update() on the parts of area within bounds, cut along the tile grid, so that
+// no more than a tile is composited at once
+static void forEachTile(const QRegion &area, const QRect &bounds, const std::function<void(const QRect &)> &update) {
+    for (auto &rect: area) {
+        auto validRect = rect.intersected(bounds);
+        if (validRect.isEmpty())
+            continue;
+
+        for (int ty = validRect.top() / TiledImage::tileSize; ty <= validRect.bottom() / TiledImage::tileSize; ty++) {
+            for (int tx = validRect.left() / TiledImage::tileSize; tx <= validRect.right() / TiledImage::tileSize; tx++) {
+                QRect tileRect {tx * TiledImage::tileSize, ty * TiledImage::tileSize, TiledImage::tileSize, TiledImage::tileSize};
+                update(tileRect.intersected(validRect));
+            }
+        }
+    }
+}
+
+static bool isPlain(const LayerProperties &properties) {
+    return properties.isVisible && properties.opacity == 100 && properties.blendMode == BlendMode::Normal;
+}
+
+static bool hasVisibleLayers(const LayerStack &layers, int first, int last) {
+    for (int i = first; i < last; i++) {
+        if (layers.layer(i).properties.isVisible && layers.layer(i).properties.opacity > 0)
+            return true;
+    }
+
+    return false;
+}
+
+
+void LayerCompositor::invalidate(int layer, const QRect &area) {
+    QRegion staleArea {area.isNull() ? m_composite.rect() : area};
+
+    if (layer < m_activeLayer)
+        m_staleBelow += staleArea;
+    else if (layer > m_activeLayer)
+        m_staleAbove += staleArea;
+    m_staleComposite += staleArea;
+}
+
+void LayerCompositor::invalidate() {
+    // the caches are rebuilt on the next composite()
+    m_activeLayer = -1;
+}
+
+void LayerCompositor::reset(const LayerStack &layers, int activeLayer) {
+    m_activeLayer = activeLayer;
+    m_layerCount = layers.count();
+
+    // source-over is associative, so normal layers can be flattened ahead of what is under them
+    m_isAboveFlat = true;
+    for (int i = activeLayer + 1; i < layers.count(); i++)
+        m_isAboveFlat = m_isAboveFlat && (layers.layer(i).properties.blendMode == BlendMode::Normal);
+
+    m_below = TiledImage {layers.size()};
+    m_above = TiledImage {layers.size()};
+    m_composite = TiledImage {layers.size()};
+
+    QRegion wholeDocument {layers.rect()};
+    m_staleBelow = hasVisibleLayers(layers, 0, activeLayer) ? wholeDocument : QRegion {};
+    m_staleAbove = (m_isAboveFlat && hasVisibleLayers(layers, activeLayer + 1, layers.count())) ? wholeDocument : QRegion {};
+    m_staleComposite = wholeDocument;
+}
+
+
+const TiledImage & LayerCompositor::composite(const LayerStack &layers, int activeLayer, const TiledImage &overlay,
+                                              BlendMode overlayMode) {
+    if (activeLayer != m_activeLayer || layers.count() != m_layerCount || layers.size() != m_composite.size())
+        reset(layers, activeLayer);
+
+    auto &active = layers.layer(activeLayer);
+
+    // a lone plain layer is its own composite, and they share all their tiles
+    bool isAlone = !hasVisibleLayers(layers, 0, activeLayer) && !hasVisibleLayers(layers, activeLayer + 1, layers.count());
+    if (isAlone && isPlain(active.properties) && overlay.isNull()) {
+        m_composite = active.image;
+        m_staleComposite = QRegion {};
+        return m_composite;
+    }
+
+    forEachTile(m_staleBelow, layers.rect(), [&](const QRect &tileArea) {
+        QImage image {tileArea.size(), QImage::Format_ARGB32_Premultiplied};
+        image.fill(Qt::transparent);
+        layers.composite(image, tileArea, 0, activeLayer);
+        m_below.paste(image, tileArea.topLeft());
+    });
+    m_staleBelow = QRegion {};
+
+    forEachTile(m_staleAbove, layers.rect(), [&](const QRect &tileArea) {
+        QImage image {tileArea.size(), QImage::Format_ARGB32_Premultiplied};
+        image.fill(Qt::transparent);
+        layers.composite(image, tileArea, activeLayer + 1, layers.count());
+        m_above.paste(image, tileArea.topLeft());
+    });
+    m_staleAbove = QRegion {};
+
+    forEachTile(m_staleComposite, layers.rect(), [&](const QRect &tileArea) {
+        auto image = m_below.copy(tileArea);
+
+        auto activeImage = active.image.copy(tileArea);
+        if (!overlay.isNull())
+            overlay.composite(activeImage, tileArea, overlayMode);
+        LayerStack::compositeLayer(image, activeImage, active.properties);
+
+        if (m_isAboveFlat) {
+            m_above.composite(image, tileArea, BlendMode::Normal);
+        } else {
+            layers.composite(image, tileArea, activeLayer + 1, layers.count());
+        }
+
+        m_composite.paste(image, tileArea.topLeft());
+    });
+    m_staleComposite = QRegion {};
+
+    return m_composite;
+}
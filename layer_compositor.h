@@ -0,0 +1,42 @@
+#ifndef LAYER_COMPOSITOR_H
+#define LAYER_COMPOSITOR_H
+
+#include "layer_stack.h"
+#include "tiled_image.h"
+
+#include <QRect>
+#include <QRegion>
+
+
+// Flattened image of a LayerStack, kept along with the flattened layers below and above
+// the active one. Only the stale parts are composited again, and a change to the active
+// layer costs three images per tile (below, active, above), however many layers there are.
+class LayerCompositor {
+public:
+    // layer is where area changed; area is in document coordinates, a null rect stands for the whole document
+    void invalidate(int layer, const QRect &area);
+    // for changes to the stack itself: layers added, removed, moved or with new properties
+    void invalidate();
+
+    // overlay is blended onto the active layer with overlayMode, before the opacity and blend mode
+    // of the layer apply; it may be null
+    const TiledImage & composite(const LayerStack &layers, int activeLayer, const TiledImage &overlay,
+                                 BlendMode overlayMode = BlendMode::Normal);
+
+private:
+    TiledImage m_below;
+    TiledImage m_above; //only kept when all the layers above are normal
+    TiledImage m_composite;
+    QRegion m_staleBelow;
+    QRegion m_staleAbove;
+    QRegion m_staleComposite;
+
+    int m_activeLayer = -1;
+    int m_layerCount = 0;
+    bool m_isAboveFlat = false;
+
+    void reset(const LayerStack &layers, int activeLayer);
+};
+
+
+#endif // LAYER_COMPOSITOR_H
@@ -0,0 +1,73 @@
+#include "layer_stack.h"
+
+#include <cassert>
+
+
+// from percent to the 0-255 scale of the blend kernels
+static int opacityLevel(int opacity) {
+    return (opacity * 255 + 50) / 100;
+}
+
+
+LayerStack::LayerStack(const TiledImage &image): m_size(image.size()) {
+    m_layers.push_back(Layer { LayerProperties {"Background"}, image });
+}
+
+void LayerStack::insert(int index, const LayerProperties &properties) {
+    assert(index >= 0 && index <= count());
+    m_layers.insert(m_layers.begin() + index, Layer { properties, TiledImage {m_size} });
+}
+
+void LayerStack::remove(int index) {
+    assert(index >= 0 && index < count());
+    m_layers.erase(m_layers.begin() + index);
+}
+
+void LayerStack::move(int from, int to) {
+    assert(from >= 0 && from < count() && to >= 0 && to < count());
+    auto layer = m_layers[from];
+    m_layers.erase(m_layers.begin() + from);
+    m_layers.insert(m_layers.begin() + to, layer);
+}
+
+
+void LayerStack::composite(QImage &target, const QRect &area, int first, int last) const {
+    for (int i = first; i < last; i++) {
+        auto &layer = m_layers[i];
+        if (!layer.properties.isVisible || layer.properties.opacity == 0)
+            continue;
+
+        // layers are mostly transparent, and their empty tiles cost nothing in any mode
+        layer.image.composite(target, area, layer.properties.blendMode, opacityLevel(layer.properties.opacity));
+    }
+}
+
+void LayerStack::compositeLayer(QImage &target, const QImage &image, const LayerProperties &properties) {
+    assert(target.format() == QImage::Format_ARGB32_Premultiplied && image.format() == QImage::Format_ARGB32_Premultiplied);
+    assert(target.size() == image.size());
+    if (!properties.isVisible)
+        return;
+
+    for (int y = 0; y < image.height(); y++) {
+        auto src = reinterpret_cast<const QRgb *>(image.constScanLine(y));
+        auto dest = reinterpret_cast<QRgb *>(target.scanLine(y));
+        BlendKernels::composite(properties.blendMode, dest, src, image.width(), opacityLevel(properties.opacity));
+    }
+}
+
+
+qint64 LayerStack::memoryUsage() const {
+    qint64 usage = 0;
+    for (auto &layer: m_layers)
+        usage += layer.image.memoryUsage();
+
+    return usage;
+}
+
+qint64 LayerStack::memoryUsage(std::unordered_set<const Tile *> &countedTiles) const {
+    qint64 usage = 0;
+    for (auto &layer: m_layers)
+        usage += layer.image.memoryUsage(countedTiles);
+
+    return usage;
+}
@@ -0,0 +1,70 @@
+#ifndef LAYER_STACK_H
+#define LAYER_STACK_H
+
+#include "tiled_image.h"
+#include "blend_kernels.h"
+
+#include <QImage>
+#include <QRect>
+#include <QSize>
+#include <QString>
+
+#include <unordered_set>
+#include <vector>
+
+
+struct LayerProperties {
+    QString name;
+    int opacity = 100; //in percent
+    bool isVisible = true;
+    BlendMode blendMode = BlendMode::Normal;
+
+    bool operator==(const LayerProperties &other) const {
+        return name == other.name && opacity == other.opacity && isVisible == other.isVisible && blendMode == other.blendMode;
+    }
+};
+
+struct Layer {
+    LayerProperties properties;
+    TiledImage image;
+};
+
+
+// The layers of a document, from the bottom one up. Copies share all their tiles,
+// so the history keeps whole stacks as cheaply as single images.
+class LayerStack {
+public:
+    LayerStack() {}
+    // a stack with image as its only layer
+    explicit LayerStack(const TiledImage &image);
+
+    bool isNull() const { return m_layers.empty(); }
+    QSize size() const { return m_size; }
+    QRect rect() const { return QRect {QPoint {0, 0}, m_size}; }
+
+    int count() const { return (int)m_layers.size(); }
+    const Layer & layer(int index) const { return m_layers[index]; }
+    Layer & layer(int index) { return m_layers[index]; }
+
+    // a new transparent layer, which ends up at index
+    void insert(int index, const LayerProperties &properties);
+    void remove(int index);
+    void move(int from, int to);
+
+    // composites the visible layers in [first, last) over target, which holds area of the document
+    void composite(QImage &target, const QRect &area, int first, int last) const;
+    // blends image onto target like a layer with the given properties would be; both have the same size
+    static void compositeLayer(QImage &target, const QImage &image, const LayerProperties &properties);
+
+    // bytes of the allocated tiles of all layers, shared or not
+    qint64 memoryUsage() const;
+    // bytes of the allocated tiles not in countedTiles yet, which are then added to it
+    qint64 memoryUsage(std::unordered_set<const Tile *> &countedTiles) const;
+
+private:
+    QSize m_size;
+    std::vector<Layer> m_layers {};
+};
+
+
+#endif // LAYER_STACK_H
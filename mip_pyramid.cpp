@@ -0,0 +1,136 @@
+#include "mip_pyramid.h"
+
+#include <QImage>
+
+#include <algorithm>
+#include <cmath>
+
+
+static constexpr int maxMipLevel = 8;
+
+
+// average of four premultiplied pixels, two channels at a time
+static inline QRgb averagePixels(QRgb p1, QRgb p2, QRgb p3, QRgb p4) {
+    constexpr quint32 mask = 0x00ff00ff;
+    quint32 redBlue = (p1 & mask) + (p2 & mask) + (p3 & mask) + (p4 & mask) + 0x00020002;
+    quint32 alphaGreen = ((p1 >> 8) & mask) + ((p2 >> 8) & mask) + ((p3 >> 8) & mask) + ((p4 >> 8) & mask) + 0x00020002;
+
+    return ((redBlue >> 2) & mask) | (((alphaGreen >> 2) & mask) << 8);
+}
+
+// dest, whose pixels are the halving of source; pixel (x, y) of dest covers pixels
+// (2x, 2y) to (2x+1, 2y+1) of source
+static void halve(const QImage &source, QImage &dest) {
+    const int lastRow = source.height() - 1;
+    const int lastColumn = source.width() - 1;
+
+    for (int y = 0; y < dest.height(); y++) {
+        // odd sizes: the last pixel of the level above is averaged with itself
+        int sy = 2 * y;
+        auto line1 = reinterpret_cast<const QRgb *>(source.constScanLine(sy));
+        auto line2 = reinterpret_cast<const QRgb *>(source.constScanLine(std::min(sy + 1, lastRow)));
+        auto destLine = reinterpret_cast<QRgb *>(dest.scanLine(y));
+
+        for (int x = 0; x < dest.width(); x++) {
+            int sx1 = 2 * x;
+            int sx2 = std::min(sx1 + 1, lastColumn);
+            destLine[x] = averagePixels(line1[sx1], line1[sx2], line2[sx1], line2[sx2]);
+        }
+    }
+}
+
+
+int MipPyramid::levelFor(double zoomLevel, const QSize &documentSize) {
+    if (zoomLevel > 0.5)
+        return 0;
+
+    int n = static_cast<int>(std::floor(std::log2(1.0 / zoomLevel)));
+    // no level smaller than a pixel
+    while (n > 0 && (std::max(documentSize.width(), documentSize.height()) >> n) == 0)
+        n--;
+
+    return std::min(n, maxMipLevel);
+}
+
+QRect MipPyramid::mapToLevel(const QRect &documentArea, int n) {
+    if (documentArea.isEmpty())
+        return QRect {};
+
+    return QRect { QPoint {documentArea.left() >> n, documentArea.top() >> n},
+        QPoint {documentArea.right() >> n, documentArea.bottom() >> n} };
+}
+
+
+const TiledImage & MipPyramid::level(const TiledImage &buffer, int n, const QRect &levelArea) {
+    if (buffer.size() != m_documentSize)
+        reset(buffer.size());
+
+    update(buffer, n, levelArea);
+
+    return m_levels[n - 1].image;
+}
+
+void MipPyramid::invalidate(const QRect &documentArea) {
+    auto documentRect = QRect {QPoint {0, 0}, m_documentSize};
+    auto area = documentArea.isNull() ? documentRect : documentArea.intersected(documentRect);
+
+    for (int i = 0; i < (int)m_levels.size(); i++) {
+        auto &level = m_levels[i];
+        auto levelArea = mapToLevel(area, i + 1);
+        if (levelArea.isEmpty())
+            continue;
+
+        for (int ty = levelArea.top() / TiledImage::tileSize; ty <= levelArea.bottom() / TiledImage::tileSize; ty++)
+            for (int tx = levelArea.left() / TiledImage::tileSize; tx <= levelArea.right() / TiledImage::tileSize; tx++)
+                level.dirtyTiles[ty * level.image.tilesX() + tx] = true;
+    }
+}
+
+
+void MipPyramid::reset(const QSize &documentSize) {
+    m_documentSize = documentSize;
+    m_levels.clear();
+
+    auto size = documentSize;
+    for (int n = 1; n <= maxMipLevel && (size.width() > 1 || size.height() > 1); n++) {
+        size = QSize { (size.width() + 1) / 2, (size.height() + 1) / 2 };
+
+        MipLevel level;
+        level.image = TiledImage {size};
+        level.dirtyTiles.assign(level.image.tilesX() * level.image.tilesY(), true);
+        m_levels.push_back(std::move(level));
+    }
+}
+
+void MipPyramid::update(const TiledImage &buffer, int n, const QRect &levelArea) {
+    auto &level = m_levels[n - 1];
+    auto area = levelArea.intersected(level.image.rect());
+    if (area.isEmpty())
+        return;
+
+    for (int ty = area.top() / TiledImage::tileSize; ty <= area.bottom() / TiledImage::tileSize; ty++) {
+        for (int tx = area.left() / TiledImage::tileSize; tx <= area.right() / TiledImage::tileSize; tx++) {
+            if (!level.dirtyTiles[ty * level.image.tilesX() + tx])
+                continue;
+
+            auto tileRect = level.image.tileRect(tx, ty);
+            auto sourceRect = QRect {tileRect.x() * 2, tileRect.y() * 2, tileRect.width() * 2, tileRect.height() * 2};
+
+            QImage source;
+            if (n == 1) {
+                source = buffer.copy(sourceRect.intersected(buffer.rect()));
+            } else {
+                // the level above is brought up to date first, where it is needed
+                update(buffer, n - 1, sourceRect);
+                auto &above = m_levels[n - 2].image;
+                source = above.copy(sourceRect.intersected(above.rect()));
+            }
+
+            QImage tile {tileRect.size(), QImage::Format_ARGB32_Premultiplied};
+            halve(source, tile);
+            level.image.setTileImage(tx, ty, tile);
+
+            level.dirtyTiles[ty * level.image.tilesX() + tx] = false;
+        }
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef MIP_PYRAMID_H
+#define MIP_PYRAMID_H
+
+#include "tiled_image.h"
+
+#include <QRect>
+#include <QSize>
+
+#include <vector>
+
+
+// Successive halvings of the buffer (box filter), for zoomed-out display.
+// Level n is 1/2^n of the document size; level 0 is the buffer itself and is not stored.
+// Levels are TiledImages, kept in the TileStore like the layers; only the tiles touched
+// by a change are rebuilt, lazily, when they are drawn.
+class MipPyramid {
+public:
+    // closest level that is not smaller than the document at zoomLevel
+    static int levelFor(double zoomLevel, const QSize &documentSize);
+    // document area covered by area of level n, and the other way around
+    static QRect mapToLevel(const QRect &documentArea, int n);
+
+    // level n >= 1, with the tiles intersecting levelArea up to date with buffer
+    const TiledImage & level(const TiledImage &buffer, int n, const QRect &levelArea);
+    // area is in document coordinates; a null rect stands for the whole document
+    void invalidate(const QRect &documentArea = QRect {});
+
+private:
+    struct MipLevel {
+        TiledImage image;
+        std::vector<bool> dirtyTiles;
+    };
+
+    QSize m_documentSize;
+    std::vector<MipLevel> m_levels; //m_levels[i] is level i+1
+
+    void reset(const QSize &documentSize);
+    void update(const TiledImage &buffer, int n, const QRect &levelArea);
+};
+
+
+#endif // MIP_PYRAMID_H
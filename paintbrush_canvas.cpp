@@ -13,68 +13,202 @@
 #include <QColor>
 #include <QSize>
 #include <QScrollBar>
+#include <QPaintEvent>
+#include <QBrush>
 
 #include <math.h>
 
 
-void paintBackgroundPattern(QWidget * target);
+void paintBackgroundPattern(QPainter &painter, const QRect &area, const QPoint &origin);
 
 
-PaintbrushCanvas::PaintbrushCanvas(QWidget *parent, QScrollArea *scrollArea, Editor *editor) : 
-    QWidget(parent), m_scrollArea(scrollArea), m_editor(editor), m_documentSize(QSize()), m_zoomLevel(1.0) {
+PaintbrushCanvas::PaintbrushCanvas(QWidget *parent, Editor *editor) : 
+    QAbstractScrollArea(parent), m_editor(editor), m_documentSize(QSize()), m_zoomLevel(1.0) {
 
-    setFixedSize(m_documentSize);
-    setMouseTracking(true);
+    viewport()->setMouseTracking(true);
+    // every pixel is copied from the view cache, so the background is never erased first
+    viewport()->setAttribute(Qt::WA_OpaquePaintEvent);
+
+    // drag samples are collected as they come, but the command and the view are updated once per frame
+    m_frameTimer.setSingleShot(true);
+    m_frameTimer.setInterval(frameInterval);
+    m_frameTimer.setTimerType(Qt::PreciseTimer);
+    connect(&m_frameTimer, &QTimer::timeout, this, &PaintbrushCanvas::flushDragPath);
+    m_clock.start();
 }
 
 void PaintbrushCanvas::onDocumentSizeChanged(QSize size) {
     std::cout << "onDocumentSizeChanged " << std::endl;
     m_documentSize = size;
-    updateSizeAndPos(QPoint { -1, -1 });
-
+    m_zoomCache.invalidate();
+    m_mipPyramid.invalidate();
+    updateScrollBars();
+
+    // a new document starts centered
+    auto zoomedSize = m_documentSize * m_zoomLevel;
+    moveViewTo(QPoint { (zoomedSize.width() - viewport()->width()) / 2, (zoomedSize.height() - viewport()->height()) / 2 });
+    invalidateView();
 }
 
 void PaintbrushCanvas::onZoomLevelChanged(double zoomLevel, const QPoint & zoomPos) {
     std::cout << "onZoomLevelChanged: " << zoomLevel << std::endl;
+
+    // the document point under zoomPos stays where it is in the viewport
+    auto zoomPosInViewport = documentTransform().map(QPointF(zoomPos));
     m_zoomLevel = zoomLevel;
-    updateSizeAndPos(zoomPos);
+    updateScrollBars();
+
+    auto newScrollPos = QPointF(zoomPos) * m_zoomLevel - zoomPosInViewport;
+    moveViewTo(newScrollPos.toPoint());
+    invalidateView();
+}
+
+void PaintbrushCanvas::onSomethingDrawn(const QRect &area) {
+    m_zoomCache.invalidate(area);
+    m_mipPyramid.invalidate(area);
+
+    invalidateView(area.isNull() ? QRect {} : mapToWidget(area));
+}
+
+// band around the outline of a selection, wide enough for its right and bottom edges
+static QRegion selectionOutline(const QRect &widgetRect) {
+    QRegion outline {widgetRect.adjusted(-2, -2, 2, 2)};
+    auto inside = widgetRect.adjusted(2, 2, -2, -2);
+    if (inside.isValid())
+        outline -= inside;
+
+    return outline;
+}
+
+void PaintbrushCanvas::onSelectionMoved(const QRect &oldSelection, const QRect &newSelection) {
+    // the view cache stays valid, only the pixels under the outlines are copied again
+    QRegion dirtyArea;
+    auto transform = documentTransform();
+    if (!oldSelection.isEmpty())
+        dirtyArea += selectionOutline(transform.mapRect(oldSelection));
+    if (!newSelection.isEmpty())
+        dirtyArea += selectionOutline(transform.mapRect(newSelection));
+
+    if (!dirtyArea.isEmpty())
+        viewport()->update(dirtyArea);
+}
+
+void PaintbrushCanvas::invalidateView(const QRect &area) {
+    auto viewArea = area.isNull() ? viewport()->rect() : area.intersected(viewport()->rect());
+    if (viewArea.isEmpty())
+        return;
+
+    m_staleArea += viewArea;
+    viewport()->update(viewArea);
 }
 
-void PaintbrushCanvas::paintEvent(QPaintEvent * _) {
-    paintBackgroundPattern(this);
+void PaintbrushCanvas::paintEvent(QPaintEvent *event) {
+    if (m_viewCache.size() != viewport()->size()) {
+        m_viewCache = QImage {viewport()->size(), QImage::Format_ARGB32_Premultiplied};
+        m_staleArea = QRegion {viewport()->rect()};
+    }
+    // each stale rect on its own, so that two far apart do not bring in everything between them
+    for (auto &rect: m_staleArea)
+        renderView(rect);
+    m_staleArea = QRegion {};
+
+    QPainter painter { viewport() };
+    for (auto &rect: event->region())
+        painter.drawImage(rect.topLeft(), m_viewCache, rect);
 
-    QPainter painter { this };
+    painter.setClipRegion(event->region());
     painter.setRenderHints(QPainter::Antialiasing);
+    m_editor->paintCustomCursor(m_currMousePos, &painter);
+    m_editor->paintCurrentSelection(&painter, documentTransform());
 
-    QTransform transform = QTransform::fromScale(m_zoomLevel, m_zoomLevel);
-    painter.setTransform(transform);
+    if (m_unshownInputTime >= 0) {
+        emit inputLatencyMeasured(m_clock.nsecsElapsed() - m_unshownInputTime);
+        m_unshownInputTime = -1;
+    }
+}
 
-    m_editor->paintCurrentBuffer(&painter);
-    m_editor->performPartialCommand(&painter);
+void PaintbrushCanvas::renderView(const QRect &exposedArea) {
+    QPainter painter { &m_viewCache };
+    painter.setClipRect(exposedArea);
+    painter.fillRect(exposedArea, viewport()->palette().brush(viewport()->backgroundRole()));
 
-    // m_editor->paintCurrentBuffer(this);
-    // m_editor->performCurrentCommand(this);
+    auto documentArea = mapToWidget(QRect {QPoint {0, 0}, m_documentSize}).adjusted(1, 1, -1, -1);
+    paintBackgroundPattern(painter, exposedArea.intersected(documentArea), documentArea.topLeft());
+    painter.setRenderHints(QPainter::Antialiasing);
 
-    transform.reset();
+    // zoomed in, the visible pixels are magnified once and kept, instead of being
+    // transformed by the painter on every paint
+    if (m_zoomLevel > 1.0) {
+        auto &magnified = m_zoomCache.render(m_editor->buffer(), m_zoomLevel, scrollPos(), viewport()->size());
+        painter.drawImage(exposedArea.topLeft(), magnified, exposedArea);
+    }
+
+    auto transform = documentTransform();
     painter.setTransform(transform);
 
-    m_editor->paintCustomCursor(m_currMousePos, this);
-    m_editor->paintCurrentSelection(this);
+    // zoomed out, a level of the pyramid at most twice as large as the view is drawn instead of the buffer
+    int mipLevel = MipPyramid::levelFor(m_zoomLevel, m_documentSize);
+    if (mipLevel > 0) {
+        auto levelArea = MipPyramid::mapToLevel(mapToDocument(exposedArea).intersected(QRect {QPoint {0, 0}, m_documentSize}), mipLevel);
+        auto &levelImage = m_mipPyramid.level(m_editor->buffer(), mipLevel, levelArea);
+
+        painter.save();
+        painter.setRenderHint(QPainter::SmoothPixmapTransform);
+        painter.scale(1 << mipLevel, 1 << mipLevel);
+        levelImage.draw(painter, levelArea);
+        painter.restore();
+
+    } else if (m_zoomLevel <= 1.0) {
+        m_editor->paintCurrentBuffer(&painter, mapToDocument(exposedArea));
+    }
+}
+
+void PaintbrushCanvas::resizeEvent(QResizeEvent *event) {
+    QAbstractScrollArea::resizeEvent(event);
+    updateScrollBars();
+    invalidateView();
+}
+
+void PaintbrushCanvas::scrollContentsBy(int dx, int dy) {
+    invalidateView();
 }
 
 
 void PaintbrushCanvas::mouseMoveEvent(QMouseEvent *event) {
+    // the cursor is repainted where it was and where it is now, from the view cache
+    auto oldCursorRect = m_editor->customCursorRect(m_currMousePos);
     m_currMousePos = event->pos();
-    update();
+    auto newCursorRect = m_editor->customCursorRect(m_currMousePos);
+    auto cursorArea = oldCursorRect | newCursorRect;
+    if (!cursorArea.isNull())
+        viewport()->update(cursorArea);
     
     if (!m_isDragging)
         return;
 
-    QPoint dragEnd = scalePoint(m_currMousePos);
+    // samples falling on the same document pixel add nothing to the stroke
+    auto dragPos = scalePoint(m_currMousePos);
+    if (dragPos == m_dragPath.back())
+        return;
+
+    if (m_dragPath.size() == 1)
+        m_batchStartTime = m_clock.nsecsElapsed();
+    m_dragPath.push_back(dragPos);
+
+    if (!m_frameTimer.isActive())
+        m_frameTimer.start();
+}
+
+void PaintbrushCanvas::flushDragPath() {
+    m_frameTimer.stop();
+    if (m_dragPath.size() < 2)
+        return;
 
-    emit dragContinued(m_dragStart, dragEnd);
+    emit dragContinued(m_dragPath);
 
-    m_dragStart = dragEnd;
+    if (m_unshownInputTime < 0)
+        m_unshownInputTime = m_batchStartTime;
+    m_dragPath = QVector<QPoint> {m_dragPath.back()};
 }
 
 
@@ -82,11 +216,15 @@ void PaintbrushCanvas::mousePressEvent(QMouseEvent *event) {
     if ((!m_isDragging) && (event->button() & Qt::LeftButton)) {
         m_isDragging = true;
         m_dragStart = scalePoint(event->pos());
-        emit dragStarted(event->pos());
+        m_dragPath = QVector<QPoint> {m_dragStart};
+        emit dragStarted(m_dragStart);
     }
 }
 
 void PaintbrushCanvas::mouseReleaseEvent(QMouseEvent *event) {
+    // the end of the stroke must not wait for the next frame
+    flushDragPath();
+
     emit clicked(scalePoint(event->pos()), event->button());
 
     if ((m_isDragging) && (event->button() & Qt::LeftButton)) {
@@ -96,107 +234,92 @@ void PaintbrushCanvas::mouseReleaseEvent(QMouseEvent *event) {
 }
 
 void PaintbrushCanvas::wheelEvent(QWheelEvent *event) {
+    // scrolling is left to the editor, which tells the canvas through onViewMovedBy
     QPoint intPos = QPoint { static_cast<int>(event->position().x()), static_cast<int>(event->position().y()) };
-    emit wheelRolled(intPos, event->angleDelta().y(), event->modifiers());
+    emit wheelRolled(scalePoint(intPos), event->angleDelta().y(), event->modifiers());
 }
 
 
+QPoint PaintbrushCanvas::scrollPos() const {
+    return QPoint { horizontalScrollBar()->value(), verticalScrollBar()->value() };
+}
+
+QTransform PaintbrushCanvas::documentTransform() const {
+    QTransform transform;
+    transform.translate(-scrollPos().x(), -scrollPos().y());
+    transform.scale(m_zoomLevel, m_zoomLevel);
+
+    return transform;
+}
+
 QPoint PaintbrushCanvas::scalePoint(const QPoint &p) const {
     return QPoint {
-        static_cast<int>(floor(p.x()/m_zoomLevel)), 
-        static_cast<int>(floor(p.y()/m_zoomLevel))
+        static_cast<int>(floor((p.x() + horizontalScrollBar()->value()) / m_zoomLevel)), 
+        static_cast<int>(floor((p.y() + verticalScrollBar()->value()) / m_zoomLevel))
     };
 }
 
+QRect PaintbrushCanvas::mapToWidget(const QRect &documentRect) const {
+    auto widgetRect = documentTransform().mapRect(QRectF(documentRect)).toAlignedRect();
 
-QRect PaintbrushCanvas::getVisibleArea() const {
-    auto viewportRect = m_scrollArea->viewport()->rect();
-
-    //QRect visibleRect = mapFromParent(viewportRect.translated(m_scrollArea->viewport()->mapTo(this, QPoint(0, 0))));
-    auto topLeft = mapFromParent(viewportRect.topLeft());
-    auto bottomRight = mapFromParent(viewportRect.bottomRight());
-    auto visibleRect = QRect { topLeft, bottomRight };
-
-    return visibleRect;
+    // antialiased edges can bleed one pixel outside the scaled area
+    return widgetRect.adjusted(-1, -1, 1, 1);
 }
 
-void PaintbrushCanvas::updateSizeAndPos(const QPoint & zoomPos) {
-    auto canvasSize = m_documentSize * m_zoomLevel;
-    std::cout << "PaintbrushCanvas::updateSizeAndPos " << std::endl;
-    std::cout << "setting PaintbrushCanvas size to: " << canvasSize.width() << ", " << canvasSize.height() << std::endl;
-    setFixedSize(canvasSize);
-
-    update();
-    
-    QPoint newCenter;
+QRect PaintbrushCanvas::mapToDocument(const QRect &widgetRect) const {
+    return documentTransform().inverted().mapRect(QRectF(widgetRect)).toAlignedRect();
+}
 
-    if (zoomPos.x() < 0) {
-        newCenter = QPoint { canvasSize.width() / 2, canvasSize.height() / 2 };
-    } else {
-        newCenter = zoomPos + m_zoomLevel * (m_viewCenter - zoomPos);
-        //newCenter = zoomPos / m_zoomLevel + (m_viewCenter - zoomPos);
-    }
 
-    std::cout << "setting newCenter to: " << newCenter.x() << ", " << newCenter.y() << std::endl;
-    moveViewToCenter(newCenter);
+QRect PaintbrushCanvas::getVisibleArea() const {
+    return mapToDocument(viewport()->rect()).intersected(QRect {QPoint {0, 0}, m_documentSize});
 }
 
-void PaintbrushCanvas::moveViewToCenter(const QPoint &newCenter) {
-    auto viewport = m_scrollArea->viewport();
+void PaintbrushCanvas::updateScrollBars() {
+    auto zoomedSize = m_documentSize * m_zoomLevel;
+    auto viewportSize = viewport()->size();
 
-    auto hBar = m_scrollArea->horizontalScrollBar();
-    std::cout << "setting m_scrollArea; hBar->minimum: " << hBar->minimum() << ", hBar->maximum: " << hBar->maximum() << std::endl;
-    auto newHorValue = newCenter.x() - viewport->width()  / 2;
-    newHorValue = std::max(hBar->minimum(), newHorValue);
-    newHorValue = std::min(hBar->maximum(), newHorValue);
-    hBar->setValue(newHorValue);
+    horizontalScrollBar()->setPageStep(viewportSize.width());
+    horizontalScrollBar()->setSingleStep(defaultScrollAmount);
+    horizontalScrollBar()->setRange(0, std::max(0, zoomedSize.width() - viewportSize.width()));
 
-    auto vBar = m_scrollArea->verticalScrollBar();
-    auto newVerValue = newCenter.y() - viewport->height() / 2;
-    newVerValue = std::max(vBar->minimum(), newVerValue);
-    newVerValue = std::min(vBar->maximum(), newVerValue);
-
-    hBar->setValue(newHorValue);
-    vBar->setValue(newVerValue);
-    std::cout << "newHorValue: " << newHorValue << ", newVerValue: " << newVerValue << std::endl;
+    verticalScrollBar()->setPageStep(viewportSize.height());
+    verticalScrollBar()->setSingleStep(defaultScrollAmount);
+    verticalScrollBar()->setRange(0, std::max(0, zoomedSize.height() - viewportSize.height()));
+}
 
-    m_viewCenter = newCenter;
+void PaintbrushCanvas::moveViewTo(const QPoint &scrollPos) {
+    // scrollbars clamp the values to their range
+    horizontalScrollBar()->setValue(scrollPos.x());
+    verticalScrollBar()->setValue(scrollPos.y());
 }
 
 
 void PaintbrushCanvas::onViewMovedBy(QPoint delta) {
-    auto hBar = m_scrollArea->horizontalScrollBar();
-    auto newHorValue = hBar->value() + delta.x();
-    newHorValue = std::max(hBar->minimum(), newHorValue);
-    newHorValue = std::min(hBar->maximum(), newHorValue);
-    hBar->setValue(newHorValue);
-
-    auto vBar = m_scrollArea->verticalScrollBar();
-    auto newVerValue = vBar->value() + delta.y();
-    newVerValue = std::max(vBar->minimum(), newVerValue);
-    newVerValue = std::min(vBar->maximum(), newVerValue);
-    vBar->setValue(newVerValue);
+    moveViewTo(scrollPos() + delta);
 }
 
 
-void paintBackgroundPattern(QWidget * target) {
-    QPainter painter { target };
-
-    for (int xTile=0; xTile < target->width(); xTile++) {
-        for (int yTile=0; yTile < target->height(); yTile++) {
-            QColor color;
-
-            if ((xTile + yTile) % 2 == 0)
-                color = bkgPatternColor1;
-            else
-                color = bkgPatternColor2;
-
-            int tileW = std::min(bkgPatternSize, target->width()  - xTile*bkgPatternSize);
-            int tileH = std::min(bkgPatternSize, target->height() - yTile*bkgPatternSize);
-            auto targetArea = QRect {xTile*bkgPatternSize, yTile*bkgPatternSize, tileW, tileH};
-
-            painter.fillRect(targetArea, color);
-        }
-    }
+// two by two squares of the checkerboard, repeated as a brush texture
+static const QImage & backgroundPatternTile() {
+    // an image, like the view cache it is painted on
+    static QImage tile = []() {
+        QImage image {bkgPatternSize * 2, bkgPatternSize * 2, QImage::Format_ARGB32_Premultiplied};
+        QPainter painter {&image};
+        painter.fillRect(0, 0, bkgPatternSize * 2, bkgPatternSize * 2, bkgPatternColor2);
+        painter.fillRect(0, 0, bkgPatternSize, bkgPatternSize, bkgPatternColor1);
+        painter.fillRect(bkgPatternSize, bkgPatternSize, bkgPatternSize, bkgPatternSize, bkgPatternColor1);
+        painter.end();
+        return image;
+    }();
+
+    return tile;
 }
 
+void paintBackgroundPattern(QPainter &painter, const QRect &area, const QPoint &origin) {
+    painter.save();
+    // the pattern moves along with the document when scrolling
+    painter.setBrushOrigin(origin);
+    painter.fillRect(area, QBrush {backgroundPatternTile()});
+    painter.restore();
+}
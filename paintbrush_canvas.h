@@ -2,33 +2,45 @@
 #define PAINTBRUSH_CANVAS_H
 
 #include "editor.h"
+#include "zoom_cache.h"
+#include "mip_pyramid.h"
 #include "qnamespace.h"
-#include "qscrollarea.h"
 #include "qwidget.h"
 
+#include <QImage>
 #include <QPixmap>
+#include <QRegion>
+#include <QVector>
+#include <QTimer>
+#include <QElapsedTimer>
 #include <QWidget>
+#include <QAbstractScrollArea>
+#include <QTransform>
 #include <QMouseEvent>
 #include <QWheelEvent>
+#include <QResizeEvent>
 
 #include <vector>
 
 
 
-class PaintbrushCanvas : public QWidget
+// Viewport on the document: only the visible part of the buffer is painted,
+// and the scrollbars are driven from the zoomed document size
+class PaintbrushCanvas : public QAbstractScrollArea
 {
 Q_OBJECT
 public:
-    explicit PaintbrushCanvas(QWidget *parent, QScrollArea *scrollArea, Editor *editor);
+    explicit PaintbrushCanvas(QWidget *parent, Editor *editor);
     
 public slots:
     void onDocumentSizeChanged(QSize size);
     void onZoomLevelChanged(double zoomLevel, const QPoint & zoomPos);
-    void onSomethingDrawn() { update(); }
+    void onSomethingDrawn(const QRect &area);
+    void onSelectionMoved(const QRect &oldSelection, const QRect &newSelection);
     void onViewMovedBy(QPoint deltaPx);
+    void flushDragPath();
 
 protected:
-    QScrollArea *m_scrollArea;
     Editor *m_editor;
 
     QSize m_documentSize;
@@ -37,17 +49,40 @@ protected:
     bool m_isDragging { false };
     QPoint m_dragStart;
     QPoint m_currMousePos;
-    QPoint m_viewCenter;
+    // drag samples not passed on yet, after the last one that was
+    QVector<QPoint> m_dragPath;
+    QTimer m_frameTimer;
+    QElapsedTimer m_clock;
+    qint64 m_batchStartTime = -1; //when the oldest sample of m_dragPath came, in ns
+    qint64 m_unshownInputTime = -1; //when the oldest sample not painted yet came, in ns
     double m_zoomLevel;
+    ZoomCache m_zoomCache;
+    MipPyramid m_mipPyramid;
 
-    void updateSizeAndPos(const QPoint & zoomPos);
-    void moveViewToCenter(const QPoint &center);
+    // the document as shown in the viewport, without cursor and selection, which are
+    // painted over it; only its stale parts are rendered again
+    QImage m_viewCache;
+    QRegion m_staleArea;
 
+    void updateScrollBars();
+    void moveViewTo(const QPoint &scrollPos);
+
+    // from document to viewport coordinates
+    QTransform documentTransform() const;
+    QPoint scrollPos() const;
     QPoint scalePoint(const QPoint & p) const;
+    QRect mapToWidget(const QRect & documentRect) const;
+    QRect mapToDocument(const QRect & widgetRect) const;
     QRect getVisibleArea() const;
 
+    // area is in viewport coordinates; a null rect stands for the whole viewport
+    void invalidateView(const QRect &area = QRect {});
+    void renderView(const QRect &area);
+
 
     void paintEvent(QPaintEvent *event) override;
+    void resizeEvent(QResizeEvent *event) override;
+    void scrollContentsBy(int dx, int dy) override;
     void mouseMoveEvent(QMouseEvent *event) override;
     void mousePressEvent(QMouseEvent *event) override;
     void mouseReleaseEvent(QMouseEvent *event) override;
@@ -57,8 +92,11 @@ signals:
     void clicked(QPoint pos, Qt::MouseButton button);
     void dragStarted(QPoint pos);
     void dragEnded(QPoint pos);
-    void dragContinued(const QPoint start, const QPoint end);
+    // path starts at the last point of the previous one
+    void dragContinued(const QVector<QPoint> &path);
     void wheelRolled(const QPoint pos, int delta, QFlags<Qt::KeyboardModifier> modifiers);
+    // from a drag sample being received to it being painted
+    void inputLatencyMeasured(qint64 nsecs);
 };
 
 
@@ -16,9 +16,14 @@
 #include <QVBoxLayout>
 #include <QPushButton>
 #include <QSpinBox>
+#include <QComboBox>
+#include <QListWidget>
+#include <QDockWidget>
+#include <QSignalBlocker>
 #include <QLabel>
 #include <QClipboard>
-#include <QScrollArea>
+#include <QStatusBar>
+#include <QInputDialog>
 
 #include <iostream>
 
@@ -30,17 +35,26 @@ const int documentWidth = 1200;
 const int documentHeight = 800;
 
 
+// message of a failed file operation, with why it failed when that is known
+static QString withReason(const QString &message, const QString &errorString) {
+    if (errorString.isEmpty())
+        return message;
+
+    return message + "\n" + errorString;
+}
+
+
 PaintbrushWindow::PaintbrushWindow() {
     setFixedSize(screenWidth, screenHeight);
 
-    m_scrollArea = new PaintbrushScrollArea(this);
     m_editor = new Editor { documentWidth, documentHeight };
-    m_canvas = new PaintbrushCanvas { this, m_scrollArea, m_editor };
+    m_canvas = new PaintbrushCanvas { this, m_editor };
 
     m_colorChooser = new QColorDialog(this);
 
     initActions();
     initToolSettingsPanel();
+    initLayerPanel();
     initLayout();
 }
 
@@ -92,6 +106,13 @@ void PaintbrushWindow::initActions() {
     m_toolWidthAction = new QAction("Choose Width", this);
     m_toolWidthAction->setToolTip("Choose width");
 
+    auto gaussianBlurAction = new QAction("Gaussian Blur...", this);
+    auto fastGaussianBlurAction = new QAction("Fast Gaussian Blur...", this);
+    auto boxBlurAction = new QAction("Box Blur...", this);
+    auto sharpenAction = new QAction("Sharpen", this);
+    auto embossAction = new QAction("Emboss", this);
+    auto edgeDetectAction = new QAction("Edge Detect", this);
+
     auto toolSelectAction = new QAction("Select", this);
     toolSelectAction->setIcon(QIcon("images/square3d-corner-to-corner.svg"));
     toolSelectAction->setShortcut(QKeySequence("S"));
@@ -100,6 +121,10 @@ void PaintbrushWindow::initActions() {
     toolDrawAction->setIcon(QIcon("images/design-pencil.svg"));
     toolDrawAction->setShortcut(QKeySequence("D"));
 
+    auto toolBrushAction = new QAction("Brush", this);
+    toolBrushAction->setIcon(QIcon("images/brush.svg"));
+    toolBrushAction->setShortcut(QKeySequence("P"));
+
     auto toolFillAction = new QAction("Fill", this);
     toolFillAction->setIcon(QIcon("images/fill-color.svg"));
     toolFillAction->setShortcut(QKeySequence("B"));
@@ -144,6 +169,16 @@ void PaintbrushWindow::initActions() {
     selectMenu->addAction(m_selectAllAction);
     selectMenu->addAction(m_selectNoneAction);    
 
+    auto filterMenu = new QMenu {"Filters", this};
+    menuBar->addMenu(filterMenu);
+
+    filterMenu->addAction(gaussianBlurAction);
+    filterMenu->addAction(fastGaussianBlurAction);
+    filterMenu->addAction(boxBlurAction);
+    filterMenu->addAction(sharpenAction);
+    filterMenu->addAction(embossAction);
+    filterMenu->addAction(edgeDetectAction);
+
     //--------------------------- tool bar ---------------------------
 
     auto toolBar = new QToolBar(this);
@@ -153,6 +188,7 @@ void PaintbrushWindow::initActions() {
 
     toolBar->addAction(toolSelectAction);
     toolBar->addAction(toolDrawAction);
+    toolBar->addAction(toolBrushAction);
     toolBar->addAction(toolFillAction);
     toolBar->addAction(toolEraseAction);
 
@@ -175,9 +211,32 @@ void PaintbrushWindow::initActions() {
     
     connect(m_selectAllAction, &QAction::triggered, m_editor, &Editor::onSelectAll);
     connect(m_selectNoneAction, &QAction::triggered, m_editor, &Editor::onSelectNone);
+
+    connect(gaussianBlurAction, &QAction::triggered, this, [=]() {
+        bool isOk;
+        int radius = QInputDialog::getInt(this, "Gaussian Blur", "Radius", defaultBlurRadius, 1, maxBlurRadius, 1, &isOk);
+        if (isOk)
+            m_editor->onFilterChosen(FilterType::GaussianBlur, radius);
+    });
+    connect(fastGaussianBlurAction, &QAction::triggered, this, [=]() {
+        bool isOk;
+        int radius = QInputDialog::getInt(this, "Fast Gaussian Blur", "Radius", defaultBlurRadius, 1, maxFastBlurRadius, 1, &isOk);
+        if (isOk)
+            m_editor->onBlurChosen(BlurShape::Gaussian, radius);
+    });
+    connect(boxBlurAction, &QAction::triggered, this, [=]() {
+        bool isOk;
+        int radius = QInputDialog::getInt(this, "Box Blur", "Radius", defaultBlurRadius, 1, maxFastBlurRadius, 1, &isOk);
+        if (isOk)
+            m_editor->onBlurChosen(BlurShape::Box, radius);
+    });
+    connect(sharpenAction, &QAction::triggered, this, [=]() { m_editor->onFilterChosen(FilterType::Sharpen, 0); });
+    connect(embossAction, &QAction::triggered, this, [=]() { m_editor->onFilterChosen(FilterType::Emboss, 0); });
+    connect(edgeDetectAction, &QAction::triggered, this, [=]() { m_editor->onFilterChosen(FilterType::EdgeDetect, 0); });
     
     connect(toolSelectAction,       &QAction::triggered, this, [=]() { chooseTool(CommandType::Select); });
     connect(toolDrawAction,         &QAction::triggered, this, [=]() { chooseTool(CommandType::Draw); });
+    connect(toolBrushAction,        &QAction::triggered, this, [=]() { chooseTool(CommandType::Brush); });
     connect(toolFillAction,         &QAction::triggered, this, [=]() { chooseTool(CommandType::Fill); });
     connect(toolEraseAction,        &QAction::triggered, this, [=]() { chooseTool(CommandType::Erase); });
     connect(toolZoomAction,         &QAction::triggered, this, [=]() { chooseTool(CommandType::Zoom); });
@@ -192,10 +251,15 @@ void PaintbrushWindow::initActions() {
     //--------------------- connect slots from editor ---------------------
     connect(m_editor, &Editor::modifiedStatusChanged, this, &PaintbrushWindow::onModifiedStatusChanged);
     connect(m_editor, &Editor::commandStackChanged, this, &PaintbrushWindow::onCommandStackChanged);
+    connect(m_editor, &Editor::historyMemoryChanged, this, &PaintbrushWindow::onHistoryMemoryChanged);
     connect(m_editor, &Editor::selectionChanged, this, &PaintbrushWindow::onSelectionChanged);
 
     //--------------------- connect signals from this ---------------------
     connect(this, &PaintbrushWindow::chooseTool, m_editor, &Editor::onToolChosen);
+    // only the brush can afford very large widths
+    connect(this, &PaintbrushWindow::chooseTool, this, [=](CommandType newCommandType) {
+        m_chooseWidthControl->setMaximum(newCommandType == CommandType::Brush ? maxBrushWidth : maxDrawWidth);
+    });
 
 
     //--------------------- connect signals/slots between other components ---------------------
@@ -203,6 +267,7 @@ void PaintbrushWindow::initActions() {
     connect(m_editor, &Editor::zoomLevelChanged, m_canvas, &PaintbrushCanvas::onZoomLevelChanged);
     connect(m_editor, &Editor::viewMovedBy, m_canvas, &PaintbrushCanvas::onViewMovedBy);
     connect(m_editor, &Editor::somethingDrawn, m_canvas, &PaintbrushCanvas::onSomethingDrawn);
+    connect(m_editor, &Editor::selectionMoved, m_canvas, &PaintbrushCanvas::onSelectionMoved);
     connect(m_editor, &Editor::cursorChanged, m_canvas, &PaintbrushCanvas::setCursor);
 
     connect(m_canvas, &PaintbrushCanvas::clicked, m_editor, &Editor::onClicked);
@@ -210,6 +275,7 @@ void PaintbrushWindow::initActions() {
     connect(m_canvas, &PaintbrushCanvas::dragStarted, m_editor, &Editor::onDragStarted);
     connect(m_canvas, &PaintbrushCanvas::dragEnded, m_editor, &Editor::onDragEnded);
     connect(m_canvas, &PaintbrushCanvas::dragContinued, m_editor, &Editor::onDragContinued);
+    connect(m_canvas, &PaintbrushCanvas::inputLatencyMeasured, this, &PaintbrushWindow::onInputLatencyMeasured);
 }
 
 
@@ -228,25 +294,133 @@ void PaintbrushWindow::initToolSettingsPanel() {
     m_chooseWidthControl->setMinimum(1);
     m_chooseWidthControl->setMaximum(maxDrawWidth);
     connect(m_chooseWidthControl, QOverload<int>::of(&QSpinBox::valueChanged), this, &PaintbrushWindow::onWidthChosen);
+
+    auto toleranceLabel = new QLabel("Tolerance", this);
+
+    m_chooseToleranceControl = new QSpinBox(this);
+    m_chooseToleranceControl->setToolTip("Fill tolerance; right click fills every similar pixel");
+    m_chooseToleranceControl->setMinimum(0);
+    m_chooseToleranceControl->setMaximum(maxFillTolerance);
+    m_chooseToleranceControl->setValue(defaultFillTolerance);
+    connect(m_chooseToleranceControl, QOverload<int>::of(&QSpinBox::valueChanged), this, &PaintbrushWindow::onToleranceChosen);
+
+    auto hardnessLabel = new QLabel("Hardness", this);
+
+    m_chooseHardnessControl = new QSpinBox(this);
+    m_chooseHardnessControl->setToolTip("Brush hardness; lower values fade the edge");
+    m_chooseHardnessControl->setSuffix("%");
+    m_chooseHardnessControl->setMinimum(0);
+    m_chooseHardnessControl->setMaximum(100);
+    m_chooseHardnessControl->setValue(defaultBrushHardness);
+    connect(m_chooseHardnessControl, QOverload<int>::of(&QSpinBox::valueChanged), m_editor, &Editor::onToolHardnessChosen);
+
+    auto spacingLabel = new QLabel("Spacing", this);
+
+    m_chooseSpacingControl = new QSpinBox(this);
+    m_chooseSpacingControl->setToolTip("Distance between brush dabs, relative to the width");
+    m_chooseSpacingControl->setSuffix("%");
+    m_chooseSpacingControl->setMinimum(1);
+    m_chooseSpacingControl->setMaximum(200);
+    m_chooseSpacingControl->setValue(defaultBrushSpacing);
+    connect(m_chooseSpacingControl, QOverload<int>::of(&QSpinBox::valueChanged), m_editor, &Editor::onToolSpacingChosen);
+
+    m_chooseBrushShapeControl = new QComboBox(this);
+    m_chooseBrushShapeControl->setToolTip("Brush shape");
+    m_chooseBrushShapeControl->addItem("Round", static_cast<int>(BrushShape::Round));
+    m_chooseBrushShapeControl->addItem("Elliptical", static_cast<int>(BrushShape::Elliptical));
+    m_chooseBrushShapeControl->addItem("Custom...", static_cast<int>(BrushShape::Custom));
+    connect(m_chooseBrushShapeControl, QOverload<int>::of(&QComboBox::activated), this, &PaintbrushWindow::onBrushShapeChosen);
     
     toolSettingsPanelLayout->addWidget(m_chooseColorButton);
     toolSettingsPanelLayout->addSpacing(1);
     toolSettingsPanelLayout->addWidget(m_widthThumbnail);
     toolSettingsPanelLayout->addWidget(m_chooseWidthControl);
+    toolSettingsPanelLayout->addSpacing(1);
+    toolSettingsPanelLayout->addWidget(toleranceLabel);
+    toolSettingsPanelLayout->addWidget(m_chooseToleranceControl);
+    toolSettingsPanelLayout->addSpacing(1);
+    toolSettingsPanelLayout->addWidget(hardnessLabel);
+    toolSettingsPanelLayout->addWidget(m_chooseHardnessControl);
+    toolSettingsPanelLayout->addWidget(spacingLabel);
+    toolSettingsPanelLayout->addWidget(m_chooseSpacingControl);
+    toolSettingsPanelLayout->addWidget(m_chooseBrushShapeControl);
     toolSettingsPanelLayout->addStretch();
 }
 
+void PaintbrushWindow::initLayerPanel() {
+    auto layerPanel = new QWidget(this);
+    auto layerPanelLayout = new QVBoxLayout(layerPanel);
+
+    m_layerList = new QListWidget(this);
+    m_layerList->setToolTip("Layers, the top one first; unchecked ones are hidden");
+    connect(m_layerList, &QListWidget::currentRowChanged, this, &PaintbrushWindow::onLayerRowChosen);
+    connect(m_layerList, &QListWidget::itemChanged, this, &PaintbrushWindow::onLayerItemChanged);
+
+    auto addLayerButton = new QPushButton("Add", this);
+    m_removeLayerButton = new QPushButton("Remove", this);
+    auto moveLayerUpButton = new QPushButton("Up", this);
+    auto moveLayerDownButton = new QPushButton("Down", this);
+    connect(addLayerButton, &QPushButton::clicked, m_editor, &Editor::onLayerAdded);
+    connect(m_removeLayerButton, &QPushButton::clicked, m_editor, &Editor::onLayerRemoved);
+    connect(moveLayerUpButton, &QPushButton::clicked, m_editor, &Editor::onLayerMovedUp);
+    connect(moveLayerDownButton, &QPushButton::clicked, m_editor, &Editor::onLayerMovedDown);
+
+    auto layerButtonsLayout = new QHBoxLayout();
+    layerButtonsLayout->addWidget(addLayerButton);
+    layerButtonsLayout->addWidget(m_removeLayerButton);
+    layerButtonsLayout->addWidget(moveLayerUpButton);
+    layerButtonsLayout->addWidget(moveLayerDownButton);
+
+    m_chooseLayerOpacityControl = new QSpinBox(this);
+    m_chooseLayerOpacityControl->setToolTip("Layer opacity");
+    m_chooseLayerOpacityControl->setSuffix("%");
+    m_chooseLayerOpacityControl->setMinimum(0);
+    m_chooseLayerOpacityControl->setMaximum(100);
+    // every change is a command, so typed values only count once complete
+    m_chooseLayerOpacityControl->setKeyboardTracking(false);
+    connect(m_chooseLayerOpacityControl, QOverload<int>::of(&QSpinBox::valueChanged), this, &PaintbrushWindow::onLayerOpacityChosen);
+
+    m_chooseBlendModeControl = new QComboBox(this);
+    m_chooseBlendModeControl->setToolTip("Layer blend mode");
+    m_chooseBlendModeControl->addItem("Normal", static_cast<int>(BlendMode::Normal));
+    m_chooseBlendModeControl->addItem("Multiply", static_cast<int>(BlendMode::Multiply));
+    m_chooseBlendModeControl->addItem("Screen", static_cast<int>(BlendMode::Screen));
+    m_chooseBlendModeControl->addItem("Overlay", static_cast<int>(BlendMode::Overlay));
+    m_chooseBlendModeControl->addItem("Darken", static_cast<int>(BlendMode::Darken));
+    m_chooseBlendModeControl->addItem("Lighten", static_cast<int>(BlendMode::Lighten));
+    m_chooseBlendModeControl->addItem("Add", static_cast<int>(BlendMode::Add));
+    m_chooseBlendModeControl->addItem("Difference", static_cast<int>(BlendMode::Difference));
+    m_chooseBlendModeControl->addItem("Erase", static_cast<int>(BlendMode::Erase));
+    connect(m_chooseBlendModeControl, QOverload<int>::of(&QComboBox::activated), this, &PaintbrushWindow::onBlendModeChosen);
+
+    auto layerSettingsLayout = new QHBoxLayout();
+    layerSettingsLayout->addWidget(m_chooseLayerOpacityControl);
+    layerSettingsLayout->addWidget(m_chooseBlendModeControl);
+
+    layerPanelLayout->addWidget(m_layerList);
+    layerPanelLayout->addLayout(layerButtonsLayout);
+    layerPanelLayout->addLayout(layerSettingsLayout);
+
+    auto layerDock = new QDockWidget("Layers", this);
+    layerDock->setFeatures(QDockWidget::DockWidgetMovable);
+    layerDock->setWidget(layerPanel);
+    addDockWidget(Qt::RightDockWidgetArea, layerDock);
+
+    connect(m_editor, &Editor::layersChanged, this, &PaintbrushWindow::onLayersChanged);
+}
+
 void PaintbrushWindow::initLayout() {
     QWidget *centralWidget = new QWidget(this);
     setCentralWidget(centralWidget);
     auto mainLayout = new QVBoxLayout(centralWidget);
 
-    m_scrollArea->setWidget(m_canvas);
-    //scrollArea->setWidgetResizable(true);
-
     mainLayout->addWidget(m_toolSettingsPanel);
-    mainLayout->addWidget(m_scrollArea);
-    //mainLayout->addWidget(m_canvas);
+    mainLayout->addWidget(m_canvas);
+
+    m_historyMemoryLabel = new QLabel(this);
+    statusBar()->addPermanentWidget(m_historyMemoryLabel);
+    m_latencyLabel = new QLabel(this);
+    statusBar()->addPermanentWidget(m_latencyLabel);
     std::cout << "initLayout; m_canvas=" << m_canvas << std::endl;
 }
 
@@ -282,8 +456,9 @@ void PaintbrushWindow::openFile(QString filepath) {
     if (filepath.isEmpty())
         filepath = QFileDialog::getOpenFileName(this, "Open file");
 
-    if (!m_editor->loadFile(filepath)) {
-        QMessageBox::warning(this, "Warning", "Cannot open file " + filepath);
+    QString errorString;
+    if (!m_editor->loadFile(filepath, &errorString)) {
+        QMessageBox::warning(this, "Warning", withReason("Cannot open file " + filepath, errorString));
         return;
     }
 
@@ -312,8 +487,9 @@ void PaintbrushWindow::saveFile(QString filepath) {
     if (filepath.isEmpty())
         return;
 
-    if (!m_editor->saveFile(filepath)) {
-        QMessageBox::warning(this, "Warning", "Cannot save file " + filepath);
+    QString errorString;
+    if (!m_editor->saveFile(filepath, &errorString)) {
+        QMessageBox::warning(this, "Warning", withReason("Cannot save file " + filepath, errorString));
         return;
     }
 
@@ -321,7 +497,7 @@ void PaintbrushWindow::saveFile(QString filepath) {
     m_windowTitle = QFileInfo(filepath).fileName();
     setWindowTitle(m_windowTitle);
 
-    m_canvas->update();
+    m_canvas->viewport()->update();
 }
 
 
@@ -343,6 +519,60 @@ void PaintbrushWindow::onWidthChosen(int width) {
     m_editor->onToolWidthChosen(width);
 }
 
+void PaintbrushWindow::onToleranceChosen(int tolerance) {
+    m_editor->onToolToleranceChosen(tolerance);
+}
+
+void PaintbrushWindow::onBrushShapeChosen(int index) {
+    auto shape = static_cast<BrushShape>(m_chooseBrushShapeControl->itemData(index).toInt());
+    if (shape != BrushShape::Custom) {
+        m_editor->onToolBrushShapeChosen(shape, QImage {});
+        return;
+    }
+
+    auto filepath = QFileDialog::getOpenFileName(this, "Open brush tip");
+    QImage customTip;
+    if (filepath.isEmpty() || !customTip.load(filepath)) {
+        if (!filepath.isEmpty())
+            QMessageBox::warning(this, "Warning", "Cannot open file " + filepath);
+        m_chooseBrushShapeControl->setCurrentIndex(0);
+        m_editor->onToolBrushShapeChosen(BrushShape::Round, QImage {});
+        return;
+    }
+
+    m_editor->onToolBrushShapeChosen(BrushShape::Custom, customTip);
+}
+
+
+void PaintbrushWindow::onLayerRowChosen(int row) {
+    if (row < 0)
+        return;
+
+    m_editor->onLayerChosen(m_editor->layers().count() - 1 - row);
+}
+
+void PaintbrushWindow::onLayerItemChanged(QListWidgetItem *item) {
+    int index = m_editor->layers().count() - 1 - m_layerList->row(item);
+    auto properties = m_editor->layers().layer(index).properties;
+    properties.isVisible = (item->checkState() == Qt::Checked);
+
+    // only the active layer gets new properties
+    m_editor->onLayerChosen(index);
+    m_editor->onLayerPropertiesChosen(properties);
+}
+
+void PaintbrushWindow::onLayerOpacityChosen(int opacity) {
+    auto properties = m_editor->layers().layer(m_editor->activeLayer()).properties;
+    properties.opacity = opacity;
+    m_editor->onLayerPropertiesChosen(properties);
+}
+
+void PaintbrushWindow::onBlendModeChosen(int index) {
+    auto properties = m_editor->layers().layer(m_editor->activeLayer()).properties;
+    properties.blendMode = static_cast<BlendMode>(m_chooseBlendModeControl->itemData(index).toInt());
+    m_editor->onLayerPropertiesChosen(properties);
+}
+
 
 void PaintbrushWindow::onModifiedStatusChanged(bool isDocumentModified) {
     auto fullWindowTitle = m_windowTitle;
@@ -355,9 +585,17 @@ void PaintbrushWindow::onModifiedStatusChanged(bool isDocumentModified) {
     setWindowTitle(fullWindowTitle);
 }
 
-void PaintbrushWindow::onCommandStackChanged(std::vector<std::unique_ptr<Command>> &stack, int currStackPos) {
+void PaintbrushWindow::onCommandStackChanged(int stackSize, int currStackPos) {
     m_undoAction->setEnabled( (currStackPos > 0) );
-    m_redoAction->setEnabled( (currStackPos < (int)stack.size()) );
+    m_redoAction->setEnabled( (currStackPos < stackSize) );
+}
+
+void PaintbrushWindow::onHistoryMemoryChanged(qint64 bytes) {
+    m_historyMemoryLabel->setText(QString("History: %1").arg(locale().formattedDataSize(bytes)));
+}
+
+void PaintbrushWindow::onInputLatencyMeasured(qint64 nsecs) {
+    m_latencyLabel->setText(QString("Latency: %1 ms").arg(nsecs / 1.0e6, 0, 'f', 1));
 }
 
 
@@ -366,6 +604,29 @@ void PaintbrushWindow::onSelectionChanged(bool isSomethingSelected) {
     m_cutAction->setEnabled(isSomethingSelected);
 }
 
+void PaintbrushWindow::onLayersChanged() {
+    auto &layers = m_editor->layers();
+    auto &activeProperties = layers.layer(m_editor->activeLayer()).properties;
+
+    // the controls are only brought up to date, which is not a choice of the user
+    QSignalBlocker listBlocker {m_layerList};
+    QSignalBlocker opacityBlocker {m_chooseLayerOpacityControl};
+    QSignalBlocker blendModeBlocker {m_chooseBlendModeControl};
+
+    m_layerList->clear();
+    for (int i = layers.count() - 1; i >= 0; i--) {
+        auto &properties = layers.layer(i).properties;
+        auto item = new QListWidgetItem(properties.name, m_layerList);
+        item->setFlags(item->flags() | Qt::ItemIsUserCheckable);
+        item->setCheckState(properties.isVisible ? Qt::Checked : Qt::Unchecked);
+    }
+    m_layerList->setCurrentRow(layers.count() - 1 - m_editor->activeLayer());
+
+    m_chooseLayerOpacityControl->setValue(activeProperties.opacity);
+    m_chooseBlendModeControl->setCurrentIndex(m_chooseBlendModeControl->findData(static_cast<int>(activeProperties.blendMode)));
+    m_removeLayerButton->setEnabled(layers.count() > 1);
+}
+
 void PaintbrushWindow::onClipboardChanged(QClipboard::Mode targetMode) {
     if (targetMode == QClipboard::Clipboard)
         m_pasteAction->setEnabled(isClipboardValid());
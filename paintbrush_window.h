@@ -4,7 +4,6 @@
 #include "command.h"
 #include "editor.h"
 #include "paintbrush_canvas.h"
-#include "paintbrush_scroll_area.h"
 
 #include <QColorDialog>
 #include <QMainWindow>
@@ -13,6 +12,8 @@
 #include <QAction>
 #include <QPushButton>
 #include <QSpinBox>
+#include <QComboBox>
+#include <QListWidget>
 #include <QClipboard>
 
 class PaintbrushWindow : public QMainWindow
@@ -25,13 +26,23 @@ public:
 private:
     Editor *m_editor;
     PaintbrushCanvas *m_canvas;
-    PaintbrushScrollArea *m_scrollArea;
 
     QColorDialog *m_colorChooser;
     QWidget *m_toolSettingsPanel;
     QPushButton *m_chooseColorButton;
     QSpinBox *m_chooseWidthControl;
+    QSpinBox *m_chooseToleranceControl;
+    QSpinBox *m_chooseHardnessControl;
+    QSpinBox *m_chooseSpacingControl;
+    QComboBox *m_chooseBrushShapeControl;
     QLabel *m_widthThumbnail;
+    QLabel *m_historyMemoryLabel;
+    QLabel *m_latencyLabel;
+
+    QListWidget *m_layerList; //top layer first
+    QPushButton *m_removeLayerButton;
+    QSpinBox *m_chooseLayerOpacityControl;
+    QComboBox *m_chooseBlendModeControl;
 
     QAction *m_saveAction;
     QAction *m_saveAsAction;
@@ -49,6 +60,7 @@ private:
 
     void initActions();
     void initToolSettingsPanel();
+    void initLayerPanel();
     void initLayout();
     
     void openFile(QString filepath);
@@ -67,11 +79,20 @@ private slots:
 
     void onColorChosen(const QColor & color);
     void onWidthChosen(int width);
+    void onToleranceChosen(int tolerance);
+    void onBrushShapeChosen(int index);
+    void onLayerRowChosen(int row);
+    void onLayerItemChanged(QListWidgetItem *item);
+    void onLayerOpacityChosen(int opacity);
+    void onBlendModeChosen(int index);
 
     //-------- from editor --------
     void onModifiedStatusChanged(bool isDocumentModified);
-    void onCommandStackChanged(std::vector<std::unique_ptr<Command>> &stack, int currStackPos);
+    void onCommandStackChanged(int stackSize, int currStackPos);
+    void onHistoryMemoryChanged(qint64 bytes);
+    void onInputLatencyMeasured(qint64 nsecs);
     void onSelectionChanged(bool isSomethingSelected);
+    void onLayersChanged();
     void onClipboardChanged(QClipboard::Mode targetMode);
 
 signals:
@@ -0,0 +1,82 @@
+#include "pixel_codec.h"
+
+#include <QImage>
+#include <QByteArray>
+
+#include <cstring>
+#include <algorithm>
+
+
+constexpr quint32 runFlag = 0x80000000;
+constexpr quint32 maxTokenLength = 0x7fffffff;
+// shorter runs are cheaper to store as part of a literal
+constexpr qsizetype minRunLength = 3;
+
+
+static inline void appendWord(QByteArray &data, quint32 word) {
+    data.append(reinterpret_cast<const char *>(&word), sizeof(word));
+}
+
+static inline bool isRunStart(const QRgb *pixels, qsizetype i, qsizetype count) {
+    return (i + minRunLength <= count) && (pixels[i] == pixels[i+1]) && (pixels[i] == pixels[i+2]);
+}
+
+
+QByteArray PixelCodec::encode(const QImage &image) {
+    Q_ASSERT(image.depth() == 32);
+
+    // 32-bit scanlines are never padded, so the pixels can be walked as a single array
+    auto pixels = reinterpret_cast<const QRgb *>(image.constBits());
+    const qsizetype count = static_cast<qsizetype>(image.width()) * image.height();
+
+    QByteArray data;
+    qsizetype i = 0;
+    while (i < count) {
+        if (isRunStart(pixels, i, count)) {
+            qsizetype runEnd = i + minRunLength;
+            while (runEnd < count && pixels[runEnd] == pixels[i] && runEnd - i < maxTokenLength)
+                runEnd ++;
+
+            appendWord(data, runFlag | static_cast<quint32>(runEnd - i));
+            appendWord(data, pixels[i]);
+            i = runEnd;
+
+        } else {
+            qsizetype literalEnd = i + 1;
+            while (literalEnd < count && !isRunStart(pixels, literalEnd, count) && literalEnd - i < maxTokenLength)
+                literalEnd ++;
+
+            appendWord(data, static_cast<quint32>(literalEnd - i));
+            data.append(reinterpret_cast<const char *>(pixels + i), (literalEnd - i) * sizeof(QRgb));
+            i = literalEnd;
+        }
+    }
+
+    return data;
+}
+
+QImage PixelCodec::decode(const QByteArray &data, const QSize &size, QImage::Format format) {
+    QImage image {size, format};
+    auto pixels = reinterpret_cast<QRgb *>(image.bits());
+    const qsizetype count = static_cast<qsizetype>(size.width()) * size.height();
+
+    auto words = reinterpret_cast<const quint32 *>(data.constData());
+    const qsizetype nWords = data.size() / sizeof(quint32);
+
+    qsizetype i = 0;
+    qsizetype w = 0;
+    while (w < nWords && i < count) {
+        quint32 control = words[w++];
+        qsizetype length = std::min<qsizetype>(control & maxTokenLength, count - i);
+
+        if (control & runFlag) {
+            std::fill(pixels + i, pixels + i + length, words[w++]);
+        } else {
+            memcpy(pixels + i, words + w, length * sizeof(QRgb));
+            w += (control & maxTokenLength);
+        }
+        i += length;
+    }
+
+    return image;
+}
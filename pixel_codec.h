@@ -0,0 +1,19 @@
+#ifndef PIXEL_CODEC_H
+#define PIXEL_CODEC_H
+
+#include <QImage>
+#include <QByteArray>
+#include <QSize>
+
+
+// Lossless run-length coding of 32-bit images, fast enough to be used on every edit.
+// The stream is made of native-endian 32-bit words: a control word whose top bit marks
+// a run (count, then the repeated pixel) or a literal (count, then count pixels).
+class PixelCodec {
+public:
+    static QByteArray encode(const QImage &image);
+    static QImage decode(const QByteArray &data, const QSize &size, QImage::Format format);
+};
+
+
+#endif // PIXEL_CODEC_H
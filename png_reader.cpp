@@ -0,0 +1,102 @@
+#include "png_reader.h"
+
+#include <QFile>
+#include <QImage>
+
+#include <algorithm>
+#include <csetjmp>
+#include <cstdio>
+#include <vector>
+
+#include <png.h>
+
+
+// libpng gives up on an error by jumping back to readImage, with the message kept for the user
+static void onError(png_structp png, png_const_charp message) {
+    *static_cast<QString *>(png_get_error_ptr(png)) = QString::fromLatin1(message);
+    longjmp(png_jmpbuf(png), 1);
+}
+
+// warnings do not stop the read
+static void onWarning(png_structp, png_const_charp) {}
+
+
+// line of straight RGBA bytes to premultiplied pixels
+static void decodeLine(const uchar *rgba, int width, QRgb *line) {
+    for (int x = 0; x < width; x++, rgba += 4)
+        line[x] = qPremultiply(qRgba(rgba[0], rgba[1], rgba[2], rgba[3]));
+}
+
+// everything the read builds lives in the caller, which the jump back from an error
+// leaves alone; only scalars, which are not used after the jump, are local
+static bool readImage(png_structp png, png_infop info, TiledImage &image, QImage &band,
+                      std::vector<uchar> &row, QString &errorString) {
+    if (setjmp(png_jmpbuf(png)))
+        return false;
+
+    png_read_info(png, info);
+    if (png_get_interlace_type(png, info) != PNG_INTERLACE_NONE) {
+        errorString = "interlaced PNG files this large are not supported";
+        return false;
+    }
+
+    // whatever the file holds, 8 bit RGBA rows
+    png_set_expand(png);
+    png_set_strip_16(png);
+    png_set_gray_to_rgb(png);
+    png_set_add_alpha(png, 0xff, PNG_FILLER_AFTER);
+    png_read_update_info(png, info);
+
+    int width = png_get_image_width(png, info);
+    int height = png_get_image_height(png, info);
+    image = TiledImage {QSize {width, height}};
+    row.resize(png_get_rowbytes(png, info));
+
+    for (int y = 0; y < height; y += TiledImage::tileSize) {
+        band = QImage {width, std::min(TiledImage::tileSize, height - y), QImage::Format_ARGB32_Premultiplied};
+        for (int by = 0; by < band.height(); by++) {
+            png_read_row(png, row.data(), nullptr);
+            decodeLine(row.data(), width, reinterpret_cast<QRgb *>(band.scanLine(by)));
+        }
+
+        image.paste(band, QPoint {0, y});
+    }
+
+    png_read_end(png, nullptr);
+    return true;
+}
+
+
+bool PngReader::load(TiledImage &image, const QString &filename, QString *errorString) {
+    FILE *file = fopen(QFile::encodeName(filename).constData(), "rb");
+    if (file == nullptr) {
+        if (errorString)
+            *errorString = "the file cannot be read";
+        return false;
+    }
+
+    QString message;
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, &message, onError, onWarning);
+    png_infop info = (png != nullptr) ? png_create_info_struct(png) : nullptr;
+
+    TiledImage result;
+    QImage band;
+    std::vector<uchar> row;
+    bool isOk = (info != nullptr);
+    if (isOk) {
+        png_init_io(png, file);
+        isOk = readImage(png, info, result, band, row, message);
+    }
+
+    png_destroy_read_struct(&png, &info, nullptr);
+    fclose(file);
+
+    if (!isOk) {
+        if (errorString)
+            *errorString = message;
+        return false;
+    }
+
+    image = result;
+    return true;
+}
@@ -0,0 +1,20 @@
+#ifndef PNG_READER_H
+#define PNG_READER_H
+
+#include "tiled_image.h"
+
+#include <QString>
+
+
+// Reads a PNG file to a TiledImage one band of tile rows at a time, so that images larger
+// than a QImage can hold are opened too. Interlaced files are refused, as their passes
+// each go over the whole image.
+class PngReader {
+public:
+    // any bit depth and color type; returns false, leaving image alone, on failure,
+    // with the reason in errorString
+    static bool load(TiledImage &image, const QString &filename, QString *errorString);
+};
+
+
+#endif // PNG_READER_H
@@ -0,0 +1,148 @@
+#include "png_writer.h"
+
+#include <QByteArray>
+#include <QImage>
+#include <QSaveFile>
+#include <QtEndian>
+
+#include <algorithm>
+#include <vector>
+
+#include <zlib.h>
+
+
+// deflated data is cut in IDAT chunks of this many bytes
+static constexpr int idatChunkSize = 256 * 1024;
+
+// filter type byte in front of each scanline
+static constexpr uchar subFilter = 1;
+
+
+static void appendUint32(QByteArray &data, quint32 value) {
+    uchar bytes[4];
+    qToBigEndian(value, bytes);
+    data.append(reinterpret_cast<const char *>(bytes), 4);
+}
+
+static bool writeChunk(QSaveFile &file, const char *type, const uchar *data, int size) {
+    QByteArray chunk;
+    chunk.reserve(size + 12);
+    appendUint32(chunk, size);
+    chunk.append(type, 4);
+    chunk.append(reinterpret_cast<const char *>(data), size);
+    // the checksum covers the type and the data, not the length
+    appendUint32(chunk, crc32(0, reinterpret_cast<const Bytef *>(chunk.constData() + 4), size + 4));
+
+    return file.write(chunk) == chunk.size();
+}
+
+
+// zlib stream of the image data, written out as IDAT chunks whenever a chunk is full
+class IdatWriter {
+public:
+    explicit IdatWriter(QSaveFile &file): m_file(file), m_output(idatChunkSize) {
+        m_isOk = (deflateInit(&m_stream, Z_DEFAULT_COMPRESSION) == Z_OK);
+        m_stream.next_out = m_output.data();
+        m_stream.avail_out = idatChunkSize;
+    }
+    ~IdatWriter() { deflateEnd(&m_stream); }
+
+    bool write(const uchar *data, int size) {
+        m_stream.next_in = const_cast<Bytef *>(data);
+        m_stream.avail_in = size;
+        while (m_isOk && m_stream.avail_in > 0)
+            deflateStep(Z_NO_FLUSH);
+
+        return m_isOk;
+    }
+
+    // flushes what zlib still holds, the last chunk being shorter
+    bool finish() {
+        while (m_isOk && deflateStep(Z_FINISH) != Z_STREAM_END) {}
+
+        int size = idatChunkSize - m_stream.avail_out;
+        if (m_isOk && size > 0)
+            m_isOk = writeChunk(m_file, "IDAT", m_output.data(), size);
+
+        return m_isOk;
+    }
+
+private:
+    QSaveFile &m_file;
+    z_stream m_stream {};
+    std::vector<uchar> m_output;
+    bool m_isOk;
+
+    int deflateStep(int flush) {
+        int result = deflate(&m_stream, flush);
+        if (result == Z_STREAM_ERROR) {
+            m_isOk = false;
+            return result;
+        }
+
+        if (m_stream.avail_out == 0) {
+            m_isOk = writeChunk(m_file, "IDAT", m_output.data(), idatChunkSize);
+            m_stream.next_out = m_output.data();
+            m_stream.avail_out = idatChunkSize;
+        }
+
+        return result;
+    }
+};
+
+
+// line of straight RGBA bytes, sub filtered (each byte minus the same byte of the pixel on
+// its left), which compresses better than the bytes themselves on most images
+static void encodeLine(const QRgb *line, int width, uchar *scanline) {
+    scanline[0] = subFilter;
+    uchar *bytes = scanline + 1;
+
+    uchar left[4] {};
+    for (int x = 0; x < width; x++) {
+        QRgb pixel = qUnpremultiply(line[x]);
+        const uchar rgba[4] { (uchar)qRed(pixel), (uchar)qGreen(pixel), (uchar)qBlue(pixel), (uchar)qAlpha(pixel) };
+        for (int c = 0; c < 4; c++) {
+            bytes[x * 4 + c] = rgba[c] - left[c];
+            left[c] = rgba[c];
+        }
+    }
+}
+
+
+bool PngWriter::save(const TiledImage &image, const QString &filename) {
+    if (image.isNull())
+        return false;
+
+    // the file only replaces an existing one once it is complete
+    QSaveFile file {filename};
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+
+    static const char signature[] = "\x89PNG\r\n\x1a\n";
+    if (file.write(signature, 8) != 8)
+        return false;
+
+    QByteArray header;
+    appendUint32(header, image.width());
+    appendUint32(header, image.height());
+    // 8 bits per channel, RGBA, deflate, adaptive filtering, not interlaced
+    header.append("\x08\x06\x00\x00\x00", 5);
+    if (!writeChunk(file, "IHDR", reinterpret_cast<const uchar *>(header.constData()), header.size()))
+        return false;
+
+    IdatWriter idat {file};
+    std::vector<uchar> scanline(1 + static_cast<size_t>(image.width()) * 4);
+    for (int y = 0; y < image.height(); y += TiledImage::tileSize) {
+        auto band = image.copy(QRect {0, y, image.width(), std::min(TiledImage::tileSize, image.height() - y)});
+        for (int by = 0; by < band.height(); by++) {
+            encodeLine(reinterpret_cast<const QRgb *>(band.constScanLine(by)), band.width(), scanline.data());
+            if (!idat.write(scanline.data(), (int)scanline.size()))
+                return false;
+        }
+    }
+
+    if (!idat.finish() || !writeChunk(file, "IEND", nullptr, 0))
+        return false;
+
+    return file.commit();
+}
@@ -0,0 +1,18 @@
+#ifndef PNG_WRITER_H
+#define PNG_WRITER_H
+
+#include "tiled_image.h"
+
+#include <QString>
+
+
+// Writes a TiledImage to a PNG file one band of tile rows at a time, so that the whole
+// image is never held in memory, however many of its tiles are paged out.
+class PngWriter {
+public:
+    // 8 bit straight RGBA; returns false, leaving any existing file alone, on failure
+    static bool save(const TiledImage &image, const QString &filename);
+};
+
+
+#endif // PNG_WRITER_H
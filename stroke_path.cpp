@@ -0,0 +1,147 @@
+#include "stroke_path.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+
+
+static constexpr int maxStep = std::numeric_limits<qint16>::max();
+
+
+// steps too long for 16 bits are cut in equal parts, which stay on the segment
+static void encodeSteps(std::vector<qint16> &steps, const QPoint &from, const QPoint &to) {
+    auto delta = to - from;
+    int parts = (std::max(std::abs(delta.x()), std::abs(delta.y())) + maxStep - 1) / maxStep;
+
+    auto previous = from;
+    for (int i = 1; i <= parts; i++) {
+        auto point = from + QPoint {
+            static_cast<int>(static_cast<qint64>(delta.x()) * i / parts),
+            static_cast<int>(static_cast<qint64>(delta.y()) * i / parts)
+        };
+        steps.push_back(static_cast<qint16>(point.x() - previous.x()));
+        steps.push_back(static_cast<qint16>(point.y() - previous.y()));
+        previous = point;
+    }
+}
+
+
+void StrokePath::append(const QPoint &from, const QPoint &to) {
+    if (m_runs.empty() || from != m_lastPoint) {
+        m_runs.push_back(Run {from, m_steps.size()});
+        m_bounds |= QRect {from, QSize {1, 1}};
+        m_lastPoint = from;
+    }
+
+    encodeSteps(m_steps, m_lastPoint, to);
+    m_lastPoint = to;
+    m_bounds |= QRect {to, QSize {1, 1}};
+}
+
+size_t StrokePath::stepsEnd(size_t run) const {
+    return (run + 1 < m_runs.size()) ? m_runs[run + 1].firstStep : m_steps.size();
+}
+
+QPolygon StrokePath::decodeRun(size_t run) const {
+    auto end = stepsEnd(run);
+    QPolygon polygon;
+    polygon.reserve(1 + static_cast<int>(end - m_runs[run].firstStep) / 2);
+
+    auto point = m_runs[run].origin;
+    polygon.append(point);
+    for (auto i = m_runs[run].firstStep; i < end; i += 2) {
+        point += QPoint {m_steps[i], m_steps[i + 1]};
+        polygon.append(point);
+    }
+
+    return polygon;
+}
+
+
+// distance from p to the segment from a to b; a point beyond either end is measured to
+// that end, so that a stroke doubling back keeps its turning point
+static double segmentDistance(const QPoint &p, const QPoint &a, const QPoint &b) {
+    double dx = b.x() - a.x();
+    double dy = b.y() - a.y();
+    double lengthSquared = dx * dx + dy * dy;
+    if (lengthSquared == 0.0)
+        return std::hypot(p.x() - a.x(), p.y() - a.y());
+
+    double t = ((p.x() - a.x()) * dx + (p.y() - a.y()) * dy) / lengthSquared;
+    t = std::max(0.0, std::min(t, 1.0));
+
+    return std::hypot(p.x() - (a.x() + t * dx), p.y() - (a.y() + t * dy));
+}
+
+void StrokePath::simplify(double tolerance) {
+    if (tolerance <= 0.0)
+        return;
+
+    std::vector<Run> runs;
+    std::vector<qint16> steps;
+    steps.reserve(m_steps.size());
+
+    for (size_t run = 0; run < m_runs.size(); run++) {
+        auto points = decodeRun(run);
+
+        // Ramer-Douglas-Peucker, with an explicit stack since strokes can be long
+        std::vector<bool> isKept(points.size(), false);
+        isKept.front() = true;
+        isKept.back() = true;
+        std::vector<std::pair<int, int>> spans {{0, static_cast<int>(points.size()) - 1}};
+        while (!spans.empty()) {
+            int first = spans.back().first;
+            int last = spans.back().second;
+            spans.pop_back();
+
+            double maxDistance = 0.0;
+            int farthest = -1;
+            for (int i = first + 1; i < last; i++) {
+                auto distance = segmentDistance(points[i], points[first], points[last]);
+                if (distance > maxDistance) {
+                    maxDistance = distance;
+                    farthest = i;
+                }
+            }
+
+            if (farthest >= 0 && maxDistance > tolerance) {
+                isKept[farthest] = true;
+                spans.push_back({first, farthest});
+                spans.push_back({farthest, last});
+            }
+        }
+
+        // dropping points makes steps longer, so they may need splitting again
+        runs.push_back(Run {points.front(), steps.size()});
+        auto previous = points.front();
+        for (int i = 1; i < points.size(); i++) {
+            if (!isKept[i])
+                continue;
+
+            encodeSteps(steps, previous, points[i]);
+            previous = points[i];
+        }
+    }
+
+    steps.shrink_to_fit();
+    runs.shrink_to_fit();
+    m_steps = std::move(steps);
+    m_runs = std::move(runs);
+}
+
+
+void StrokePath::draw(QPainter &painter) const {
+    for (size_t run = 0; run < m_runs.size(); run++) {
+        auto polygon = decodeRun(run);
+        if (polygon.size() > 1)
+            painter.drawPolyline(polygon);
+        else
+            painter.drawPoint(polygon.front());
+    }
+}
+
+
+qint64 StrokePath::memoryUsage() const {
+    return static_cast<qint64>(m_runs.capacity()) * sizeof(Run) + static_cast<qint64>(m_steps.capacity()) * sizeof(qint16);
+}
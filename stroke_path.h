@@ -0,0 +1,49 @@
+#ifndef STROKE_PATH_H
+#define STROKE_PATH_H
+
+#include <QPainter>
+#include <QPoint>
+#include <QPolygon>
+#include <QRect>
+
+#include <vector>
+
+
+// Compact store for the polylines of a stroke: each run keeps its first point, then
+// the 16-bit steps to the following ones. Segments continuing the last run cost one
+// step; longer steps are split along the way.
+class StrokePath {
+public:
+    bool isEmpty() const { return m_runs.empty(); }
+    // bounds of the points, pen width not included
+    QRect bounds() const { return m_bounds; }
+
+    // continues the last run when from is where it ended, starts a new one otherwise
+    void append(const QPoint &from, const QPoint &to);
+    // drops the points closer than tolerance to the segment between the points kept around them
+    void simplify(double tolerance);
+    // one polyline per run, with the current pen
+    void draw(QPainter &painter) const;
+
+    int runCount() const { return static_cast<int>(m_runs.size()); }
+    QPolygon run(int index) const { return decodeRun(index); }
+
+    qint64 memoryUsage() const;
+
+private:
+    struct Run {
+        QPoint origin;
+        size_t firstStep; //index in m_steps
+    };
+
+    std::vector<Run> m_runs;
+    std::vector<qint16> m_steps; //dx, dy pairs
+    QPoint m_lastPoint;
+    QRect m_bounds;
+
+    size_t stepsEnd(size_t run) const;
+    QPolygon decodeRun(size_t run) const;
+};
+
+
+#endif // STROKE_PATH_H
@@ -0,0 +1,146 @@
+#include "blend_kernels.h"
+
+#include <QColor>
+
+#include <cstdio>
+#include <initializer_list>
+#include <vector>
+
+
+// Checks that every SIMD loop the CPU supports gives the same pixels as the scalar
+// loops, over all pairs of source and dest alphas, each with a sample of channels
+// that, over all the pairs, sweeps the whole range of every channel.
+
+static const char *levelNames[] = {"scalar", "SSE2", "SSE4.1", "AVX2"};
+static const BlendMode allModes[] = {
+    BlendMode::Normal, BlendMode::Multiply, BlendMode::Screen, BlendMode::Overlay, BlendMode::Darken,
+    BlendMode::Lighten, BlendMode::Add, BlendMode::Difference, BlendMode::Erase,
+};
+static const int opacities[] = {255, 128, 77, 1};
+// pixels of each alpha pair, on either side
+static constexpr int channelSamples = 24;
+
+static int failureCount = 0;
+
+
+// the levels among candidates that the CPU supports
+static std::vector<SimdLevel> supportedLevels(std::initializer_list<SimdLevel> candidates) {
+    std::vector<SimdLevel> levels;
+    for (auto level: candidates) {
+        if (level <= BlendKernels::supportedLevel())
+            levels.push_back(level);
+    }
+
+    return levels;
+}
+
+// premultiplied pixel of alpha a whose color channels all sweep [0, a] as i grows
+static QRgb premultipliedPixel(int a, int i) {
+    int r = i % (a + 1);
+    int g = (i * 113 + 7) % (a + 1);
+    int b = a - r;
+    return qRgba(r, g, b, a);
+}
+
+// index of the first pixel where actual differs from expected, -1 if none
+static int firstMismatch(const std::vector<QRgb> &expected, const std::vector<QRgb> &actual) {
+    for (size_t i = 0; i < expected.size(); i++) {
+        if (expected[i] != actual[i])
+            return (int)i;
+    }
+
+    return -1;
+}
+
+
+// every source alpha against every dest alpha; for each pair, a sample of the source
+// channels, then one of the dest channels, each going on where the previous pair's stopped
+static void checkComposite(const std::vector<SimdLevel> &levels) {
+    std::vector<QRgb> sources, dests;
+    for (int sourceAlpha = 0; sourceAlpha < 256; sourceAlpha++) {
+        sources.clear();
+        dests.clear();
+        for (int destAlpha = 0; destAlpha < 256; destAlpha++) {
+            for (int i = destAlpha * channelSamples; i < (destAlpha + 1) * channelSamples; i++) {
+                sources.push_back(premultipliedPixel(sourceAlpha, i));
+                dests.push_back(premultipliedPixel(destAlpha, i * 29 + sourceAlpha));
+            }
+            for (int i = sourceAlpha * channelSamples; i < (sourceAlpha + 1) * channelSamples; i++) {
+                sources.push_back(premultipliedPixel(sourceAlpha, i * 31 + destAlpha));
+                dests.push_back(premultipliedPixel(destAlpha, i));
+            }
+        }
+
+        for (auto mode: allModes) {
+            for (int opacity: opacities) {
+                auto expected = dests;
+                BlendKernels::composite(mode, expected.data(), sources.data(), (int)sources.size(), opacity, SimdLevel::Scalar);
+
+                for (auto level: levels) {
+                    auto actual = dests;
+                    BlendKernels::composite(mode, actual.data(), sources.data(), (int)sources.size(), opacity, level);
+
+                    int i = firstMismatch(expected, actual);
+                    if (i < 0)
+                        continue;
+
+                    failureCount ++;
+                    fprintf(stderr, "composite, mode %d, opacity %d, %s: source %08x over %08x gives %08x instead of %08x\n",
+                            (int)mode, opacity, levelNames[(int)level], sources[i], dests[i], actual[i], expected[i]);
+                }
+            }
+        }
+    }
+}
+
+// every color alpha against every dest alpha and every coverage, with the channels
+// of the color and the dest sweeping their range along
+static void checkBlendMasked(const std::vector<SimdLevel> &levels) {
+    std::vector<QRgb> dests;
+    std::vector<uchar> mask;
+    for (int colorAlpha = 0; colorAlpha < 256; colorAlpha++) {
+        dests.clear();
+        mask.clear();
+        for (int destAlpha = 0; destAlpha < 256; destAlpha++) {
+            for (int coverage = 0; coverage < 256; coverage++) {
+                dests.push_back(premultipliedPixel(destAlpha, coverage * 7 + colorAlpha));
+                mask.push_back(coverage);
+            }
+        }
+
+        for (int variant = 0; variant < 4; variant++) {
+            QRgb color = premultipliedPixel(colorAlpha, colorAlpha * 53 + variant * 67);
+
+            auto expected = dests;
+            BlendKernels::blendMasked(expected.data(), mask.data(), (int)mask.size(), color, SimdLevel::Scalar);
+
+            for (auto level: levels) {
+                auto actual = dests;
+                BlendKernels::blendMasked(actual.data(), mask.data(), (int)mask.size(), color, level);
+
+                int i = firstMismatch(expected, actual);
+                if (i < 0)
+                    continue;
+
+                failureCount ++;
+                fprintf(stderr, "blendMasked, %s: color %08x at coverage %d over %08x gives %08x instead of %08x\n",
+                        levelNames[(int)level], color, mask[i], dests[i], actual[i], expected[i]);
+            }
+        }
+    }
+}
+
+
+int main() {
+    // the levels that have loops of their own
+    checkComposite(supportedLevels({SimdLevel::Sse41, SimdLevel::Avx2}));
+    checkBlendMasked(supportedLevels({SimdLevel::Sse2, SimdLevel::Avx2}));
+
+    if (failureCount > 0) {
+        fprintf(stderr, "%d failures\n", failureCount);
+        return 1;
+    }
+
+    printf("checked up to %s\n", levelNames[(int)BlendKernels::supportedLevel()]);
+    return 0;
+}
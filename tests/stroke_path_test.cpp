@@ -0,0 +1,77 @@
+#include "stroke_path.h"
+
+#include <QPoint>
+#include <QPolygon>
+
+#include <algorithm>
+#include <cstdio>
+#include <initializer_list>
+
+
+static int failureCount = 0;
+
+// the points of the only run of path must be expected, in order
+static void checkRun(const char *name, const StrokePath &path, std::initializer_list<QPoint> expected) {
+    bool isOk = (path.runCount() == 1);
+    QPolygon run;
+    if (isOk) {
+        run = path.run(0);
+        isOk = (run.size() == (int)expected.size()) && std::equal(expected.begin(), expected.end(), run.begin());
+    }
+
+    if (isOk)
+        return;
+
+    failureCount ++;
+    fprintf(stderr, "%s: got %d runs, the first one", name, path.runCount());
+    for (auto &point: run)
+        fprintf(stderr, " (%d,%d)", point.x(), point.y());
+    fprintf(stderr, "\n");
+}
+
+static StrokePath makePath(std::initializer_list<QPoint> points) {
+    StrokePath path;
+    auto previous = *points.begin();
+    for (auto it = points.begin() + 1; it != points.end(); ++it) {
+        path.append(previous, *it);
+        previous = *it;
+    }
+
+    return path;
+}
+
+
+int main() {
+    // the turning point lies on the line through the ends, but far outside the segment between them
+    auto doublingBack = makePath({{0, 0}, {100, 0}, {50, 0}});
+    doublingBack.simplify(1.0);
+    checkRun("doubling back", doublingBack, {{0, 0}, {100, 0}, {50, 0}});
+
+    auto zigzag = makePath({{0, 0}, {100, 0}, {0, 1}, {100, 2}});
+    zigzag.simplify(1.0);
+    checkRun("zigzag", zigzag, {{0, 0}, {100, 0}, {0, 1}, {100, 2}});
+
+    auto straight = makePath({{0, 0}, {25, 0}, {50, 0}, {100, 0}});
+    straight.simplify(1.0);
+    checkRun("straight", straight, {{0, 0}, {100, 0}});
+
+    auto jitter = makePath({{0, 0}, {50, 1}, {100, 0}});
+    jitter.simplify(2.0);
+    checkRun("jitter under tolerance", jitter, {{0, 0}, {100, 0}});
+
+    auto bump = makePath({{0, 0}, {50, 1}, {100, 0}});
+    bump.simplify(0.5);
+    checkRun("bump over tolerance", bump, {{0, 0}, {50, 1}, {100, 0}});
+
+    // a single point stays, whatever the tolerance
+    auto dot = makePath({{10, 10}, {10, 10}});
+    dot.simplify(5.0);
+    checkRun("dot", dot, {{10, 10}});
+
+    if (failureCount > 0) {
+        fprintf(stderr, "%d failures\n", failureCount);
+        return 1;
+    }
+
+    return 0;
+}
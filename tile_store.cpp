@@ -0,0 +1,171 @@
+#include "tile_store.h"
+#include "tiled_image.h"
+#include "constants.h"
+
+#include <QDir>
+#include <QMutexLocker>
+
+#include <algorithm>
+#include <cstring>
+
+
+// every slot can hold a full tile, edge tiles use only part of theirs
+static constexpr qint64 slotBytes = static_cast<qint64>(TiledImage::tileSize) * TiledImage::tileSize * sizeof(QRgb);
+static constexpr int minSlotCount = 64;
+
+
+Tile::~Tile() {
+    TileStore::instance().release(*this);
+}
+
+
+TileStore & TileStore::instance() {
+    static TileStore store;
+    return store;
+}
+
+TileStore::TileStore(): m_memoryBudget(defaultTileMemoryBudget), m_file(QDir::tempPath() + "/paintbrush_tiles_XXXXXX") {
+}
+
+TileStore::~TileStore() {
+    if (m_map != nullptr)
+        m_file.unmap(m_map);
+}
+
+
+void TileStore::setMemoryBudget(qint64 bytes) {
+    QMutexLocker locker {&m_mutex};
+    m_memoryBudget = bytes;
+    evict(nullptr);
+}
+
+std::shared_ptr<Tile> TileStore::makeTile(const QImage &image) {
+    QMutexLocker locker {&m_mutex};
+
+    auto tile = std::shared_ptr<Tile> {new Tile {image.size()}};
+    tile->m_image = image;
+    m_residentBytes += tile->sizeInBytes();
+    m_lru.push_front(tile.get());
+    tile->m_lruPos = m_lru.begin();
+
+    evict(tile.get());
+    return tile;
+}
+
+QImage TileStore::read(Tile &tile) {
+    QMutexLocker locker {&m_mutex};
+
+    if (tile.m_image.isNull())
+        pageIn(tile);
+    touch(tile);
+    evict(&tile);
+
+    return tile.m_image;
+}
+
+void TileStore::modify(Tile &tile, const std::function<void(QImage &)> &edit) {
+    QMutexLocker locker {&m_mutex};
+
+    if (tile.m_image.isNull())
+        pageIn(tile);
+    touch(tile);
+
+    // images previously returned by read() keep the old pixels
+    edit(tile.m_image);
+    tile.m_isDirty = true;
+
+    evict(&tile);
+}
+
+
+void TileStore::release(Tile &tile) {
+    QMutexLocker locker {&m_mutex};
+
+    if (!tile.m_image.isNull()) {
+        m_lru.erase(tile.m_lruPos);
+        m_residentBytes -= tile.sizeInBytes();
+    }
+    if (tile.m_slot >= 0)
+        m_freeSlots.push_back(tile.m_slot);
+}
+
+void TileStore::pageIn(Tile &tile) {
+    tile.m_image = QImage {tile.m_size, QImage::Format_ARGB32_Premultiplied};
+
+    const size_t rowBytes = tile.m_size.width() * sizeof(QRgb);
+    auto slot = slotData(tile.m_slot);
+    for (int y = 0; y < tile.m_size.height(); y++)
+        std::memcpy(tile.m_image.scanLine(y), slot + y * rowBytes, rowBytes);
+
+    tile.m_isDirty = false;
+    m_residentBytes += tile.sizeInBytes();
+    m_lru.push_front(&tile);
+    tile.m_lruPos = m_lru.begin();
+}
+
+void TileStore::pageOut(Tile &tile) {
+    // clean tiles already match their slot and are just dropped
+    if (tile.m_isDirty) {
+        const size_t rowBytes = tile.m_size.width() * sizeof(QRgb);
+        auto slot = slotData(tile.m_slot);
+        for (int y = 0; y < tile.m_size.height(); y++)
+            std::memcpy(slot + y * rowBytes, tile.m_image.constScanLine(y), rowBytes);
+        tile.m_isDirty = false;
+    }
+
+    tile.m_image = QImage {};
+    m_residentBytes -= tile.sizeInBytes();
+    m_lru.erase(tile.m_lruPos);
+}
+
+void TileStore::touch(Tile &tile) {
+    m_lru.splice(m_lru.begin(), m_lru, tile.m_lruPos);
+}
+
+void TileStore::evict(const Tile *keep) {
+    while (m_residentBytes > m_memoryBudget && !m_lru.empty()) {
+        auto victim = m_lru.back();
+        if (victim == keep)
+            break;
+
+        if (victim->m_slot < 0) {
+            victim->m_slot = allocateSlot();
+            // without scratch space, tiles just stay in memory
+            if (victim->m_slot < 0)
+                break;
+        }
+        pageOut(*victim);
+    }
+}
+
+int TileStore::allocateSlot() {
+    if (m_freeSlots.empty()) {
+        int newSlotCount = std::max(minSlotCount, m_slotCount * 2);
+
+        if (!m_file.isOpen() && !m_file.open())
+            return -1;
+        if (!m_file.resize(newSlotCount * slotBytes))
+            return -1;
+
+        // the old mapping stays valid until the new one is in place
+        auto newMap = m_file.map(0, newSlotCount * slotBytes);
+        if (newMap == nullptr)
+            return -1;
+        if (m_map != nullptr)
+            m_file.unmap(m_map);
+        m_map = newMap;
+
+        for (int slot = newSlotCount - 1; slot >= m_slotCount; slot--)
+            m_freeSlots.push_back(slot);
+        m_slotCount = newSlotCount;
+    }
+
+    int slot = m_freeSlots.back();
+    m_freeSlots.pop_back();
+
+    return slot;
+}
+
+uchar * TileStore::slotData(int slot) const {
+    return m_map + slot * slotBytes;
+}
@@ -0,0 +1,77 @@
+#ifndef TILE_STORE_H
+#define TILE_STORE_H
+
+#include <QImage>
+#include <QMutex>
+#include <QTemporaryFile>
+
+#include <functional>
+#include <list>
+#include <memory>
+#include <vector>
+
+
+class TileStore;
+
+// Pixels of one tile of a TiledImage, possibly shared by several of them.
+// When paged out, the pixels only live in a slot of the scratch file.
+class Tile {
+public:
+    ~Tile();
+    qint64 sizeInBytes() const { return static_cast<qint64>(m_size.width()) * m_size.height() * sizeof(QRgb); }
+
+private:
+    friend class TileStore;
+    Tile(const QSize &size): m_size(size) {}
+
+    QSize m_size;
+    QImage m_image; //null while paged out
+    int m_slot = -1; //in the scratch file, -1 if none yet
+    bool m_isDirty = true; //differs from its slot
+    std::list<Tile *>::iterator m_lruPos;
+};
+
+
+// Keeps the resident tiles under a memory budget: the least recently used ones are
+// written to a memory-mapped scratch file and read back when next needed.
+// Thread safe; the scratch file is only created once the budget is first exceeded.
+class TileStore {
+public:
+    static TileStore & instance();
+    ~TileStore();
+
+    qint64 memoryBudget() const { return m_memoryBudget; }
+    void setMemoryBudget(qint64 bytes);
+    qint64 residentBytes() const { return m_residentBytes; }
+
+    std::shared_ptr<Tile> makeTile(const QImage &image);
+    // shallow copy of the tile pixels, paged in if needed
+    QImage read(Tile &tile);
+    // edits the tile pixels in place, paged in if needed
+    void modify(Tile &tile, const std::function<void(QImage &)> &edit);
+
+private:
+    friend class Tile;
+    TileStore();
+
+    QMutex m_mutex;
+    qint64 m_memoryBudget;
+    qint64 m_residentBytes = 0;
+    std::list<Tile *> m_lru {}; //resident tiles, most recently used first
+
+    QTemporaryFile m_file;
+    uchar *m_map = nullptr;
+    int m_slotCount = 0;
+    std::vector<int> m_freeSlots {};
+
+    void release(Tile &tile);
+    void pageIn(Tile &tile);
+    void pageOut(Tile &tile);
+    void touch(Tile &tile);
+    void evict(const Tile *keep);
+    int allocateSlot();
+    uchar * slotData(int slot) const;
+};
+
+
+#endif // TILE_STORE_H
@@ -0,0 +1,288 @@
+#include "tiled_image.h"
+#include "tile_store.h"
+#include "png_reader.h"
+#include "png_writer.h"
+#include "jpeg_reader.h"
+
+#include <QFileInfo>
+#include <QImage>
+#include <QImageReader>
+#include <QImageWriter>
+#include <QPainter>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <limits>
+
+
+// images above this are read in bands of tile rows, when their format allows it
+static constexpr qint64 bandedLoadMinPixels = 64 * 1024 * 1024;
+
+// Qt 5 cannot allocate a QImage of more than 2 GB, about 23170x23170 pixels at 32 bits each
+static constexpr qint64 maxImageBytes = std::numeric_limits<int>::max();
+
+static bool fitsInImage(const QSize &size) {
+    return static_cast<qint64>(size.width()) * size.height() * sizeof(QRgb) <= maxImageBytes;
+}
+
+
+static bool isTransparent(const QImage &image, const QRect &area) {
+    for (int y = area.top(); y <= area.bottom(); y++) {
+        auto line = reinterpret_cast<const QRgb *>(image.constScanLine(y));
+        for (int x = area.left(); x <= area.right(); x++) {
+            if (line[x] != 0)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+
+TiledImage::TiledImage(const QSize &size): m_size(size) {
+    m_tilesX = (size.width() + tileSize - 1) / tileSize;
+    m_tilesY = (size.height() + tileSize - 1) / tileSize;
+    m_tiles.resize(m_tilesX * m_tilesY);
+}
+
+TiledImage TiledImage::fromImage(const QImage &image) {
+    TiledImage tiledImage {image.size()};
+    tiledImage.paste(image, QPoint {0, 0});
+
+    return tiledImage;
+}
+
+bool TiledImage::load(const QString &filename, QString *errorString) {
+    QImageReader reader {filename};
+    auto size = reader.size();
+    bool isLarge = size.isValid() && static_cast<qint64>(size.width()) * size.height() >= bandedLoadMinPixels;
+
+    // the whole image never needs to be in memory: each band goes to the tiles,
+    // which the tile store pages out as needed
+    if (isLarge && reader.format() == "png")
+        return PngReader::load(*this, filename, errorString);
+    if (isLarge && reader.format() == "jpeg")
+        return JpegReader::load(*this, filename, errorString);
+
+    // other formats go through a QImage of the whole image
+    if (size.isValid() && !fitsInImage(size)) {
+        if (errorString)
+            *errorString = "images above 2 GB can only be opened from PNG or JPEG files";
+        return false;
+    }
+
+    auto image = reader.read();
+    if (image.isNull()) {
+        if (errorString)
+            *errorString = reader.errorString();
+        return false;
+    }
+
+    *this = fromImage(image);
+    return true;
+}
+
+bool TiledImage::save(const QString &filename, QString *errorString) const {
+    if (QFileInfo {filename}.suffix().compare("png", Qt::CaseInsensitive) == 0)
+        return PngWriter::save(*this, filename);
+
+    // other formats go through a QImage of the whole image
+    if (!fitsInImage(size())) {
+        if (errorString)
+            *errorString = "images above 2 GB can only be saved as PNG";
+        return false;
+    }
+
+    QImageWriter writer {filename};
+    if (!writer.write(toImage())) {
+        if (errorString)
+            *errorString = writer.errorString();
+        return false;
+    }
+
+    return true;
+}
+
+
+QImage TiledImage::copy(const QRect &area) const {
+    QImage result {area.size(), QImage::Format_ARGB32_Premultiplied};
+    result.fill(Qt::transparent);
+
+    auto validArea = area.intersected(rect());
+    if (validArea.isEmpty())
+        return result;
+
+    auto &store = TileStore::instance();
+    for (int ty = validArea.top() / tileSize; ty <= validArea.bottom() / tileSize; ty++) {
+        for (int tx = validArea.left() / tileSize; tx <= validArea.right() / tileSize; tx++) {
+            auto &tile = m_tiles[ty * m_tilesX + tx];
+            if (tile == nullptr)
+                continue;
+
+            auto tileImage = store.read(*tile);
+            auto tileArea = tileRect(tx, ty);
+            auto part = tileArea.intersected(validArea);
+            const size_t rowBytes = part.width() * sizeof(QRgb);
+            for (int y = part.top(); y <= part.bottom(); y++) {
+                auto src = reinterpret_cast<const QRgb *>(tileImage.constScanLine(y - tileArea.y())) + (part.x() - tileArea.x());
+                auto dest = reinterpret_cast<QRgb *>(result.scanLine(y - area.y())) + (part.x() - area.x());
+                std::memcpy(dest, src, rowBytes);
+            }
+        }
+    }
+
+    return result;
+}
+
+void TiledImage::paste(const QImage &image, const QPoint &pos) {
+    auto source = image;
+    if (source.format() != QImage::Format_ARGB32_Premultiplied)
+        source = source.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+
+    auto sourceArea = QRect {pos, source.size()};
+    auto validArea = sourceArea.intersected(rect());
+    if (validArea.isEmpty())
+        return;
+
+    auto &store = TileStore::instance();
+    for (int ty = validArea.top() / tileSize; ty <= validArea.bottom() / tileSize; ty++) {
+        for (int tx = validArea.left() / tileSize; tx <= validArea.right() / tileSize; tx++) {
+            auto &tile = m_tiles[ty * m_tilesX + tx];
+            auto tileArea = tileRect(tx, ty);
+            auto part = tileArea.intersected(validArea);
+            bool isPartTransparent = isTransparent(source, part.translated(-pos));
+
+            if (tile == nullptr) {
+                if (isPartTransparent)
+                    continue;
+                QImage tileImage {tileArea.size(), QImage::Format_ARGB32_Premultiplied};
+                tileImage.fill(Qt::transparent);
+                tile = store.makeTile(tileImage);
+
+            } else if (tile.use_count() > 1) {
+                // copy on write: the other images keep the shared tile
+                tile = store.makeTile(store.read(*tile).copy());
+            }
+
+            bool isTileTransparent = false;
+            store.modify(*tile, [&](QImage &tileImage) {
+                const size_t rowBytes = part.width() * sizeof(QRgb);
+                for (int y = part.top(); y <= part.bottom(); y++) {
+                    auto src = reinterpret_cast<const QRgb *>(source.constScanLine(y - pos.y())) + (part.x() - pos.x());
+                    auto dest = reinterpret_cast<QRgb *>(tileImage.scanLine(y - tileArea.y())) + (part.x() - tileArea.x());
+                    std::memcpy(dest, src, rowBytes);
+                }
+                isTileTransparent = isPartTransparent && isTransparent(tileImage, tileImage.rect());
+            });
+
+            if (isTileTransparent)
+                tile.reset();
+        }
+    }
+}
+
+void TiledImage::draw(QPainter &painter, const QRect &area) const {
+    auto validArea = area.intersected(rect());
+    if (validArea.isEmpty())
+        return;
+
+    // antialiased tile edges would show seams when scaled
+    painter.save();
+    painter.setRenderHint(QPainter::Antialiasing, false);
+
+    auto &store = TileStore::instance();
+    for (int ty = validArea.top() / tileSize; ty <= validArea.bottom() / tileSize; ty++) {
+        for (int tx = validArea.left() / tileSize; tx <= validArea.right() / tileSize; tx++) {
+            auto &tile = m_tiles[ty * m_tilesX + tx];
+            if (tile == nullptr)
+                continue;
+
+            auto tileArea = tileRect(tx, ty);
+            auto part = tileArea.intersected(validArea);
+            painter.drawImage(part.topLeft(), store.read(*tile), part.translated(-tileArea.topLeft()));
+        }
+    }
+
+    painter.restore();
+}
+
+void TiledImage::composite(QImage &target, const QRect &area, BlendMode mode, int opacity) const {
+    assert(target.format() == QImage::Format_ARGB32_Premultiplied && target.size() == area.size());
+
+    auto validArea = area.intersected(rect());
+    if (validArea.isEmpty())
+        return;
+
+    auto &store = TileStore::instance();
+    for (int ty = validArea.top() / tileSize; ty <= validArea.bottom() / tileSize; ty++) {
+        for (int tx = validArea.left() / tileSize; tx <= validArea.right() / tileSize; tx++) {
+            auto &tile = m_tiles[ty * m_tilesX + tx];
+            if (tile == nullptr)
+                continue;
+
+            auto tileImage = store.read(*tile);
+            auto tileArea = tileRect(tx, ty);
+            auto part = tileArea.intersected(validArea);
+            for (int y = part.top(); y <= part.bottom(); y++) {
+                auto src = reinterpret_cast<const QRgb *>(tileImage.constScanLine(y - tileArea.y())) + (part.x() - tileArea.x());
+                auto dest = reinterpret_cast<QRgb *>(target.scanLine(y - area.y())) + (part.x() - area.x());
+                BlendKernels::composite(mode, dest, src, part.width(), opacity);
+            }
+        }
+    }
+}
+
+
+QRgb TiledImage::pixel(const QPoint &pos) const {
+    auto tileImage = this->tileImage(pos.x() / tileSize, pos.y() / tileSize);
+    if (tileImage.isNull())
+        return 0;
+
+    return reinterpret_cast<const QRgb *>(tileImage.constScanLine(pos.y() % tileSize))[pos.x() % tileSize];
+}
+
+QImage TiledImage::tileImage(int tx, int ty) const {
+    auto &tile = m_tiles[ty * m_tilesX + tx];
+    if (tile == nullptr)
+        return QImage {};
+
+    return TileStore::instance().read(*tile);
+}
+
+void TiledImage::setTileImage(int tx, int ty, const QImage &image) {
+    assert(image.size() == tileRect(tx, ty).size() && image.format() == QImage::Format_ARGB32_Premultiplied);
+
+    // the tile is replaced rather than modified, which leaves it to the images sharing it
+    auto &tile = m_tiles[ty * m_tilesX + tx];
+    if (isTransparent(image, image.rect()))
+        tile.reset();
+    else
+        tile = TileStore::instance().makeTile(image);
+}
+
+
+qint64 TiledImage::memoryUsage() const {
+    qint64 usage = 0;
+    for (auto &tile: m_tiles) {
+        if (tile != nullptr)
+            usage += tile->sizeInBytes();
+    }
+
+    return usage;
+}
+
+qint64 TiledImage::memoryUsage(std::unordered_set<const Tile *> &countedTiles) const {
+    qint64 usage = 0;
+    for (auto &tile: m_tiles) {
+        if (tile != nullptr && countedTiles.insert(tile.get()).second)
+            usage += tile->sizeInBytes();
+    }
+
+    return usage;
+}
+
+
+QRect TiledImage::tileRect(int tx, int ty) const {
+    return QRect {tx * tileSize, ty * tileSize, tileSize, tileSize}.intersected(rect());
+}
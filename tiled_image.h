@@ -0,0 +1,80 @@
+#ifndef TILED_IMAGE_H
+#define TILED_IMAGE_H
+
+#include "tile_store.h"
+#include "blend_kernels.h"
+
+#include <QImage>
+#include <QPainter>
+#include <QString>
+#include <QPoint>
+#include <QRect>
+#include <QSize>
+
+#include <memory>
+#include <unordered_set>
+#include <vector>
+
+
+// Premultiplied ARGB image stored as a grid of tiles. Fully transparent tiles are not
+// allocated. Tiles are shared between copies of a TiledImage, and only the tiles written
+// afterwards are duplicated. Tiles live in the TileStore, which may page them out to disk.
+class TiledImage {
+public:
+    static constexpr int tileSize = 256;
+
+    TiledImage() {}
+    // fully transparent
+    explicit TiledImage(const QSize &size);
+    static TiledImage fromImage(const QImage &image);
+    // large PNG and JPEG files are read a band at a time; other formats must fit in a
+    // QImage. On failure, the reason goes to errorString when given
+    bool load(const QString &filename, QString *errorString = nullptr);
+    // the format is told by the suffix of filename; PNG files are written a band at a
+    // time, other formats must fit in a QImage
+    bool save(const QString &filename, QString *errorString = nullptr) const;
+
+    bool isNull() const { return m_size.isEmpty(); }
+    QSize size() const { return m_size; }
+    QRect rect() const { return QRect {QPoint {0, 0}, m_size}; }
+    int width() const { return m_size.width(); }
+    int height() const { return m_size.height(); }
+
+    QImage toImage() const { return copy(rect()); }
+    // area may extend past the image, where it reads as transparent
+    QImage copy(const QRect &area) const;
+    // replaces the pixels under image, placed at pos, with those of image
+    void paste(const QImage &image, const QPoint &pos);
+    // paints area of the image at its own coordinates
+    void draw(QPainter &painter, const QRect &area) const;
+    // blends area of the image onto target, a premultiplied image holding area, with
+    // opacity from 0 to 255; transparent tiles are skipped
+    void composite(QImage &target, const QRect &area, BlendMode mode, int opacity = 255) const;
+
+    // pixel at pos, which must be inside the image
+    QRgb pixel(const QPoint &pos) const;
+
+    int tilesX() const { return m_tilesX; }
+    int tilesY() const { return m_tilesY; }
+    // area of tile (tx, ty), smaller than tileSize along the right and bottom edges
+    QRect tileRect(int tx, int ty) const;
+    // shallow copy of the pixels of tile (tx, ty), null when the tile is fully transparent
+    QImage tileImage(int tx, int ty) const;
+    // replaces the pixels of tile (tx, ty) with image, of the size of the tile; the tiles
+    // shared with other images are left to them. Different tiles can be set concurrently.
+    void setTileImage(int tx, int ty, const QImage &image);
+
+    // bytes of the allocated tiles, shared or not, in memory or not
+    qint64 memoryUsage() const;
+    // bytes of the allocated tiles not in countedTiles yet, which are then added to it
+    qint64 memoryUsage(std::unordered_set<const Tile *> &countedTiles) const;
+
+private:
+    QSize m_size;
+    int m_tilesX = 0;
+    int m_tilesY = 0;
+    std::vector<std::shared_ptr<Tile>> m_tiles; //null for fully transparent tiles
+};
+
+
+#endif // TILED_IMAGE_H
@@ -14,6 +14,7 @@ ToolConfig::ToolConfig() {
     for (auto cmdType: {
         CommandType::Select,
         CommandType::Draw,
+        CommandType::Brush,
         CommandType::Fill,
         CommandType::Erase,
         CommandType::Scroll,
@@ -30,6 +31,9 @@ ToolConfig::ToolConfig() {
             case Draw: 
                 cmdConfig = new CommandDraw {Qt::black, defaultDrawWidth };
                 break;
+            case Brush:
+                cmdConfig = new CommandBrush {Qt::black, defaultDrawWidth };
+                break;
             case Fill:
                 cmdConfig = new CommandFill {Qt::black, QPoint{} };
                 break;
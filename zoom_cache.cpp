@@ -0,0 +1,104 @@
+#include "zoom_cache.h"
+
+#include <QImage>
+#include <QRectF>
+
+#include <cmath>
+#include <cstring>
+
+
+// source index of each of count destination pixels, starting at offset in zoomed coordinates
+static std::vector<int> nearestLookup(int count, int offset, double zoomLevel, int sourceSize) {
+    std::vector<int> lookup(count);
+    for (int i = 0; i < count; i++) {
+        int source = static_cast<int>(std::floor((i + offset) / zoomLevel));
+        lookup[i] = (source >= 0 && source < sourceSize) ? source : -1;
+    }
+
+    return lookup;
+}
+
+
+const QImage & ZoomCache::render(const TiledImage &buffer, double zoomLevel, const QPoint &scrollPos, const QSize &viewportSize) {
+    bool isStale = (zoomLevel != m_zoomLevel) || (scrollPos != m_scrollPos) || (viewportSize != m_image.size())
+        || (buffer.size() != m_documentSize);
+    if (isStale) {
+        m_zoomLevel = zoomLevel;
+        m_scrollPos = scrollPos;
+        m_documentSize = buffer.size();
+        m_image = QImage {viewportSize, QImage::Format_ARGB32_Premultiplied};
+        buildLookup();
+        m_dirtyArea = m_image.rect();
+    }
+
+    if (!m_dirtyArea.isEmpty()) {
+        renderArea(buffer, m_dirtyArea);
+        m_dirtyArea = QRect {};
+    }
+
+    return m_image;
+}
+
+void ZoomCache::invalidate(const QRect &documentArea) {
+    if (documentArea.isNull() || m_image.isNull()) {
+        m_dirtyArea = m_image.rect();
+        return;
+    }
+
+    QRectF zoomedArea { documentArea.x() * m_zoomLevel, documentArea.y() * m_zoomLevel,
+        documentArea.width() * m_zoomLevel, documentArea.height() * m_zoomLevel };
+    auto viewportArea = zoomedArea.translated(-m_scrollPos).toAlignedRect();
+    m_dirtyArea |= viewportArea.intersected(m_image.rect());
+}
+
+
+void ZoomCache::buildLookup() {
+    m_sourceColumns = nearestLookup(m_image.width(), m_scrollPos.x(), m_zoomLevel, m_documentSize.width());
+    m_sourceRows = nearestLookup(m_image.height(), m_scrollPos.y(), m_zoomLevel, m_documentSize.height());
+}
+
+void ZoomCache::renderArea(const TiledImage &buffer, const QRect &area) {
+    // only the source pixels that end up in area are read from the buffer
+    int firstColumn = m_documentSize.width(), lastColumn = -1;
+    for (int x = area.left(); x <= area.right(); x++) {
+        if (m_sourceColumns[x] < 0)
+            continue;
+        firstColumn = std::min(firstColumn, m_sourceColumns[x]);
+        lastColumn = std::max(lastColumn, m_sourceColumns[x]);
+    }
+    int firstRow = m_documentSize.height(), lastRow = -1;
+    for (int y = area.top(); y <= area.bottom(); y++) {
+        if (m_sourceRows[y] < 0)
+            continue;
+        firstRow = std::min(firstRow, m_sourceRows[y]);
+        lastRow = std::max(lastRow, m_sourceRows[y]);
+    }
+
+    QImage source;
+    if (lastColumn >= 0 && lastRow >= 0) {
+        source = buffer.copy(QRect {QPoint {firstColumn, firstRow}, QPoint {lastColumn, lastRow}});
+    }
+
+    const size_t rowBytes = area.width() * sizeof(QRgb);
+    for (int y = area.top(); y <= area.bottom(); y++) {
+        auto line = reinterpret_cast<QRgb *>(m_image.scanLine(y)) + area.left();
+        int sourceRow = m_sourceRows[y];
+
+        if (sourceRow < 0 || source.isNull()) {
+            std::memset(line, 0, rowBytes);
+            continue;
+        }
+
+        // magnified rows repeat: whole rows are copied until the source row changes
+        if (y > area.top() && sourceRow == m_sourceRows[y - 1]) {
+            std::memcpy(line, reinterpret_cast<const QRgb *>(m_image.constScanLine(y - 1)) + area.left(), rowBytes);
+            continue;
+        }
+
+        auto sourceLine = reinterpret_cast<const QRgb *>(source.constScanLine(sourceRow - firstRow));
+        for (int x = area.left(); x <= area.right(); x++) {
+            int sourceColumn = m_sourceColumns[x];
+            *line++ = (sourceColumn < 0) ? 0 : sourceLine[sourceColumn - firstColumn];
+        }
+    }
+}
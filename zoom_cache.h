@@ -0,0 +1,40 @@
+#ifndef ZOOM_CACHE_H
+#define ZOOM_CACHE_H
+
+#include "tiled_image.h"
+
+#include <QImage>
+#include <QPoint>
+#include <QRect>
+#include <QSize>
+
+#include <vector>
+
+
+// Nearest-neighbour magnification of the visible part of the buffer, for zoom levels above 1.
+// The magnified image is viewport-sized and kept until the zoom level or the scroll position
+// changes; buffer changes only re-render the part of it they cover.
+class ZoomCache {
+public:
+    // scrollPos is the viewport origin in zoomed document coordinates
+    const QImage & render(const TiledImage &buffer, double zoomLevel, const QPoint &scrollPos, const QSize &viewportSize);
+    // area is in document coordinates; a null rect stands for the whole document
+    void invalidate(const QRect &documentArea = QRect {});
+
+private:
+    QImage m_image;
+    QSize m_documentSize;
+    double m_zoomLevel = 0.0;
+    QPoint m_scrollPos;
+    QRect m_dirtyArea; //in viewport coordinates
+
+    // source column and row of each viewport pixel, -1 outside the document
+    std::vector<int> m_sourceColumns;
+    std::vector<int> m_sourceRows;
+
+    void buildLookup();
+    void renderArea(const TiledImage &buffer, const QRect &area);
+};
+
+
+#endif // ZOOM_CACHE_H